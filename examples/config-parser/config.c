@@ -67,9 +67,10 @@ static int cb_text(struct List *list, struct LOP_ASTNode *n, int delta)
 	return 0;
 }
 
-static int resolve(struct List *list, struct LOP_Handler *h)
+typedef int (*cb_t)(struct List *list, struct LOP_ASTNode *n, int delta);
+
+static void bind(struct LOP_Schema *schema)
 {
-	typedef int (*cb_t)(struct List *list, struct LOP_ASTNode *n, int delta);
 	static struct {
 		const char *key;
 		cb_t handler;
@@ -83,11 +84,43 @@ static int resolve(struct List *list, struct LOP_Handler *h)
 	};
 
 	for (int i = 0; entries[i].handler; i++) {
-		if (!strcmp(h->key, entries[i].key)) {
-			return entries[i].handler(list, h->n, h->delta);
-		}
+		LOP_schema_bind(schema, entries[i].key, entries[i].handler);
+	}
+}
+
+static int resolve(void *ctx, const struct LOP_HandlerList *hl, int i)
+{
+	cb_t cb = hl->ct->data[LOP_handler_id(hl, i)].fn;
+
+	if (!cb) {
+		return -1;
 	}
-	return -1;
+	return cb(ctx, LOP_handler_node(hl, i), LOP_handler_delta(hl, i));
+}
+
+/* Every item is built into a list of its own on one of the threads */
+static void *item_begin(void *arg, const struct LOP_HandlerList *hl, int i, int depth)
+{
+	struct List *list = calloc(1, sizeof(*list));
+
+	assert(list);
+	return list;
+}
+
+/* And they are moved to the main list in order */
+static int item_merge(void *arg, void *ctx, int rc)
+{
+	struct List *list = arg;
+	struct List *item = ctx;
+
+	list->item = realloc(list->item, (list->count + item->count) * sizeof(*list->item));
+	assert(list->item);
+	memcpy(&list->item[list->count], item->item, item->count * sizeof(*item->item));
+	list->count += item->count;
+
+	free(item->item);
+	free(item);
+	return rc;
 }
 
 int main(int argc, char *argv[])
@@ -104,18 +137,26 @@ int main(int argc, char *argv[])
 			.schema = &schema,
 			.top_rule_name = argv[3],
 			.filename = argv[2],
+			/* Long lists make a lot of handlers, keep them small */
+			.compact = true,
+			/* The next token always tells which SN takes it, so no AST is needed */
+			.direct = true,
 		};
 
-		LOP_init(&lop, source.data, source.len);
+		bind(&schema);
 
-		struct LOP_HandlerList *hl = &lop.hl;
-
-		for (int i = 0; i < hl->count; i++) {
-			struct LOP_Handler *h = &hl->handler[i];
+		static const char *const tasks[] = { "item", NULL };
+		struct LOP_Dispatch d = {
+			.handler = resolve,
+			.task = tasks,
+			.arg = &list,
+			.threads = 4,
+			.task_begin = item_begin,
+			.task_merge = item_merge,
+		};
 
-			if (resolve(&list, h)) {
-				break;
-			}
+		if (!LOP_init(&lop, source.data, source.len)) {
+			LOP_dispatch(&lop.hl, &d);
 		}
 
 		LOP_deinit(&lop);
@@ -8,6 +8,7 @@
 
 typedef int (*cb_t)(struct LOP_ASTNode *n, int delta);
 
+static struct LOP_CallbackTable *ct;
 static struct LOP_HandlerList *hl;
 static int hl_index;
 
@@ -127,7 +128,7 @@ static int cb_if(struct LOP_ASTNode *n, int delta)
 	return 0;
 }
 
-static cb_t resolve(int index)
+static void bind(struct LOP_Schema *schema)
 {
 	static struct {
 		const char *key;
@@ -143,11 +144,13 @@ static cb_t resolve(int index)
 	};
 
 	for (int i = 0; i < ARRAY_SIZE(entries); i++) {
-		if (!strcmp(hl->handler[index].key, entries[i].key)) {
-			return entries[i].handler;
-		}
+		LOP_schema_bind(schema, entries[i].key, entries[i].handler);
 	}
-	return NULL;
+}
+
+static cb_t resolve(int index)
+{
+	return ct->data[hl->handler[index].id].fn;
 }
 
 int main(int argc, char *argv[])
@@ -165,6 +168,9 @@ int main(int argc, char *argv[])
 			.filename = argv[2],
 		};
 
+		bind(&schema);
+		ct = &schema.callback_table;
+
 		LOP_init(&lop, source.data, source.len);
 
 		hl = &lop.hl;
@@ -8,19 +8,21 @@
 
 typedef int (*cb_t)(struct LOP_ASTNode *n, int delta);
 
+static struct LOP_CallbackTable *ct;
 static struct LOP_HandlerList *hl;
 static int hl_index;
 
 static cb_t resolve(int index);
+static int cb_attr_separator(struct LOP_ASTNode *n, int delta);
 static int level;
 
-static int handler_is(const char *key)
+static int handler_is(cb_t cb)
 {
 	if (hl_index >= hl->count) {
 		return 0;
 	}
 
-	return strcmp(hl->handler[hl_index].key, key) == 0;
+	return resolve(hl_index) == cb;
 }
 
 static int node_inside(void)
@@ -92,7 +94,7 @@ static int cb_html(struct LOP_ASTNode *n, int delta)
 {
 	printf("<html");
 
-	if (handler_is("attr_separator")) {
+	if (handler_is(cb_attr_separator)) {
 		eval_node();
 	}
 	if (node_inside()) {
@@ -120,7 +122,7 @@ static int cb_node(struct LOP_ASTNode *n, int delta)
 
 	eval_node();
 
-	if (handler_is("attr_separator")) {
+	if (handler_is(cb_attr_separator)) {
 		eval_node();
 	}
 	if (node_inside()) {
@@ -184,7 +186,7 @@ static int cb_iprintln(struct LOP_ASTNode *n, int delta)
 	return 0;
 }
 
-static cb_t resolve(int index)
+static void bind(struct LOP_Schema *schema)
 {
 	static struct {
 		const char *key;
@@ -199,11 +201,13 @@ static cb_t resolve(int index)
 	};
 
 	for (int i = 0; i < ARRAY_SIZE(entries); i++) {
-		if (!strcmp(hl->handler[index].key, entries[i].key)) {
-			return entries[i].handler;
-		}
+		LOP_schema_bind(schema, entries[i].key, entries[i].handler);
 	}
-	return NULL;
+}
+
+static cb_t resolve(int index)
+{
+	return ct->data[hl->handler[index].id].fn;
 }
 
 int main(int argc, char *argv[])
@@ -221,6 +225,9 @@ int main(int argc, char *argv[])
 			.filename = argv[2],
 		};
 
+		bind(&schema);
+		ct = &schema.callback_table;
+
 		LOP_init(&lop, source.data, source.len);
 
 		hl = &lop.hl;
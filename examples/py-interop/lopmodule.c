@@ -0,0 +1,607 @@
+/* The lop Python module: the match runs in C and the whole handler list comes back at once.
+ *
+ *	schema = lop.Schema(src, 'schema.lop')
+ *	hl = schema.parse(data, 'top', 'example.lop')
+ *	memoryview(hl)		# (len(hl), 4) int32: callback ID, node type, delta, symbol offset
+ *	hl.pool			# the symbols, NUL terminated, by the offsets, -1 is none
+ *	hl.dispatch(table, arg)	# table[ID](arg, symbol, delta) in order
+ *	hl.group()		# the handler indices of every callback ID
+ *	hl.batch(table, arg)	# table[ID](arg, hl, indices) once for every callback ID
+ *
+ * LOP's lexer keeps its state in globals, so the GIL is held during the match */
+
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <LOP.h>
+
+enum {
+	H_ID,
+	H_TYPE,
+	H_DELTA,
+	H_SYMBOL,
+	H_FIELDS,
+};
+
+static PyObject *LopError;
+
+typedef struct {
+	PyObject_HEAD
+	struct LOP_Schema schema;
+	bool init;
+	/* Copies of the source and the name the schema may point into, and the callback names by ID */
+	PyObject *src;
+	PyObject *filename;
+	PyObject *callbacks;
+} SchemaObject;
+
+typedef struct {
+	PyObject_HEAD
+	int32_t (*h)[H_FIELDS];
+	Py_ssize_t count;
+	/* count, H_FIELDS */
+	Py_ssize_t shape[2];
+	PyObject *pool;
+	PyObject *callbacks;
+} HandlersObject;
+
+static PyTypeObject HandlersType;
+
+/* lop.Error('<file>:<line>:<char>: <what>', rc, file, line, char), the error has no location if line is 0 */
+static PyObject *lop_error(int rc, const struct LOP *lop)
+{
+	struct LOP_Location loc = lop->error;
+	PyObject *msg;
+	PyObject *args;
+
+	if (rc == LOP_ERROR_SCHEMA_MISSING_TOP) {
+		msg = PyUnicode_FromFormat("%s: %s: '%s'", lop->filename, LOP_strerror(rc), lop->top_rule_name);
+	} else if (loc.lineno == 0) {
+		msg = PyUnicode_FromFormat("%s: %s", lop->filename, LOP_strerror(rc));
+	} else {
+		msg = PyUnicode_FromFormat("%s:%d:%d: %s", lop->filename, loc.lineno, loc.charno + 1, LOP_strerror(rc));
+	}
+	args = Py_BuildValue("(Nisii)", msg, rc, lop->filename, loc.lineno, loc.charno + 1);
+
+	if (args) {
+		PyErr_SetObject(LopError, args);
+		Py_DECREF(args);
+	}
+	return NULL;
+}
+
+static int schema_init(SchemaObject *self, PyObject *args, PyObject *kwds)
+{
+	static char *kwlist[] = { "src", "filename", NULL };
+	const char *src;
+	Py_ssize_t len;
+	const char *filename = "<schema>";
+	int rc;
+
+	if (self->init) {
+		PyErr_SetString(PyExc_RuntimeError, "Schema is initialized already");
+		return -1;
+	}
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "s#|s", kwlist, &src, &len, &filename)) {
+		return -1;
+	}
+
+	/* LOP_Schema keeps the pointers */
+	self->src = PyBytes_FromStringAndSize(src, len);
+	self->filename = PyBytes_FromString(filename);
+	if (!self->src || !self->filename) {
+		return -1;
+	}
+	self->schema.filename = PyBytes_AS_STRING(self->filename);
+
+	rc = LOP_schema_init(&self->schema, PyBytes_AS_STRING(self->src), len);
+	if (rc) {
+		PyObject *e = Py_BuildValue("(Ni)", PyUnicode_FromFormat("%s: %s", filename, LOP_strerror(rc)), rc);
+
+		if (e) {
+			PyErr_SetObject(LopError, e);
+			Py_DECREF(e);
+		}
+		return -1;
+	}
+	self->init = true;
+
+	self->callbacks = PyTuple_New(self->schema.callback_table.size);
+	if (!self->callbacks) {
+		return -1;
+	}
+	for (int i = 0; i < self->schema.callback_table.size; i++) {
+		PyObject *name = PyUnicode_FromString(self->schema.callback_table.data[i].name);
+
+		if (!name) {
+			return -1;
+		}
+		PyTuple_SET_ITEM(self->callbacks, i, name);
+	}
+
+	return 0;
+}
+
+static void schema_dealloc(SchemaObject *self)
+{
+	if (self->init) {
+		LOP_schema_deinit(&self->schema);
+	}
+	Py_XDECREF(self->src);
+	Py_XDECREF(self->filename);
+	Py_XDECREF(self->callbacks);
+	Py_TYPE(self)->tp_free((PyObject *)self);
+}
+
+/* The handlers into a table of records and the symbols into one pool.
+ * The list is compact, its records are read as LOP.h lays them out */
+static HandlersObject *handlers_new(const struct LOP_HandlerList *hl, PyObject *callbacks)
+{
+	HandlersObject *self = PyObject_New(HandlersObject, &HandlersType);
+	char *pool = NULL;
+	size_t pool_len = 0;
+	size_t pool_size = 0;
+
+	if (!self) {
+		return NULL;
+	}
+	self->count = hl->count;
+	self->shape[0] = hl->count;
+	self->shape[1] = H_FIELDS;
+	self->pool = NULL;
+	self->callbacks = Py_NewRef(callbacks);
+	self->h = PyMem_Malloc((hl->count ? hl->count : 1) * sizeof(*self->h));
+	if (!self->h) {
+		Py_DECREF(self);
+		return (HandlersObject *)PyErr_NoMemory();
+	}
+
+	for (int i = 0; i < hl->count; i++) {
+		const struct LOP_CompactHandler *c = &hl->compact_handler[i];
+		struct LOP_ASTNode *n = c->node ? hl->node[c->node - 1] : NULL;
+
+		self->h[i][H_ID] = c->id_delta >> 2;
+		self->h[i][H_DELTA] = (int)(c->id_delta & 3) - 1;
+		self->h[i][H_TYPE] = n ? (int32_t)n->type : -1;
+		self->h[i][H_SYMBOL] = -1;
+
+		if (n && n->type > LOP_TYPE_LIST_LAST && n->type != LOP_TYPE_NIL) {
+			size_t len = strlen(n->symbol.value) + 1;
+
+			if (pool_len + len > pool_size) {
+				char *p;
+
+				pool_size = (pool_len + len) * 2;
+				p = PyMem_Realloc(pool, pool_size);
+				if (!p) {
+					PyMem_Free(pool);
+					Py_DECREF(self);
+					return (HandlersObject *)PyErr_NoMemory();
+				}
+				pool = p;
+			}
+			if (pool_len > INT32_MAX) {
+				PyMem_Free(pool);
+				Py_DECREF(self);
+				PyErr_SetString(PyExc_OverflowError, "symbols take more than 2 GiB");
+				return NULL;
+			}
+			self->h[i][H_SYMBOL] = pool_len;
+			memcpy(pool + pool_len, n->symbol.value, len);
+			pool_len += len;
+		}
+	}
+
+	self->pool = PyBytes_FromStringAndSize(pool, pool_len);
+	PyMem_Free(pool);
+	if (!self->pool) {
+		Py_DECREF(self);
+		return NULL;
+	}
+
+	return self;
+}
+
+static PyObject *schema_match(SchemaObject *self, PyObject *args, PyObject *kwds, bool validate)
+{
+	static char *kwlist[] = { "src", "top", "filename", "direct", NULL };
+	Py_buffer src;
+	const char *top;
+	const char *filename = "<string>";
+	int direct = 1;
+	PyObject *ret = NULL;
+	int rc;
+
+	if (!self->init) {
+		PyErr_SetString(PyExc_RuntimeError, "Schema is not initialized");
+		return NULL;
+	}
+	if (!PyArg_ParseTupleAndKeywords(args, kwds, "y*s|sp", kwlist, &src, &top, &filename, &direct)) {
+		return NULL;
+	}
+
+	struct LOP lop = {
+		.schema = &self->schema,
+		.top_rule_name = top,
+		.filename = filename,
+		/* Only the records are kept */
+		.compact = true,
+		.direct = direct,
+	};
+
+	if (validate) {
+		rc = LOP_validate(&lop, src.buf, src.len);
+	} else {
+		rc = LOP_init(&lop, src.buf, src.len);
+	}
+
+	if (rc) {
+		lop_error(rc, &lop);
+	} else if (validate) {
+		ret = Py_NewRef(Py_None);
+	} else {
+		ret = (PyObject *)handlers_new(&lop.hl, self->callbacks);
+	}
+
+	LOP_deinit(&lop);
+	PyBuffer_Release(&src);
+	return ret;
+}
+
+static PyObject *schema_parse(SchemaObject *self, PyObject *args, PyObject *kwds)
+{
+	return schema_match(self, args, kwds, false);
+}
+
+static PyObject *schema_validate(SchemaObject *self, PyObject *args, PyObject *kwds)
+{
+	return schema_match(self, args, kwds, true);
+}
+
+static PyMethodDef schema_methods[] = {
+	{ "parse", (PyCFunction)schema_parse, METH_VARARGS | METH_KEYWORDS,
+		"parse(src, top, filename='<string>', direct=True) -> Handlers" },
+	{ "validate", (PyCFunction)schema_validate, METH_VARARGS | METH_KEYWORDS,
+		"validate(src, top, filename='<string>', direct=True) -> None, raises lop.Error" },
+	{ NULL },
+};
+
+static PyObject *schema_get_callbacks(SchemaObject *self, void *closure)
+{
+	if (!self->callbacks) {
+		PyErr_SetString(PyExc_RuntimeError, "Schema is not initialized");
+		return NULL;
+	}
+	return Py_NewRef(self->callbacks);
+}
+
+static PyGetSetDef schema_getset[] = {
+	{ "callbacks", (getter)schema_get_callbacks, NULL, "Callback names by ID", NULL },
+	{ NULL },
+};
+
+static PyTypeObject SchemaType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "lop.Schema",
+	.tp_doc = "Schema(src, filename='<schema>')",
+	.tp_basicsize = sizeof(SchemaObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_new = PyType_GenericNew,
+	.tp_init = (initproc)schema_init,
+	.tp_dealloc = (destructor)schema_dealloc,
+	.tp_methods = schema_methods,
+	.tp_getset = schema_getset,
+};
+
+static void handlers_dealloc(HandlersObject *self)
+{
+	PyMem_Free(self->h);
+	Py_XDECREF(self->pool);
+	Py_XDECREF(self->callbacks);
+	PyObject_Free(self);
+}
+
+static Py_ssize_t handlers_len(HandlersObject *self)
+{
+	return self->count;
+}
+
+/* (count, 4) int32, read only. The records never change, so the exports aren't counted */
+static int handlers_getbuffer(HandlersObject *self, Py_buffer *view, int flags)
+{
+	static Py_ssize_t strides[2] = { H_FIELDS * sizeof(int32_t), sizeof(int32_t) };
+
+	if (flags & PyBUF_WRITABLE) {
+		PyErr_SetString(PyExc_BufferError, "Handlers are read only");
+		return -1;
+	}
+
+	view->obj = Py_NewRef(self);
+	view->buf = self->h;
+	view->len = self->count * sizeof(*self->h);
+	view->readonly = 1;
+	view->itemsize = sizeof(int32_t);
+	view->format = (flags & PyBUF_FORMAT) ? "i" : NULL;
+	view->ndim = 2;
+	view->shape = (flags & PyBUF_ND) == PyBUF_ND ? self->shape : NULL;
+	view->strides = (flags & PyBUF_STRIDES) == PyBUF_STRIDES ? strides : NULL;
+	view->suboffsets = NULL;
+	view->internal = NULL;
+	return 0;
+}
+
+static PyObject *handlers_symbol_at(HandlersObject *self, Py_ssize_t i)
+{
+	int32_t off = self->h[i][H_SYMBOL];
+
+	if (off < 0) {
+		return Py_NewRef(Py_None);
+	}
+	return PyUnicode_DecodeUTF8(PyBytes_AS_STRING(self->pool) + off,
+		strlen(PyBytes_AS_STRING(self->pool) + off), "surrogateescape");
+}
+
+static PyObject *handlers_symbol(HandlersObject *self, PyObject *arg)
+{
+	Py_ssize_t i = PyLong_AsSsize_t(arg);
+
+	if (i == -1 && PyErr_Occurred()) {
+		return NULL;
+	}
+	if (i < 0 || i >= self->count) {
+		PyErr_SetString(PyExc_IndexError, "handler index out of range");
+		return NULL;
+	}
+	return handlers_symbol_at(self, i);
+}
+
+/* table[ID](arg, symbol, delta) for every handler in order, the IDs past the table
+ * or with None there are skipped. The first exception stops it */
+static PyObject *handlers_dispatch(HandlersObject *self, PyObject *args)
+{
+	PyObject *table;
+	PyObject *arg;
+	PyObject *fast;
+	PyObject *delta[3];
+	Py_ssize_t size;
+
+	if (!PyArg_ParseTuple(args, "OO", &table, &arg)) {
+		return NULL;
+	}
+	fast = PySequence_Fast(table, "table must be a sequence");
+	if (!fast) {
+		return NULL;
+	}
+	size = PySequence_Fast_GET_SIZE(fast);
+	for (int i = 0; i < 3; i++) {
+		delta[i] = PyLong_FromLong(i - 1);
+	}
+
+	for (Py_ssize_t i = 0; i < self->count; i++) {
+		int32_t id = self->h[i][H_ID];
+		PyObject *fn;
+		PyObject *symbol;
+		PyObject *r;
+
+		if (id >= size || (fn = PySequence_Fast_GET_ITEM(fast, id)) == Py_None) {
+			continue;
+		}
+		symbol = handlers_symbol_at(self, i);
+		if (!symbol) {
+			goto err;
+		}
+		r = PyObject_CallFunctionObjArgs(fn, arg, symbol, delta[self->h[i][H_DELTA] + 1], NULL);
+		Py_DECREF(symbol);
+		if (!r) {
+			goto err;
+		}
+		Py_DECREF(r);
+	}
+
+	for (int i = 0; i < 3; i++) {
+		Py_DECREF(delta[i]);
+	}
+	Py_DECREF(fast);
+	Py_RETURN_NONE;
+
+err:
+	for (int i = 0; i < 3; i++) {
+		Py_DECREF(delta[i]);
+	}
+	Py_DECREF(fast);
+	return NULL;
+}
+
+/* A list by callback ID of int32 memoryviews with the indices of its handlers, in order */
+static PyObject *handlers_group(HandlersObject *self, PyObject *unused)
+{
+	Py_ssize_t size = PyTuple_GET_SIZE(self->callbacks);
+	Py_ssize_t *count = PyMem_Calloc(size ? size : 1, sizeof(*count));
+	int32_t **index = PyMem_Calloc(size ? size : 1, sizeof(*index));
+	PyObject **bytes = PyMem_Calloc(size ? size : 1, sizeof(*bytes));
+	PyObject *ret = NULL;
+
+	if (!count || !index || !bytes) {
+		PyErr_NoMemory();
+		goto out;
+	}
+
+	for (Py_ssize_t i = 0; i < self->count; i++) {
+		count[self->h[i][H_ID]]++;
+	}
+	for (Py_ssize_t k = 0; k < size; k++) {
+		bytes[k] = PyBytes_FromStringAndSize(NULL, count[k] * sizeof(int32_t));
+		if (!bytes[k]) {
+			goto out;
+		}
+		index[k] = (int32_t *)PyBytes_AS_STRING(bytes[k]);
+		count[k] = 0;
+	}
+	for (Py_ssize_t i = 0; i < self->count; i++) {
+		int32_t id = self->h[i][H_ID];
+
+		index[id][count[id]++] = i;
+	}
+
+	ret = PyList_New(size);
+	for (Py_ssize_t k = 0; ret && k < size; k++) {
+		PyObject *view = PyMemoryView_FromObject(bytes[k]);
+		PyObject *cast = view ? PyObject_CallMethod(view, "cast", "s", "i") : NULL;
+
+		Py_XDECREF(view);
+		if (!cast) {
+			Py_CLEAR(ret);
+			break;
+		}
+		PyList_SET_ITEM(ret, k, cast);
+	}
+
+out:
+	for (Py_ssize_t k = 0; bytes && k < size; k++) {
+		Py_XDECREF(bytes[k]);
+	}
+	PyMem_Free(count);
+	PyMem_Free(index);
+	PyMem_Free(bytes);
+	return ret;
+}
+
+/* table[ID](arg, self, indices) once for every callback ID with handlers, indices as by group(),
+ * for the callbacks which don't depend on the order of the others */
+static PyObject *handlers_batch(HandlersObject *self, PyObject *args)
+{
+	PyObject *table;
+	PyObject *arg;
+	PyObject *fast;
+	PyObject *group;
+	Py_ssize_t size;
+
+	if (!PyArg_ParseTuple(args, "OO", &table, &arg)) {
+		return NULL;
+	}
+	fast = PySequence_Fast(table, "table must be a sequence");
+	if (!fast) {
+		return NULL;
+	}
+	group = handlers_group(self, NULL);
+	if (!group) {
+		Py_DECREF(fast);
+		return NULL;
+	}
+	size = PySequence_Fast_GET_SIZE(fast);
+
+	for (Py_ssize_t k = 0; k < size && k < PyList_GET_SIZE(group); k++) {
+		PyObject *fn = PySequence_Fast_GET_ITEM(fast, k);
+		PyObject *indices = PyList_GET_ITEM(group, k);
+		PyObject *r;
+
+		if (fn == Py_None || PyObject_Length(indices) == 0) {
+			continue;
+		}
+		r = PyObject_CallFunctionObjArgs(fn, arg, (PyObject *)self, indices, NULL);
+		if (!r) {
+			Py_DECREF(group);
+			Py_DECREF(fast);
+			return NULL;
+		}
+		Py_DECREF(r);
+	}
+
+	Py_DECREF(group);
+	Py_DECREF(fast);
+	Py_RETURN_NONE;
+}
+
+static PyMethodDef handlers_methods[] = {
+	{ "symbol", (PyCFunction)handlers_symbol, METH_O,
+		"symbol(i) -> str of the node of the handler i, None for a list or no node" },
+	{ "dispatch", (PyCFunction)handlers_dispatch, METH_VARARGS,
+		"dispatch(table, arg): table[ID](arg, symbol, delta) for every handler in order" },
+	{ "group", (PyCFunction)handlers_group, METH_NOARGS,
+		"group() -> [memoryview of the handler indices of every callback ID]" },
+	{ "batch", (PyCFunction)handlers_batch, METH_VARARGS,
+		"batch(table, arg): table[ID](arg, handlers, indices) once for every callback ID" },
+	{ NULL },
+};
+
+static PyObject *handlers_get_pool(HandlersObject *self, void *closure)
+{
+	return Py_NewRef(self->pool);
+}
+
+static PyObject *handlers_get_callbacks(HandlersObject *self, void *closure)
+{
+	return Py_NewRef(self->callbacks);
+}
+
+static PyGetSetDef handlers_getset[] = {
+	{ "pool", (getter)handlers_get_pool, NULL, "The symbols, NUL terminated", NULL },
+	{ "callbacks", (getter)handlers_get_callbacks, NULL, "Callback names by ID", NULL },
+	{ NULL },
+};
+
+static PySequenceMethods handlers_as_sequence = {
+	.sq_length = (lenfunc)handlers_len,
+};
+
+static PyBufferProcs handlers_as_buffer = {
+	.bf_getbuffer = (getbufferproc)handlers_getbuffer,
+};
+
+static PyTypeObject HandlersType = {
+	PyVarObject_HEAD_INIT(NULL, 0)
+	.tp_name = "lop.Handlers",
+	.tp_doc = "The handler list of a match: (callback ID, node type, delta, symbol offset) records",
+	.tp_basicsize = sizeof(HandlersObject),
+	.tp_flags = Py_TPFLAGS_DEFAULT,
+	.tp_dealloc = (destructor)handlers_dealloc,
+	.tp_methods = handlers_methods,
+	.tp_getset = handlers_getset,
+	.tp_as_sequence = &handlers_as_sequence,
+	.tp_as_buffer = &handlers_as_buffer,
+};
+
+static struct PyModuleDef lop_module = {
+	PyModuleDef_HEAD_INIT,
+	.m_name = "lop",
+	.m_doc = "LOP matcher returning the handler lists in bulk",
+	.m_size = -1,
+};
+
+PyMODINIT_FUNC PyInit_lop(void)
+{
+	PyObject *m;
+
+	if (PyType_Ready(&SchemaType) < 0 || PyType_Ready(&HandlersType) < 0) {
+		return NULL;
+	}
+
+	m = PyModule_Create(&lop_module);
+	if (!m) {
+		return NULL;
+	}
+
+	LopError = PyErr_NewException("lop.Error", NULL, NULL);
+	if (PyModule_AddObjectRef(m, "Error", LopError) < 0 ||
+	    PyModule_AddObjectRef(m, "Schema", (PyObject *)&SchemaType) < 0 ||
+	    PyModule_AddObjectRef(m, "Handlers", (PyObject *)&HandlersType) < 0) {
+		Py_DECREF(m);
+		return NULL;
+	}
+
+	/* The node types of the records */
+	PyModule_AddIntConstant(m, "TYPE_LIST_ROUND", LOP_TYPE_LIST_ROUND);
+	PyModule_AddIntConstant(m, "TYPE_LIST_CURLY", LOP_TYPE_LIST_CURLY);
+	PyModule_AddIntConstant(m, "TYPE_LIST_SQUARE", LOP_TYPE_LIST_SQUARE);
+	PyModule_AddIntConstant(m, "TYPE_LIST_COLON", LOP_TYPE_LIST_COLON);
+	PyModule_AddIntConstant(m, "TYPE_LIST_STRING", LOP_TYPE_LIST_STRING);
+	PyModule_AddIntConstant(m, "TYPE_LIST_OPERATOR_UNARY", LOP_TYPE_LIST_OPERATOR_UNARY);
+	PyModule_AddIntConstant(m, "TYPE_LIST_OPERATOR_BINARY", LOP_TYPE_LIST_OPERATOR_BINARY);
+	PyModule_AddIntConstant(m, "TYPE_OPERATOR", LOP_TYPE_OPERATOR);
+	PyModule_AddIntConstant(m, "TYPE_ID", LOP_TYPE_ID);
+	PyModule_AddIntConstant(m, "TYPE_NUMBER", LOP_TYPE_NUMBER);
+	PyModule_AddIntConstant(m, "TYPE_STRING", LOP_TYPE_STRING);
+	PyModule_AddIntConstant(m, "TYPE_NIL", LOP_TYPE_NIL);
+
+	return m;
+}
@@ -1,6 +1,5 @@
 import sys
-import LOP
-import ctypes
+import lop
 
 class Module:
     def __init__(self):
@@ -121,19 +120,19 @@ module:
 			$statement: @module_add_stmt
 """)
 class ParseModule:
-    def module_create(stack, ast, delta):
+    def module_create(stack, value, delta):
         if delta > 0:
             stack.append(Module())
 
-    def module_set_name(stack, ast, delta):
-        stack[-1].set_name(LOP.LOP_symbol_value(ast).decode())
+    def module_set_name(stack, value, delta):
+        stack[-1].set_name(value)
 
-    def module_add_port(stack, ast, delta):
+    def module_add_port(stack, value, delta):
         if delta < 0:
             i = stack.pop()
             stack[-1].add_port(i)
 
-    def module_add_stmt(stack, ast, delta):
+    def module_add_stmt(stack, value, delta):
         if delta < 0:
             i = stack.pop()
             stack[-1].add_stmt(i)
@@ -154,19 +153,19 @@ direction:
 		identifier: 'out'
 """)
 class ParsePort:
-    def port_create(stack, ast, delta):
+    def port_create(stack, value, delta):
         if delta > 0:
             stack.append(Port())
 
-    def port_set_name(stack, ast, delta):
-        stack[-1].set_name(LOP.LOP_symbol_value(ast).decode())
+    def port_set_name(stack, value, delta):
+        stack[-1].set_name(value)
 
-    def port_set_dir(stack, ast, delta):
+    def port_set_dir(stack, value, delta):
         if delta > 0:
-            stack[-1].set_dir(LOP.LOP_symbol_value(ast).decode())
+            stack[-1].set_dir(value)
 
-    def port_set_width(stack, ast, delta):
-        stack[-1].set_width(int(LOP.LOP_symbol_value(ast).decode()))
+    def port_set_width(stack, value, delta):
+        stack[-1].set_width(int(value))
 
 @parser("""
 statement:
@@ -174,11 +173,11 @@ statement:
 		$stmt_assign: @stmt_set
 """)
 class ParseStatement:
-    def stmt_create(stack, ast, delta):
+    def stmt_create(stack, value, delta):
         if delta > 0:
             stack.append(Statement())
 
-    def stmt_set(stack, ast, delta):
+    def stmt_set(stack, value, delta):
         if delta < 0:
             i = stack.pop()
             stack[-1].set_stmt(i)
@@ -196,16 +195,16 @@ lhs:
 		$bus
 """)
 class ParseAssign:
-    def assign_create(stack, ast, delta):
+    def assign_create(stack, value, delta):
         if delta > 0:
             stack.append(Assign())
 
-    def assign_set_lhs(stack, ast, delta):
+    def assign_set_lhs(stack, value, delta):
         if delta < 0:
             i = stack.pop()
             stack[-1].set_lhs(i)
 
-    def assign_set_rhs(stack, ast, delta):
+    def assign_set_rhs(stack, value, delta):
         if delta < 0:
             i = stack.pop()
             stack[-1].set_rhs(i)
@@ -217,11 +216,11 @@ bus:
 			$expr: @bus_add
 """)
 class ParseBus:
-    def bus_create(stack, ast, delta):
+    def bus_create(stack, value, delta):
         if delta > 0:
             stack.append(Bus())
 
-    def bus_add(stack, ast, delta):
+    def bus_add(stack, value, delta):
         if delta < 0:
             i = stack.pop()
             stack[-1].add(i)
@@ -243,22 +242,22 @@ expr:
 			$expr
 """)
 class ParserExpr:
-    def identifier(stack, ast, delta):
-        stack.append(LOP.LOP_symbol_value(ast).decode())
+    def identifier(stack, value, delta):
+        stack.append(value)
 
-    def binary(stack, ast, delta):
+    def binary(stack, value, delta):
         if delta > 0:
             stack.append(Binary())
 
-    def binary_set_op(stack, ast, delta):
-        stack[-1].set_op(LOP.LOP_symbol_value(ast).decode())
+    def binary_set_op(stack, value, delta):
+        stack[-1].set_op(value)
 
-    def binary_set_op1(stack, ast, delta):
+    def binary_set_op1(stack, value, delta):
         if delta < 0:
             i = stack.pop()
             stack[-1].set_op1(i)
 
-    def binary_set_op2(stack, ast, delta):
+    def binary_set_op2(stack, value, delta):
         if delta < 0:
             i = stack.pop()
             stack[-1].set_op2(i)
@@ -305,33 +304,21 @@ schema_str = """
 
 schema_str += ''.join(SYNTAX)
 
-schema = LOP.LOP_Schema()
-schema.filename = LOP.String('schema.lop'.encode())
+schema = lop.Schema(schema_str, 'schema.lop')
 
-rc = LOP.LOP_schema_init(schema, schema_str, len(schema_str))
+# The callbacks by ID, looked up once instead of by every handler
+table = [None] * len(schema.callbacks)
+for i, name in enumerate(schema.callbacks):
+    for j in PARSER:
+        if hasattr(j, name):
+            table[i] = getattr(j, name)
+            break
 
-if rc == 0:
-    lop = LOP.LOP()
-    lop.schema = ctypes.pointer(schema)
-    lop.top_rule_name = LOP.String('top'.encode())
-    lop.filename = LOP.String('example.lop'.encode())
+with open('example.lop', 'rb') as f:
+    hl = schema.parse(f.read(), 'top', 'example.lop')
 
-    src = LOP.map_file('example.lop')
-    LOP.LOP_init(lop, src.data, src.len)
-    LOP.unmap_file(src)
+stack = []
+hl.dispatch(table, stack)
 
-    stack = []
-
-    for i in range(lop.hl.count):
-        for j in PARSER:
-            if hasattr(j, str(lop.hl.handler[i].key)):
-                func = getattr(j, str(lop.hl.handler[i].key))
-                func(stack, lop.hl.handler[i].n, lop.hl.handler[i].delta)
-                break
-
-    for i in stack:
-        print(i)
-
-    LOP.LOP_deinit(lop)
-
-LOP.LOP_schema_deinit(schema)
+for i in stack:
+    print(i)
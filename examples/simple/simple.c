@@ -8,6 +8,7 @@
 
 typedef int (*cb_t)(struct LOP_ASTNode *n, int delta);
 
+static struct LOP_CallbackTable *ct;
 static struct LOP_HandlerList *hl;
 static int hl_index;
 
@@ -33,6 +34,8 @@ static int eval_node(void)
 	cb_t cb = resolve(hl_index);
 	struct LOP_ASTNode *n = hl->handler[hl_index].n;
 	int delta = hl->handler[hl_index].delta;
+	/* Continue after the subtree, however much of it the callback has evaluated */
+	int next = LOP_handler_skip(hl, hl_index);
 
 	hl_index++;
 
@@ -48,9 +51,7 @@ static int eval_node(void)
 		}
 	}
 
-	if (delta > 0) {
-		hl_index++;
-	}
+	hl_index = next;
 
 	return 0;
 }
@@ -126,7 +127,7 @@ static int cb_print(struct LOP_ASTNode *n, int delta)
 	return 0;
 }
 
-static cb_t resolve(int index)
+static void bind(struct LOP_Schema *schema)
 {
 	static struct {
 		const char *key;
@@ -143,13 +144,29 @@ static cb_t resolve(int index)
 	};
 
 	for (int i = 0; i < ARRAY_SIZE(entries); i++) {
-		if (!strcmp(hl->handler[index].key, entries[i].key)) {
-			return entries[i].handler;
-		}
+		LOP_schema_bind(schema, entries[i].key, entries[i].handler);
 	}
-	return NULL;
 }
 
+static cb_t resolve(int index)
+{
+	return ct->data[hl->handler[index].id].fn;
+}
+
+#ifdef SIMPLE_GEN
+/* Matcher generated by lop-gen from simple.schema, see Makefile */
+int simple_init(struct LOP *lop, const char *src, size_t len);
+extern struct LOP_CallbackTable simple_callback_table;
+
+#define schema_init(schema, src, len) ((schema)->callback_table = simple_callback_table, 0)
+#define schema_deinit(schema)
+#define match_init simple_init
+#else
+#define schema_init LOP_schema_init
+#define schema_deinit LOP_schema_deinit
+#define match_init LOP_init
+#endif
+
 int main(int argc, char *argv[])
 {
 	struct LOP_Schema schema = {
@@ -158,14 +175,17 @@ int main(int argc, char *argv[])
 	struct FileMap schema_str = map_file(argv[1]);
 	struct FileMap source = map_file(argv[2]);
 
-	if (!LOP_schema_init(&schema, schema_str.data, schema_str.len)) {
+	if (!schema_init(&schema, schema_str.data, schema_str.len)) {
 		struct LOP lop = {
 			.schema = &schema,
 			.top_rule_name = argv[3],
 			.filename = argv[2],
 		};
 
-		LOP_init(&lop, source.data, source.len);
+		bind(&schema);
+		ct = &schema.callback_table;
+
+		match_init(&lop, source.data, source.len);
 
 		hl = &lop.hl;
 
@@ -175,7 +195,7 @@ int main(int argc, char *argv[])
 
 		LOP_deinit(&lop);
 	}
-	LOP_schema_deinit(&schema);
+	schema_deinit(&schema);
 
 	unmap_file(schema_str);
 	unmap_file(source);
@@ -4,6 +4,8 @@
 #include <limits.h>
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
 
 struct LOP_Location {
 	int lineno;
@@ -43,6 +45,8 @@ struct LOP_ASTNode {
 
 	/* Needed for closing colon lists */
 	int indent;
+	/* Lists it's nested in, see LOP_Limits.max_depth */
+	int depth;
 
 	union {
 		struct {
@@ -61,8 +65,13 @@ struct LOP_ASTNode {
 
 	struct LOP_Location loc;
 
-	int parsed;
-	void *sn;
+	/* Dense preorder number given by LOP_parse(), the root is 0.
+	 * The matcher keeps its per-node state aside by this, so the AST is never written by LOP_match().
+	 * LOP_init_file() numbers the nodes as it takes them, and reuses the IDs of the freed items */
+	unsigned id;
+#define LOP_AST_NO_ID UINT_MAX
+	/* Of a list: the most lists nested in it, so a list made a callee still counts its depth */
+	int height;
 };
 
 struct LOP_Operator {
@@ -83,15 +92,65 @@ struct LOP_OperatorTable {
 	int size;
 };
 
+/* Every distinct @callback of the schema gets a dense ID, which is its index here */
+struct LOP_Callback {
+	const char *name;
+	/* Set by LOP_schema_bind(), LOP doesn't call it by itself */
+	void *fn;
+};
+
+struct LOP_CallbackTable {
+	struct LOP_Callback *data;
+	int size;
+};
+
 struct LOP_Handler {
 	const char *key;
 	struct LOP_ASTNode *n;
+	/* Index in LOP_Schema.callback_table */
+	int id;
 	int delta;
+	union {
+		/* delta == 1: index of the matching delta == -1 handler */
+		int close;
+		/* delta == 0: index of the value a #set SN has matched, 0 for the other SNs.
+		 * A #lazy list has delta == 0 too, and its SN here for LOP_force() */
+		int member;
+	};
+	/* delta == 1: handlers directly inside, opened or delta == 0 */
+	int children;
+};
+
+/* 12 bytes a handler instead of 32, see LOP.compact: these 8, and 4 in LOP_HandlerList.close */
+struct LOP_CompactHandler {
+	/* id << 2 | (delta + 1) */
+	uint32_t id_delta;
+	/* Position in LOP_HandlerList.node + 1, 0 is NULL.
+	 * delta == -1 handlers have no node and keep the children of the opened one here */
+	uint32_t node;
 };
 
 struct LOP_HandlerList {
-	struct LOP_Handler *handler;
+	union {
+		struct LOP_Handler *handler;
+		/* If compact is set */
+		struct LOP_CompactHandler *compact_handler;
+	};
 	int count;
+	/* Allocated size, grows geometrically and is never released during the match */
+	int capacity;
+	/* Reallocations of the handler during the last LOP_init() */
+	int reallocs;
+
+	bool compact;
+	/* Compact: LOP_Handler.close (or .member) of the handlers, allocated with them */
+	int *close;
+	/* Nodes of the compact handlers, by LOP_CompactHandler.node - 1 */
+	struct LOP_ASTNode **node;
+	int node_count;
+	int node_capacity;
+	/* Callback names of the IDs */
+	const struct LOP_CallbackTable *ct;
 };
 
 struct LOP_Schema {
@@ -101,6 +160,92 @@ struct LOP_Schema {
 	/* LOP will fill these */
 	struct KV *kv;
 	struct LOP_OperatorTable operator_table;
+	struct LOP_CallbackTable callback_table;
+	/* SchemaNodes of the rules, see LOP_Profile */
+	int node_count;
+
+	/* Set if the schema came from LOP_schema_load() */
+	struct LOP_SchemaBlob *blob;
+};
+
+/* What LOP_getAST() may take of a hostile source, 0 is no limit.
+ * Every one is checked as the tokens are added, and stops the parse with its error */
+struct LOP_Limits {
+	/* Lists nested in each other, operators and colon lists included: LOP_ERROR_LEXER_DEPTH */
+	int max_depth;
+	/* AST nodes: LOP_ERROR_LEXER_NODES */
+	size_t max_nodes;
+	/* Bytes of a symbol or a string: LOP_ERROR_LEXER_SYMBOL */
+	size_t max_symbol;
+	/* Bytes of the nodes and their symbols: LOP_ERROR_LEXER_BYTES */
+	size_t max_bytes;
+};
+
+/* Parsed source which can be matched many times, see LOP_match() */
+struct LOP_AST {
+	/* You must fill these */
+	/* For its operator table */
+	struct LOP_Schema *schema;
+	const char *filename;
+
+	/* Optional */
+	struct LOP_Limits limits;
+
+	/* LOP will fill these */
+	struct LOP_ASTNode *root;
+	/* Nodes in the AST, LOP_ASTNode.id < node_count */
+	unsigned node_count;
+	/* For the error reports, must outlive the AST */
+	const char *src;
+	size_t len;
+	/* Where LOP_parse() failed */
+	struct LOP_Location error;
+};
+
+/* Counters of an SN, summed over the matches */
+struct LOP_ProfileNode {
+	/* The rule, and what the SNs down to this one take: "top/tlist/tree @item/binary#2" */
+	char *path;
+	/* The SN is the rule itself */
+	bool rule;
+	uint64_t attempts;
+	uint64_t successes;
+	/* Attempts which have never succeeded */
+	uint64_t failures;
+	/* Backtracks to the next possibility of the SN which have dropped handlers */
+	uint64_t rollbacks;
+	/* Most SNs the match was inside of when it entered this one */
+	int max_depth;
+	/* From the attempt to its first success or its failure, the SNs inside included,
+	 * but not again for the SN nested in itself */
+	uint64_t ns;
+};
+
+enum LOP_LintSeverity {
+	/* Likely not what was meant, but harmless */
+	LOP_LINT_LOW,
+	/* Costs a backtrack on some inputs */
+	LOP_LINT_MEDIUM,
+	/* Never matches, or can backtrack exponentially */
+	LOP_LINT_HIGH,
+};
+
+/* A finding of LOP_schema_lint() */
+struct LOP_LintFinding {
+	enum LOP_LintSeverity severity;
+	/* The rule it's in, and where the SN is declared in the schema source */
+	const char *rule;
+	struct LOP_Location loc;
+	const char *message;
+};
+
+/* Per-SN schema profile, see LOP.profile */
+struct LOP_Profile {
+	/* LOP will fill these */
+	const struct LOP_Schema *schema;
+	/* By SchemaNode, the rules in the schema order and the SNs inside them depth first */
+	struct LOP_ProfileNode *node;
+	int count;
 };
 
 struct LOP {
@@ -109,9 +254,78 @@ struct LOP {
 	const char *top_rule_name;
 	const char *filename;
 
+	/* Optional: LOP_deinit() keeps the handler buffer for the next LOP_init(),
+	 * clear it before the last LOP_deinit() to free it */
+	bool keep_handlers;
+	/* Optional: fill hl.compact_handler instead of hl.handler,
+	 * read either of them with LOP_handler() and friends */
+	bool compact;
+	/* Optional: match the items of a long listof on this many threads, the handlers are
+	 * the same as of the serial match. Only the listof whose children take one AST node each.
+	 * LOP_init_file() instead scans the source on a thread of its own, ahead of the match */
+	int threads;
+	/* Optional: streaming. Every item of a listof which can't be backtracked into is passed here
+	 * as soon as it has matched, as a handler list of its own, and it's left out of hl.
+	 * depth is the number of handlers opened around the item. Non-zero stops the match and is returned */
+	int (*item)(void *arg, const struct LOP_HandlerList *hl, int depth);
+	void *item_arg;
+	/* Optional, with item: LOP_init() frees the AST of every item once it's passed */
+	bool free_items;
+	/* Optional: LOP_init_file() reads the source by this many bytes, 64 KiB if 0 */
+	size_t window;
+	/* Optional: count every SN the match tries, see LOP_profile_init().
+	 * The items are not matched on threads then */
+	struct LOP_Profile *profile;
+	/* Optional: stop the match with LOP_ERROR_BUDGET after this many more SNs are entered,
+	 * or once CLOCK_MONOTONIC reaches the deadline in ns. 0 is no limit. The stopped match
+	 * can be continued by LOP_resume() with a new budget. The items are not matched on threads then */
+	uint64_t max_steps;
+	uint64_t deadline;
+	/* Optional: the limits of the parse */
+	struct LOP_Limits limits;
+	/* Optional: match the tokens as they are scanned, without the AST, if the next token always
+	 * tells which SN takes it. The handler nodes are made for the handlers alone, they have no
+	 * parent, children or siblings. Any other source or schema gets the AST and the same handlers.
+	 * Not with item, profile, the budget or the limits */
+	bool direct;
+
 	/* LOP will fill these */
 	struct LOP_ASTNode *ast;
 	struct LOP_HandlerList hl;
+	/* LOP.direct has matched the tokens: ast is NULL and the handler nodes are kept here */
+	bool scanned;
+	struct LOP_Nodes *nodes;
+	/* Where LOP_init() or LOP_validate() failed: for a mismatch, the furthest node the match has reached */
+	struct LOP_Location error;
+	/* SNs entered by the match, its resumes included */
+	uint64_t steps;
+	/* The match stopped by the budget, see LOP_resume() */
+	struct LOP_Suspended *suspended;
+};
+
+/* Parallel dispatch of a handler list, see LOP_dispatch() */
+struct LOP_Dispatch {
+	/* You must fill these */
+	/* Called for every handler, with the context of the task the handler is in, arg otherwise.
+	 * Non-zero stops the task, or the dispatch */
+	int (*handler)(void *ctx, const struct LOP_HandlerList *hl, int i);
+	/* @callbacks which open independent subtrees, NULL terminated */
+	const char *const *task;
+
+	/* Optional */
+	void *arg;
+	int threads;
+	/* The context of the task opened by the handler i inside depth opened ones,
+	 * arg is shared by the tasks if not set */
+	void *(*task_begin)(void *arg, const struct LOP_HandlerList *hl, int i, int depth);
+	/* Called on the calling thread in the place of every task, in the source order,
+	 * with the result of the task. It's called even after a failure, to release ctx */
+	int (*task_merge)(void *arg, void *ctx, int rc);
+
+	/* LOP will fill these */
+	int task_count;
+	/* Tasks taken by a thread from the share of another one */
+	int steals;
 };
 
 enum LOP_ErrorType {
@@ -125,16 +339,70 @@ enum LOP_ErrorType {
 	LOP_ERROR_LEXER_BINARY_ARGS,
 	LOP_ERROR_LEXER_BINARY_UNKNOWN,
 	LOP_ERROR_LEXER_OUT_OF_MEMORY,
+	/* LOP_Limits */
+	LOP_ERROR_LEXER_DEPTH,
+	LOP_ERROR_LEXER_NODES,
+	LOP_ERROR_LEXER_SYMBOL,
+	LOP_ERROR_LEXER_BYTES,
+	/* LOP_init_file(): a colon list on several lines is called or an operand after its items are passed,
+	 * LOP_scan_next(): a list or a string which is passed already is called or an operand */
+	LOP_ERROR_LEXER_MATCHED,
 
 	LOP_ERROR_SCHEMA_SYNTAX,
 	LOP_ERROR_SCHEMA_MISSING_RULE,
 	LOP_ERROR_SCHEMA_MISSING_TOP,
+	LOP_ERROR_SCHEMA_CACHE,
+	LOP_ERROR_SCHEMA_UNKNOWN_CALLBACK,
+	LOP_ERROR_SCHEMA_OPERATORS,
+
+	LOP_ERROR_FILE,
+	/* LOP.max_steps or LOP.deadline has stopped the match */
+	LOP_ERROR_BUDGET,
 };
 
+/* What the error is, as it's reported without the location and the details: "Unbalanced list" */
+const char *LOP_strerror(int rc);
+
 /* AST functions */
+/* limits may be NULL */
 int LOP_getAST(struct LOP_ASTNode **root, const char *filename, const char *string, size_t len,
-	struct LOP_OperatorTable *operator_table);
+	struct LOP_OperatorTable *operator_table, const struct LOP_Limits *limits);
 void LOP_delAST(struct LOP_ASTNode *root);
+/* Location of the last LOP_getAST() error */
+struct LOP_Location LOP_getAST_loc(void);
+
+/* LOP_getAST() a token at a time, for LOP_init_file(). With window > 0 string must be
+ * a page aligned file mapping: it's read by window bytes and the pages behind are released.
+ * With thread the source is scanned ahead on a thread of its own, and the steps build the tree */
+int LOP_getAST_begin(struct LOP_ASTNode **root, const char *filename, const char *string, size_t len,
+	struct LOP_OperatorTable *operator_table, const struct LOP_Limits *limits, size_t window, bool thread);
+/* 1 after a token, 0 at the end of the source, or the error, which is reported */
+int LOP_getAST_step(void);
+/* The list still gets children */
+bool LOP_getAST_open(const struct LOP_ASTNode *n);
+/* The node won't be turned into something else by the next tokens */
+bool LOP_getAST_settled(const struct LOP_ASTNode *n);
+void LOP_getAST_end(void);
+
+/* The tokens as LOP_getAST() would build them, without the tree, for LOP.direct */
+struct LOP_Scan {
+	enum LOP_ScanType {
+		LOP_SCAN_OPEN,
+		LOP_SCAN_SYMBOL,
+		LOP_SCAN_CLOSE,
+		LOP_SCAN_END,
+	} what;
+	/* The node LOP_getAST() would have built, without the links and with height 0.
+	 * The symbol value is valid until the next LOP_scan_next() */
+	struct LOP_ASTNode n;
+};
+
+/* window and thread are those of LOP_getAST_begin() */
+int LOP_scan_begin(const char *string, size_t len, struct LOP_OperatorTable *operator_table, size_t window, bool thread);
+/* 0 or the error, which isn't reported. LOP_SCAN_END is given again at the end */
+int LOP_scan_next(struct LOP_Scan *s);
+/* keep: the copy of the source stays for the next LOP_getAST() of it, to fall back without copying it again */
+void LOP_scan_end(bool keep);
 
 void LOP_dump_ast(struct LOP_ASTNode *root);
 
@@ -146,7 +414,95 @@ struct LOP_ASTNode *LOP_list_tail(struct LOP_ASTNode *n);
 int LOP_schema_init(struct LOP_Schema *schema, const char *src, size_t len);
 void LOP_schema_deinit(struct LOP_Schema *schema);
 
+/* Binds fn to the @name callback and returns its ID, so the handlers can be dispatched with
+ * schema->callback_table.data[h->id].fn instead of comparing h->key. */
+int LOP_schema_bind(struct LOP_Schema *schema, const char *name, void *fn);
+
+/* Compiled schema cache.
+ * The blob is tied to the schema source by its hash, so LOP_schema_load() fails
+ * with LOP_ERROR_SCHEMA_CACHE if the blob is missing, broken or stale,
+ * and the caller is expected to fall back to LOP_schema_init() + LOP_schema_save(). */
+int LOP_schema_save(struct LOP_Schema *schema, const char *filename, const char *src, size_t len);
+int LOP_schema_load(struct LOP_Schema *schema, const char *filename, const char *src, size_t len);
+
+/* Emits a standalone C matcher for the schema.
+ * The generated file provides int <prefix>_init(struct LOP *lop, const char *src, size_t len)
+ * which behaves like LOP_init(), but doesn't need lop->schema. See util/lop-gen.c */
+int LOP_schema_gen(struct LOP_Schema *schema, FILE *out, const char *prefix);
+
 int LOP_init(struct LOP *lop, const char *src, size_t len);
 void LOP_deinit(struct LOP *lop);
 
+/* LOP_init() in two steps: the source is parsed once and the AST can be matched
+ * against any top rule of any schema with the same operator table.
+ * LOP_match() doesn't write the AST, so it can run concurrently on one AST with different struct LOP.
+ * lop->filename is not used, lop->ast is left NULL: the AST belongs to the caller,
+ * release it with LOP_parse_deinit() after LOP_deinit() of its matches. */
+int LOP_parse(struct LOP_AST *ast, const char *src, size_t len);
+int LOP_match(struct LOP *lop, const struct LOP_AST *ast);
+void LOP_parse_deinit(struct LOP_AST *ast);
+
+/* Out-of-core LOP_init() of lop->filename: the file is mapped and lexed as far as the match
+ * needs it, by lop->window bytes, and the pages behind are released. Streamed items (lop->item)
+ * are freed as they go, so with a streamed listof the memory doesn't depend on the file size.
+ * The first error stops it where it is. With lop->threads > 1 the source is scanned on a thread */
+int LOP_init_file(struct LOP *lop);
+/* LOP_validate() of lop->filename the same way, every item which can't be backtracked into is freed */
+int LOP_validate_file(struct LOP *lop);
+
+/* Matches the content of the #lazy list of the handler h (LOP_handler_lazy()) which the match
+ * has left out, and fills hl with its handlers: the ones of the list itself and everything inside,
+ * as the match would have without #lazy. The #lazy lists inside are left out again.
+ * The AST must still be there, so not after LOP.free_items. Returns 0 or the error, which is
+ * reported without the source line, lop->error is its location. hl is reused by the next
+ * LOP_force() into it, LOP_force_deinit() frees it */
+int LOP_force(struct LOP *lop, const struct LOP_Handler *h, struct LOP_HandlerList *hl);
+void LOP_force_deinit(struct LOP_HandlerList *hl);
+
+/* Continues the match of LOP_init(), LOP_validate() or LOP_match() stopped with LOP_ERROR_BUDGET,
+ * with lop->max_steps and lop->deadline as they are now. Returns what they would have returned.
+ * The source and the AST must stay until then, LOP_deinit() drops the stopped match.
+ * LOP_init_file() can't be resumed: its lexer doesn't wait */
+int LOP_resume(struct LOP *lop);
+
+/* Same check as LOP_init(), but no handlers and no AST are kept, LOP_deinit() is not needed
+ * unless the budget has stopped it.
+ * Returns 0 or the error, lop->error is the location of the error */
+int LOP_validate(struct LOP *lop, const char *src, size_t len);
+
+/* Zeroed counters for the matches of the schema, LOP_profile_deinit() frees them */
+void LOP_profile_init(struct LOP_Profile *p, const struct LOP_Schema *schema);
+void LOP_profile_deinit(struct LOP_Profile *p);
+/* A line per SN in the order of the schema, to diff the profiles of schema revisions:
+ * path, attempts, successes, failures, rollbacks, max depth and microseconds, tab separated */
+void LOP_profile_dump(const struct LOP_Profile *p, FILE *out);
+
+/* Static analysis of the schema for backtracking and ambiguity hazards: overlapping and
+ * shadowed alternatives, rules which refer to themselves without taking a node, and
+ * listof items which take a varying number of nodes. report is called for every finding,
+ * the number of LOP_LINT_HIGH ones is returned */
+int LOP_schema_lint(const struct LOP_Schema *schema,
+	void (*report)(void *arg, const struct LOP_LintFinding *f), void *arg);
+
+/* Handler accessors, work for both the plain and the compact handler list */
+struct LOP_Handler LOP_handler(const struct LOP_HandlerList *hl, int i);
+int LOP_handler_id(const struct LOP_HandlerList *hl, int i);
+int LOP_handler_delta(const struct LOP_HandlerList *hl, int i);
+struct LOP_ASTNode *LOP_handler_node(const struct LOP_HandlerList *hl, int i);
+/* Which value of a #set SN the delta == 0 handler has matched, 0 otherwise */
+int LOP_handler_member(const struct LOP_HandlerList *hl, int i);
+/* The handler stands for a #lazy list, see LOP_force() */
+bool LOP_handler_lazy(const struct LOP_HandlerList *hl, int i);
+/* Index right after the subtree of the handler i, O(1) */
+int LOP_handler_skip(const struct LOP_HandlerList *hl, int i);
+int LOP_handler_children(const struct LOP_HandlerList *hl, int i);
+/* Fills the close/children links after the match, LOP_init() and generated matchers call it */
+void LOP_handler_link(struct LOP_HandlerList *hl);
+
+/* Calls the handlers of the task subtrees on d->threads threads, and then the rest of the handlers
+ * in order on the calling thread, with d->task_merge() in the place of every task.
+ * Every task is done before the first handler outside the tasks is called.
+ * Returns the first non-zero result in the source order, or LOP_ERROR_SCHEMA_UNKNOWN_CALLBACK */
+int LOP_dispatch(const struct LOP_HandlerList *hl, struct LOP_Dispatch *d);
+
 #endif // LOP_H
@@ -1,12 +1,19 @@
 #include <assert.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <stdarg.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
 
 #include <LOP.h>
+#include "FileMap.h"
 
 #include "KV.c"
+#include "SymbolSet.c"
+#include "Pattern.c"
 
 struct SchemaNode {
 	enum SchemaNodeType {
@@ -18,8 +25,18 @@ struct SchemaNode {
 	} sn_type;
 
 	bool optional;
-
-	const char *key;
+	/* #cut: once it has matched, the other alternatives of the enclosing oneof/listof item aren't tried */
+	bool cut;
+	/* #set: the symbol is any of symbol.members */
+	bool set;
+	/* #pattern: the symbol matches symbol.value as a regular expression, see Pattern.c */
+	bool pattern;
+	/* #lazy: only the list itself is matched, its content is left to LOP_force() */
+	bool lazy;
+
+	/* @callbacks, indexes in LOP_Schema.callback_table */
+	int *cb;
+	int cb_count;
 
 	struct SchemaNode *parent;
 	struct SchemaNode *next;
@@ -28,12 +45,25 @@ struct SchemaNode {
 	int child_count;
 
 	int ref;
+	/* Index in LOP_Profile.node, see schema_number() */
+	int id;
+	/* Where it's declared in the schema source, see LOP_schema_lint() */
+	struct LOP_Location loc;
+	/* The AST SNs it may start with, and of a rule, whether LOP.direct takes it, see Direct.c */
+	struct SchemaNode **first;
+	int first_count;
+	bool direct;
 
 	enum LOP_ASTNodeType type;
 
 	union {
 		struct {
+			/* The first one of the members */
 			char *value;
+			/* #set: all of the values, LOP_Handler.member is the index */
+			struct SymbolSet *members;
+			/* #pattern: value compiled */
+			struct Pattern *dfa;
 		} symbol;
 
 		struct {
@@ -42,6 +72,21 @@ struct SchemaNode {
 	};
 };
 
+/* Which value of the SN the symbol is: the member of #set, 0 if it's the only one or any, -1 if none */
+static int sn_member(struct SchemaNode *sn, const char *value)
+{
+	if (sn->symbol.members) {
+		return set_find(sn->symbol.members, value);
+	}
+	if (sn->symbol.dfa) {
+		return pattern_match(sn->symbol.dfa, value) ? 0 : -1;
+	}
+	if (sn->symbol.value && strcmp(sn->symbol.value, value)) {
+		return -1;
+	}
+	return 0;
+}
+
 static void dump_sn(struct SchemaNode *sn, int level, struct KV *kv)
 {
 	for (int i = 0; i < level; i++) {
@@ -82,13 +127,29 @@ static void dump_sn(struct SchemaNode *sn, int level, struct KV *kv)
 			assert(0);
 		}
 #undef CASE_TYPE
-		if (sn->type > LOP_TYPE_LIST_LAST && sn->symbol.value) {
+		if (sn->type > LOP_TYPE_LIST_LAST && sn->symbol.members) {
+			for (int i = 0; i < sn->symbol.members->count; i++) {
+				printf(", \"%s\"", sn->symbol.members->value[i]);
+			}
+		} else if (sn->type > LOP_TYPE_LIST_LAST && sn->symbol.value) {
 			printf(", \"%s\"", sn->symbol.value);
 		}
 	}
 	if (sn->optional) {
 		printf(", #optional");
 	}
+	if (sn->cut) {
+		printf(", #cut");
+	}
+	if (sn->set) {
+		printf(", #set");
+	}
+	if (sn->pattern) {
+		printf(", #pattern");
+	}
+	if (sn->lazy) {
+		printf(", #lazy");
+	}
 	printf("\n");
 }
 
@@ -110,6 +171,9 @@ static int s_report(enum LOP_ErrorType type, const char *str)
 	case LOP_ERROR_SCHEMA_MISSING_TOP:
 		fprintf(stderr, "Top rule '%s' not found\n", str);
 		break;
+	case LOP_ERROR_SCHEMA_OPERATORS:
+		fprintf(stderr, "'%s' is parsed with other operators\n", str);
+		break;
 	default:
 		assert(1);
 	}
@@ -117,400 +181,2405 @@ static int s_report(enum LOP_ErrorType type, const char *str)
 	return type;
 }
 
-static void handler_resize(struct LOP_HandlerList *hl, int count)
-{
-	hl->count = count;
-	hl->handler = realloc(hl->handler, hl->count * sizeof(*hl->handler));
-	if (hl->count) {
-		assert(hl->handler);
-	}
-}
-
-static void handler_add(struct LOP_HandlerList *hl, struct SchemaNode *sn, struct LOP_ASTNode *n, int delta)
+/* The handlers are only appended and rolled back by setting the count,
+ * so the memory is kept until LOP_deinit() */
+static void handler_reserve(struct LOP_HandlerList *hl, int count)
 {
-	/* FIXME remove? */
-	if (!sn->key) {
+	if (count <= hl->capacity) {
 		return;
 	}
 
-	handler_resize(hl, hl->count + 1);
+	while (hl->capacity < count) {
+		hl->capacity = hl->capacity ? hl->capacity * 2 : 64;
+	}
 
-	hl->handler[hl->count - 1] = (struct LOP_Handler) { sn->key, n, delta };
+	if (hl->compact) {
+		hl->compact_handler = realloc(hl->compact_handler, hl->capacity * sizeof(*hl->compact_handler));
+		hl->close = realloc(hl->close, hl->capacity * sizeof(*hl->close));
+		assert(hl->close);
+	} else {
+		hl->handler = realloc(hl->handler, hl->capacity * sizeof(*hl->handler));
+	}
+	assert(hl->handler);
+	hl->reallocs++;
 }
 
-struct Context {
-	struct KV *kv;
-	struct LOP_HandlerList *hl;
+/* Matcher state of an AST node, by LOP_ASTNode.id.
+ * It's owned by the match, so the AST itself stays untouched */
+struct MatchNode {
+	/* Position in LOP_HandlerList.node + 1 once a compact handler refers to the node */
+	uint32_t index;
+	struct SchemaNode *sn;
 };
 
+static void handler_begin(struct LOP_HandlerList *hl, bool compact, const struct LOP_CallbackTable *ct)
+{
+	/* A kept buffer is sized for the other record */
+	if (hl->compact != compact) {
+		free(hl->handler);
+		free(hl->close);
+		hl->handler = NULL;
+		hl->close = NULL;
+		hl->capacity = 0;
+	}
+
+	hl->compact = compact;
+	hl->ct = ct;
+	hl->count = 0;
+	hl->node_count = 0;
+	hl->reallocs = 0;
+}
+
 /* Because we have refs which have parent NULL,
  * but when they in tree, they do have parent.
- * That's why we need to construct this list in runtime. */
+ * That's why we need to construct this list in runtime.
+ * The contexts live in Context.cec and refer to the parent by index. */
 struct CEContext {
 	struct SchemaNode *sn;
-	struct CEContext *parent;
+	struct LOP_ASTNode *ast;
+	int parent;
 };
 
-static bool check_optional(struct Context *ctx, struct SchemaNode *sn)
-{
-	return sn->optional;
-}
+/* What is left to try when the entry (the callee) fails */
+enum CEState {
+	/* oneof/listof: the next child at ast */
+	CE_ALT,
+	/* seqof: the next child at ast, if the failed one is optional */
+	CE_SEQ,
+	/* List: the next child at the list head, if the failed one is optional.
+	 * It's also where the success of the list content returns to. */
+	CE_LIST,
+	/* listof continued with the next AST sibling: the next child, then close it and go up */
+	CE_NEXT_ALT,
+	/* seqof/list continued with the next AST sibling: the next SN sibling, if the failed one is optional */
+	CE_NEXT_SEQ,
+};
 
-/* "Close" SNs, until it's AST */
-static bool sn_ast_up(struct Context *ctx, struct CEContext *cec)
-{
-	struct CEContext *cecp = cec->parent;
+/* Suspended check_entry() with untried possibilities */
+struct CEFrame {
+	enum CEState state;
+	/* The context of the SN which has the possibilities */
+	int cec;
+	union {
+		/* The next child to try */
+		int i;
+		/* CE_NEXT_SEQ: the SN to try */
+		struct SchemaNode *next;
+	};
+	/* The AST node for CE_LIST, and where the possibilities are tried otherwise */
+	struct LOP_ASTNode *ast;
+	/* To restore on failure */
+	int hl_count;
+	int cec_count;
+};
 
-	while (cecp) {
-		switch (cecp->sn->sn_type) {
-		case SN_TYPE_ONEOF:
-		case SN_TYPE_LISTOF:
-		case SN_TYPE_REF:
-			break;
-		case SN_TYPE_SEQOF:
-		case SN_TYPE_AST:
-			for (struct SchemaNode *sn = cec->sn->next; sn; sn = sn->next) {
-				if (!check_optional(ctx, sn)) {
-					return false;
-				}
-			}
-			break;
-		}
+#define FAIL_EXPECTED 16
+#define FAIL_SYMBOL 32
+
+/* The furthest mismatch, to report on failure, see fail_at() */
+struct Failure {
+	/* 2 * offset + 1 of the first token of the node, + 2 past the last one: the end of its list.
+	 * 0 - none yet */
+	size_t pos;
+	/* Nodes starting with the same token: the lists it heads come first */
+	int depth;
+	struct LOP_Location loc;
+	/* What is there, copied as LOP_init_file() may free the node */
+	bool end;
+	/* The list is the root, its end is the end of the file */
+	bool root;
+	enum LOP_ASTNodeType type;
+	bool call;
+	char symbol[FAIL_SYMBOL];
+	/* The SNs which have failed there, NULL is the end of the list */
+	struct SchemaNode *expected[FAIL_EXPECTED];
+	int count;
+};
 
-		if (cecp->sn->sn_type == SN_TYPE_AST) {
-			break;
-		}
+/* LOP.profile: the attempt of the SN of a context, see profile_enter() */
+struct ProfileMark {
+	uint64_t start;
+	int depth;
+	/* Succeeded or failed, it's counted */
+	bool done;
+	/* No context of the same SN above it, its time is counted */
+	bool outer;
+};
 
-		handler_add(ctx->hl, cecp->sn, NULL, -1);
+struct Context {
+	struct KV *kv;
+	struct LOP_CallbackTable *ct;
+	struct LOP_HandlerList *hl;
+	/* LOP_validate(): no handlers at all */
+	bool validate;
+	/* By LOP_ASTNode.id - node_first */
+	struct MatchNode *node;
+	unsigned node_first;
+	/* LOP_force(): the #lazy list, the match ends with it */
+	struct LOP_ASTNode *force;
+
+	struct CEContext *cec;
+	int cec_count;
+	int cec_size;
+
+	struct CEFrame *frame;
+	int frame_count;
+	int frame_size;
+
+	/* LOP.threads, see items_match() */
+	int threads;
+	/* The frames below were there before the items were matched in parallel,
+	 * the serial match would have backtracked into the items instead of them */
+	int par_frame;
+	/* Backtracked into the items matched in parallel, match again serially */
+	bool restart;
+
+	/* Worker: the copy of the listof context, reaching it means the item has matched */
+	int stop;
+	/* Worker: the list of the items */
+	struct LOP_ASTNode *items;
+	/* Worker: the compact node indexes it gives go after the ones of the match */
+	uint32_t node_base;
+
+	/* LOP.item, see stream_commit(). LOP_validate_file() only frees the items */
+	int (*item)(void *arg, const struct LOP_HandlerList *hl, int depth);
+	void *item_arg;
+	bool free_items;
+	struct Stream {
+		/* The listof whose items are passed, -1 if none */
+		int cec;
+		/* Frames, handlers and compact nodes before the current item */
+		int frame;
+		int begin;
+		int node;
+		/* Handlers opened before the items */
+		int depth;
+		struct LOP_ASTNode *item;
+		/* The node before the first item, to unlink the freed ones */
+		struct LOP_ASTNode *prev;
+		/* The last item is still in use, it's freed with the next stream or after the match */
+		struct LOP_ASTNode *last;
+		struct LOP_ASTNode *last_prev;
+		int last_begin;
+	} stream;
+
+	/* LOP_init_file(): the AST is lexed as the match goes, see ast_next() */
+	bool lazy;
+	unsigned node_size;
+	unsigned node_count;
+	/* IDs of the freed items */
+	unsigned *free_id;
+	int free_count;
+	int free_size;
+
+	/* Stops the match: the result of LOP.item() or the lexer error */
+	int rc;
+
+	struct Failure fail;
+
+	/* LOP.profile, by context */
+	struct LOP_Profile *profile;
+	struct ProfileMark *mark;
+	int mark_size;
+	/* By SN: its contexts which are neither done nor dropped */
+	int *active;
+
+	/* SNs entered, see budget_spent() */
+	uint64_t steps;
+	uint64_t check_at;
+	uint64_t step_limit;
+	uint64_t deadline;
+	/* LOP_ERROR_BUDGET: the SN which wasn't entered, LOP_resume() starts with it */
+	int resume_cec;
+	struct LOP_ASTNode *resume_ast;
+};
 
-		cec = cecp;
-		cecp = cecp->parent;
+static void node_reserve(struct LOP_HandlerList *hl, int count)
+{
+	if (count <= hl->node_capacity) {
+		return;
 	}
 
-	if (!cecp) {
-		return true;
+	while (hl->node_capacity < count) {
+		hl->node_capacity = hl->node_capacity ? hl->node_capacity * 2 : 64;
 	}
-
-	return true;
+	hl->node = realloc(hl->node, hl->node_capacity * sizeof(*hl->node));
+	assert(hl->node);
 }
 
-/* Traverses all the possibilities, until the first success.
- * Uses recursion and native stack to track the state. */
-static bool check_entry(struct Context *ctx, struct LOP_ASTNode *ast, struct CEContext *cec)
+/* Only the nodes referred by the handlers get an index,
+ * it stays with the node when the handler is rolled back */
+static uint32_t handler_node(struct Context *ctx, struct LOP_ASTNode *n)
 {
-	struct CEContext cec_next = {
-		.parent = cec,
-	};
-	struct SchemaNode *sn = cec->sn;
 	struct LOP_HandlerList *hl = ctx->hl;
-	int hl_count = hl->count;
+	struct MatchNode *mn;
 
-	if (ast->parsed == 0) {
-		ast->parsed = 1;
+	if (n == NULL) {
+		return 0;
 	}
 
-	if (ast->sn == sn) {
-		return false;
+	mn = &ctx->node[n->id - ctx->node_first];
+	if (mn->index == 0) {
+		node_reserve(hl, hl->node_count + 1);
+		hl->node[hl->node_count++] = n;
+		mn->index = ctx->node_base + hl->node_count;
 	}
 
-	ast->sn = sn;
+	return mn->index;
+}
 
-	if (0) {
-		printf("----------------- 1 ------------------\n");
-		printf("SN:\n");
-		dump_sn_recurse(sn, 0, ctx->kv);
-		printf("AST:\n");
-		LOP_dump_ast(ast);
+/* One handler per callback, closed in the reverse order to keep them nested.
+ * member is the value of a #set SN which has matched, see LOP_Handler.member */
+static void handler_add(struct Context *ctx, struct SchemaNode *sn, struct LOP_ASTNode *n, int delta, int member)
+{
+	struct LOP_HandlerList *hl = ctx->hl;
+	int count = hl->count;
+
+	if (ctx->validate || !sn->cb_count) {
+		return;
 	}
 
-	switch (sn->sn_type) {
-	case SN_TYPE_ONEOF:
-	case SN_TYPE_LISTOF:
-		handler_add(hl, sn, ast, 1);
+	handler_reserve(hl, count + sn->cb_count);
+	hl->count = count + sn->cb_count;
 
-		for (int i = 0; i < sn->child_count; i++) {
-			cec_next.sn = sn->child[i];
+	for (int i = 0; i < sn->cb_count; i++) {
+		int id = sn->cb[delta == -1 ? sn->cb_count - 1 - i : i];
 
-			if (check_entry(ctx, ast, &cec_next)) {
-				return true;
-			}
+		if (hl->compact) {
+			hl->compact_handler[count + i] = (struct LOP_CompactHandler) { id << 2 | (delta + 1), handler_node(ctx, n) };
+			hl->close[count + i] = member;
+		} else {
+			hl->handler[count + i] = (struct LOP_Handler) {
+				.key = ctx->ct->data[id].name,
+				.n = n,
+				.id = id,
+				.delta = delta,
+				.member = member,
+			};
 		}
-		goto mismatch;
-	case SN_TYPE_SEQOF:
-		handler_add(hl, sn, ast, 1);
+	}
+}
 
-		for (int i = 0; i < sn->child_count; i++) {
-			cec_next.sn = sn->child[i];
+static int cec_push(struct Context *ctx, struct SchemaNode *sn, struct LOP_ASTNode *ast, int parent)
+{
+	if (ctx->cec_count == ctx->cec_size) {
+		ctx->cec_size = ctx->cec_size ? ctx->cec_size * 2 : 64;
+		ctx->cec = realloc(ctx->cec, ctx->cec_size * sizeof(*ctx->cec));
+		assert(ctx->cec);
+	}
 
-			if (check_entry(ctx, ast, &cec_next)) {
-				return true;
-			}
+	ctx->cec[ctx->cec_count] = (struct CEContext) { sn, ast, parent };
 
-			if (!check_optional(ctx, sn->child[i])) {
-				goto mismatch;
-			}
-		}
-		goto mismatch;
-	case SN_TYPE_REF:
-		handler_add(hl, sn, ast, 1);
+	return ctx->cec_count++;
+}
 
-		cec_next.sn = ctx->kv->children[sn->ref].value;
+static struct CEFrame *frame_push(struct Context *ctx, enum CEState state, int cec, struct LOP_ASTNode *ast)
+{
+	if (ctx->frame_count == ctx->frame_size) {
+		ctx->frame_size = ctx->frame_size ? ctx->frame_size * 2 : 64;
+		ctx->frame = realloc(ctx->frame, ctx->frame_size * sizeof(*ctx->frame));
+		assert(ctx->frame);
+	}
 
-		if (check_entry(ctx, ast, &cec_next)) {
-			return true;
-		}
-		goto mismatch;
-	case SN_TYPE_AST:
-		if (!ast) {
-			goto mismatch;
-		}
+	ctx->frame[ctx->frame_count] = (struct CEFrame) {
+		.state = state,
+		.cec = cec,
+		.ast = ast,
+		.hl_count = ctx->hl->count,
+		.cec_count = ctx->cec_count,
+	};
 
-		if (sn->type != ast->type) {
-			goto mismatch;
-		}
+	return &ctx->frame[ctx->frame_count++];
+}
 
-		if (sn->type < LOP_TYPE_LIST_LAST) {
-			if (sn->list.call != ast->list.call) {
-				goto mismatch;
-			}
+static uint64_t profile_now(void)
+{
+	struct timespec ts;
 
-			handler_add(hl, sn, ast, 1);
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec;
+}
 
-			for (int i = 0; i < sn->child_count; i++) {
-				cec_next.sn = sn->child[i];
+/* The SN at cec is attempted. It succeeds the first time it's closed, and it fails if its
+ * context is dropped before that: a success which is backtracked into later still counts */
+static void profile_enter(struct Context *ctx, int cec)
+{
+	struct ProfileMark *m;
+	struct LOP_ProfileNode *n;
+	int parent = ctx->cec[cec].parent;
+	int id = ctx->cec[cec].sn->id;
 
-				if (LOP_list_head(ast)) {
-					if (check_entry(ctx, LOP_list_head(ast), &cec_next)) {
-						break;
-					}
-				}
+	if (!ctx->profile) {
+		return;
+	}
 
-				if (!check_optional(ctx, sn->child[i])) {
-					goto mismatch;
-				}
-			}
+	if (ctx->mark_size < ctx->cec_size) {
+		ctx->mark_size = ctx->cec_size;
+		ctx->mark = realloc(ctx->mark, ctx->mark_size * sizeof(*ctx->mark));
+		assert(ctx->mark);
+	}
 
-			handler_add(hl, sn, NULL, -1);
-		} else {
-			handler_add(hl, sn, ast, 0);
+	m = &ctx->mark[cec];
+	*m = (struct ProfileMark) {
+		.start = profile_now(),
+		.depth = parent >= 0 ? ctx->mark[parent].depth + 1 : 0,
+		.outer = ctx->active[id]++ == 0,
+	};
 
-			if (sn->symbol.value != NULL) {
-				if (strcmp(sn->symbol.value, ast->symbol.value)) {
-					goto mismatch;
-				}
-			}
-		}
+	n = &ctx->profile->node[id];
+	n->attempts++;
+	if (n->max_depth < m->depth) {
+		n->max_depth = m->depth;
+	}
+}
 
-		break;
-	default:
-		assert(0);
+static void profile_done(struct Context *ctx, int cec, bool success)
+{
+	struct ProfileMark *m = &ctx->mark[cec];
+	int id = ctx->cec[cec].sn->id;
+	struct LOP_ProfileNode *n = &ctx->profile->node[id];
+
+	m->done = true;
+	ctx->active[id]--;
+	if (success) {
+		n->successes++;
+	} else {
+		n->failures++;
 	}
+	if (m->outer) {
+		n->ns += profile_now() - m->start;
+	}
+}
 
-	ast->parsed = 2;
+static void profile_success(struct Context *ctx, int cec)
+{
+	if (ctx->profile && !ctx->mark[cec].done) {
+		profile_done(ctx, cec, true);
+	}
+}
 
-	struct LOP_ASTNode *next_ast = ast->next;
+/* The contexts from count on are dropped by a backtrack */
+static void profile_drop(struct Context *ctx, int count)
+{
+	if (!ctx->profile) {
+		return;
+	}
 
-	if (next_ast == NULL) {
-		if (!sn_ast_up(ctx, cec)) {
-			goto mismatch;
-		}
-		ast = ast->parent;
-		if (ast) {
-			ast->parsed = 2;
+	for (int i = ctx->cec_count - 1; i >= count; i--) {
+		if (!ctx->mark[i].done) {
+			profile_done(ctx, i, false);
 		}
-		return true;
 	}
+}
+
+/* The SN of the frame tries its next possibility, the handlers of the failed one are dropped */
+static void profile_rollback(struct Context *ctx, struct CEFrame *f)
+{
+	if (ctx->profile && ctx->hl->count > f->hl_count) {
+		ctx->profile->node[ctx->cec[f->cec].sn->id].rollbacks++;
+	}
+}
 
-	struct CEContext *save;
+/* The deadline is checked by this many steps */
+#define DEADLINE_STEPS 1024
+
+/* LOP.max_steps and LOP.deadline of this run, steps are counted from here */
+static void budget_begin(struct Context *ctx, struct LOP *lop)
+{
+	ctx->step_limit = lop->max_steps ? ctx->steps + lop->max_steps : UINT64_MAX;
+	ctx->deadline = lop->deadline;
+	ctx->check_at = ctx->deadline ? ctx->steps : ctx->step_limit;
+}
 
-	if (next_ast->parsed == 0) {
-		next_ast->parsed = 1;
+/* check_entry() only calls it when the steps reach check_at, so the budget costs a comparison per SN */
+static bool budget_spent(struct Context *ctx)
+{
+	if (ctx->steps >= ctx->step_limit || (ctx->deadline && profile_now() >= ctx->deadline)) {
+		return true;
 	}
 
-	if (0) {
-		printf("----------------- 2 ------------------\n");
-		printf("SN:\n");
-		dump_sn_recurse(sn, 0, ctx->kv);
-		printf("AST:\n");
-		LOP_dump_ast(next_ast);
+	ctx->check_at = ctx->step_limit;
+	if (ctx->deadline && ctx->steps + DEADLINE_STEPS < ctx->check_at) {
+		ctx->check_at = ctx->steps + DEADLINE_STEPS;
 	}
+	return false;
+}
 
-again:
-	save = cec;
-	cec = cec->parent;
+static bool check_optional(struct Context *ctx, struct SchemaNode *sn)
+{
+	return sn->optional;
+}
 
-	while (cec && (cec->sn->sn_type == SN_TYPE_ONEOF || cec->sn->sn_type == SN_TYPE_REF)) {
-		handler_add(ctx->hl, cec->sn, NULL, -1);
+/* #cut: the SN at cec has matched, the frame of the enclosing oneof/listof item is left
+ * with nothing to try. The frames inside it are still there, they are the possibilities
+ * of the SN before the cut, and the list content returns through them */
+static void sn_cut(struct Context *ctx, int cec)
+{
+	int p = ctx->cec[cec].parent;
+	int i;
 
-		save = cec;
-		cec = cec->parent;
+	while (p >= 0 && p != ctx->stop &&
+	       ctx->cec[p].sn->sn_type != SN_TYPE_ONEOF && ctx->cec[p].sn->sn_type != SN_TYPE_LISTOF) {
+		p = ctx->cec[p].parent;
 	}
-
-	if (!cec) {
-		/* We have next_ast, but no SNs left */
-		goto mismatch;
+	if (p < 0 || p == ctx->stop) {
+		return;
 	}
 
-	sn = cec->sn;
-	cec_next.parent = cec;
-
-	if (0) {
-		printf("----------------- 3 ------------------\n");
-		printf("SN:\n");
-		dump_sn_recurse(sn, 0, ctx->kv);
-		printf("AST:\n");
-		LOP_dump_ast(next_ast);
+	/* The frames pushed inside it come later, the one of its first item may be gone with the last child */
+	for (i = ctx->frame_count - 1; i >= 0 && ctx->frame[i].cec > p; i--) {
 	}
+	if (i >= 0 && ctx->frame[i].cec == p) {
+		ctx->frame[i].i = ctx->cec[p].sn->child_count - 1;
+	}
+}
 
-	if (sn->sn_type == SN_TYPE_LISTOF) {
-		for (int i = 0; i < sn->child_count; i++) {
-			cec_next.sn = sn->child[i];
+/* The SN at cec has taken everything it matches */
+static void sn_close(struct Context *ctx, int cec)
+{
+	struct SchemaNode *sn = ctx->cec[cec].sn;
 
-			if (check_entry(ctx, next_ast, &cec_next)) {
-				return true;
-			}
-		}
+	handler_add(ctx, sn, NULL, -1, 0);
+	profile_success(ctx, cec);
+	if (sn->cut) {
+		sn_cut(ctx, cec);
+	}
+}
 
-		handler_add(ctx->hl, cec->sn, NULL, -1);
-		goto again;
+/* LOP_init_file(): the node is taken by the match, it gets an ID */
+static void ast_take(struct Context *ctx, struct LOP_ASTNode *n)
+{
+	if (n->id != LOP_AST_NO_ID) {
+		return;
 	}
 
-	if (sn->sn_type == SN_TYPE_SEQOF) {
-		for (sn = save->sn->next; sn; sn = sn->next) {
-			cec_next.sn = sn;
+	if (ctx->free_count) {
+		n->id = ctx->free_id[--ctx->free_count];
+		return;
+	}
 
-			if (check_entry(ctx, next_ast, &cec_next)) {
-				return true;
-			}
+	if (ctx->node_count == ctx->node_size) {
+		ctx->node = realloc(ctx->node, 2 * ctx->node_size * sizeof(*ctx->node));
+		assert(ctx->node);
+		memset(&ctx->node[ctx->node_size], 0, ctx->node_size * sizeof(*ctx->node));
+		ctx->node_size *= 2;
+	}
+	n->id = ctx->node_count++;
+}
 
-			if (!check_optional(ctx, sn)) {
-				goto mismatch;
+/* The IDs of a freed item are taken by the next nodes */
+static void ast_recycle(struct Context *ctx, struct LOP_ASTNode *root)
+{
+	struct LOP_ASTNode *n = root;
+
+	while (n) {
+		if (n->id != LOP_AST_NO_ID) {
+			if (ctx->free_count == ctx->free_size) {
+				ctx->free_size = ctx->free_size ? ctx->free_size * 2 : 64;
+				ctx->free_id = realloc(ctx->free_id, ctx->free_size * sizeof(*ctx->free_id));
+				assert(ctx->free_id);
 			}
+			memset(&ctx->node[n->id], 0, sizeof(*ctx->node));
+			ctx->free_id[ctx->free_count++] = n->id;
 		}
 
-		handler_add(ctx->hl, cec->sn, NULL, -1);
-		goto again;
-	}
-
-	if (sn->sn_type == SN_TYPE_AST) {
-		for (sn = save->sn->next; sn; sn = sn->next) {
-			cec_next.sn = sn;
-
-			if (check_entry(ctx, next_ast, &cec_next)) {
-				return true;
-			}
+		if (n->type < LOP_TYPE_LIST_LAST && LOP_list_head(n)) {
+			n = LOP_list_head(n);
+			continue;
+		}
 
-			if (!check_optional(ctx, sn)) {
-				goto mismatch;
-			}
+		while (n != root && n->next == NULL) {
+			n = n->parent;
 		}
-		goto mismatch;
+		n = n == root ? NULL : n->next;
 	}
-
-mismatch:
-	handler_resize(hl, hl_count);
-	return false;
 }
 
-static int kv_dump_sn(void *arg, struct KVEntry *kv)
+/* One more token, false at the end of the source or on an error */
+static bool ast_lex(struct Context *ctx)
 {
-	struct SchemaNode *sn = kv->value;
+	int rc = LOP_getAST_step();
 
-	printf("%s:\n", kv->key);
-	dump_sn_recurse(sn, 1, arg);
-	return 0;
+	if (rc < 0) {
+		ctx->rc = rc;
+	}
+	return rc > 0;
 }
 
-#include "ErrorReport.c"
-
-static struct LOP_ASTNode *ast_find_err(struct LOP_ASTNode *t)
+static struct LOP_ASTNode *ast_settle(struct Context *ctx, struct LOP_ASTNode *n)
 {
-	if (t == NULL || t->parsed != 1) {
+	if (n == NULL) {
 		return NULL;
 	}
 
-	if (t->type < LOP_TYPE_LIST_LAST) {
-		for (struct LOP_ASTNode *i = LOP_list_head(t); i; i = i->next) {
-			struct LOP_ASTNode *ret = ast_find_err(i);
-
-			if (ret) {
-				return ret;
-			}
-		}
+	while (!LOP_getAST_settled(n) && ast_lex(ctx)) {
 	}
-
-	return t;
+	ast_take(ctx, n);
+	return n;
 }
 
-int LOP_init(struct LOP *lop, const char *src, size_t len)
+/* The AST is read through these, LOP_init_file() lexes it as far as they need */
+static struct LOP_ASTNode *ast_head(struct Context *ctx, struct LOP_ASTNode *n)
 {
-	struct LOP_Schema *schema = lop->schema;
-	struct KV *kv = schema->kv;
-	struct LOP_ASTNode *ast;
-	struct SchemaNode *sn;
-	struct Context lop_ctx = {
-		.kv = kv,
-		.hl = &lop->hl,
-	};
-	int kv_key;
-	int rc = 0;
+	if (!ctx->lazy) {
+		return LOP_list_head(n);
+	}
 
-	/* If you want to see how it's look */
-	if (0) {
-		kv_iterate(kv, kv_dump_sn, kv);
+	while (!LOP_list_head(n) && LOP_getAST_open(n) && ast_lex(ctx)) {
 	}
+	return ast_settle(ctx, LOP_list_head(n));
+}
 
-	/* Get the top rule from which everything starts */
-	kv_key = kv_get_index(kv, lop->top_rule_name, false);
-	if (kv_key < 0) {
-		return s_report(LOP_ERROR_SCHEMA_MISSING_TOP, lop->top_rule_name);
+static struct LOP_ASTNode *ast_next(struct Context *ctx, struct LOP_ASTNode *n)
+{
+	if (n == ctx->force) {
+		return NULL;
+	}
+	if (!ctx->lazy) {
+		return n->next;
 	}
-	sn = kv->children[kv_key].value;
+
+	while (!n->next && n->parent && LOP_getAST_open(n->parent) && ast_lex(ctx)) {
+	}
+	return ast_settle(ctx, n->next);
+}
+
+static int stream_commit(struct Context *ctx, struct LOP_ASTNode *next);
+
+static size_t ast_offset(struct LOP_ASTNode *n)
+{
+	return n->loc.line_offset + n->loc.charno;
+}
+
+/* The element the list starts with, the operator of a binary one is in the middle */
+static struct LOP_ASTNode *ast_first(struct LOP_ASTNode *n)
+{
+	if (n->type > LOP_TYPE_LIST_LAST || !n->list.head) {
+		return NULL;
+	}
+	return n->type == LOP_TYPE_LIST_OPERATOR_BINARY ? n->list.head->next : n->list.head;
+}
+
+static void fail_add(struct Failure *f, struct SchemaNode *sn)
+{
+	for (int i = 0; i < f->count; i++) {
+		if (f->expected[i] == sn) {
+			return;
+		}
+	}
+	if (f->count < FAIL_EXPECTED) {
+		f->expected[f->count++] = sn;
+	}
+}
+
+/* Only the furthest position is kept, so it's a comparison per mismatch */
+static bool fail_further(struct Failure *f, size_t pos, int depth, struct SchemaNode *sn)
+{
+	if (pos < f->pos || (pos == f->pos && depth < f->depth)) {
+		return false;
+	}
+	if (pos == f->pos && depth == f->depth) {
+		fail_add(f, sn);
+		return false;
+	}
+
+	f->pos = pos;
+	f->depth = depth;
+	f->count = 0;
+	fail_add(f, sn);
+	return true;
+}
+
+/* sn has failed at n. It's where the first token of n is: LOP_init_file() may not have lexed
+ * the elements after the one of the list itself yet, but the ones before it are there */
+static void fail_at(struct Context *ctx, struct SchemaNode *sn, struct LOP_ASTNode *n)
+{
+	struct Failure *f = &ctx->fail;
+	struct LOP_ASTNode *first = n;
+	int depth = 0;
+
+	for (struct LOP_ASTNode *p = n; p->parent && ast_first(p->parent) == p; p = p->parent) {
+		depth++;
+	}
+	for (struct LOP_ASTNode *i = ast_first(n); i; i = ast_first(i)) {
+		if (ast_offset(i) < ast_offset(first)) {
+			first = i;
+		}
+	}
+
+	if (!fail_further(f, 2 * ast_offset(first) + 1, depth, sn)) {
+		return;
+	}
+
+	f->loc = first->loc;
+	f->end = false;
+	f->root = n->parent && !n->parent->parent;
+	f->type = n->type;
+	f->call = n->type < LOP_TYPE_LIST_LAST && n->list.call;
+	f->symbol[0] = 0;
+	if (n->type > LOP_TYPE_LIST_LAST && n->type != LOP_TYPE_NIL) {
+		snprintf(f->symbol, sizeof(f->symbol), "%s", n->symbol.value);
+	}
+}
+
+/* sn was expected after n, at the end of the list: n is its last element or the empty list itself */
+static void fail_end(struct Context *ctx, struct SchemaNode *sn, struct LOP_ASTNode *n, struct LOP_ASTNode *list)
+{
+	struct Failure *f = &ctx->fail;
+	struct LOP_ASTNode *last = n;
+
+	for (struct LOP_ASTNode *i = n; i->type < LOP_TYPE_LIST_LAST && (i = i->list.tail);) {
+		if (ast_offset(i) > ast_offset(last)) {
+			last = i;
+		}
+	}
+
+	if (!fail_further(f, 2 * ast_offset(last) + 2, 0, sn)) {
+		return;
+	}
+
+	/* Right after the token */
+	f->loc = last->loc;
+	if (last->type == LOP_TYPE_ID || last->type == LOP_TYPE_NUMBER) {
+		f->loc.charno += strlen(last->symbol.value);
+	}
+	f->end = true;
+	f->root = !list->parent;
+}
+
+/* The list may end where its last SN is optional */
+static void fail_optional_end(struct Context *ctx, struct SchemaNode *sn, struct SchemaNode *next, struct LOP_ASTNode *ast)
+{
+	if (sn->sn_type == SN_TYPE_AST && !next->next && check_optional(ctx, next)) {
+		fail_at(ctx, NULL, ast);
+	}
+}
+
+static void fail_merge(struct Failure *to, struct Failure *from)
+{
+	if (from->pos > to->pos || (from->pos == to->pos && from->depth > to->depth)) {
+		*to = *from;
+		return;
+	}
+	if (from->pos == to->pos && from->depth == to->depth) {
+		for (int i = 0; i < from->count; i++) {
+			fail_add(to, from->expected[i]);
+		}
+	}
+}
+
+/* "Close" SNs, until it's AST */
+static bool sn_ast_up(struct Context *ctx, int cec, struct LOP_ASTNode *ast)
+{
+	int cecp = ctx->cec[cec].parent;
+
+	while (cecp >= 0 && cecp != ctx->stop) {
+		struct SchemaNode *sn = ctx->cec[cecp].sn;
+
+		switch (sn->sn_type) {
+		case SN_TYPE_ONEOF:
+		case SN_TYPE_LISTOF:
+		case SN_TYPE_REF:
+			break;
+		case SN_TYPE_SEQOF:
+		case SN_TYPE_AST:
+			for (struct SchemaNode *i = ctx->cec[cec].sn->next; i; i = i->next) {
+				if (!check_optional(ctx, i)) {
+					fail_end(ctx, i, ast, ast->parent);
+					return false;
+				}
+			}
+			break;
+		}
+
+		if (sn->sn_type == SN_TYPE_AST) {
+			break;
+		}
+
+		if (cecp == ctx->stream.cec) {
+			ctx->rc = stream_commit(ctx, NULL);
+			if (ctx->rc) {
+				return false;
+			}
+		}
+
+		sn_close(ctx, cecp);
+
+		cec = cecp;
+		cecp = ctx->cec[cecp].parent;
+	}
+
+	return true;
+}
+
+static bool items_parallel(struct Context *ctx, struct SchemaNode *sn, struct LOP_ASTNode *ast);
+static struct LOP_ASTNode *items_match(struct Context *ctx, int cec, struct LOP_ASTNode *ast, int *k);
+static bool stream_listof(struct Context *ctx, int cec);
+static void stream_begin(struct Context *ctx, int cec, struct LOP_ASTNode *ast);
+
+/* Traverses all the possibilities, until the first success.
+ *
+ * It's a continuation-passing matcher: an SN which has matched the AST node
+ * goes on with the next AST sibling by itself, so "success" means the rest of
+ * the list has matched as well. The possibilities are tracked on the heap
+ * (Context.frame), so the native stack doesn't grow with the list length.
+ * A frame is only pushed if there is something left to try, or for the list
+ * content, which is committed once it has matched. */
+static bool check_entry(struct Context *ctx, struct LOP_ASTNode *ast, int cec)
+{
+	struct LOP_HandlerList *hl = ctx->hl;
+	struct LOP_ASTNode *next_ast;
+	struct SchemaNode *sn;
+	struct CEFrame *f;
+	int hl_count = hl->count;
+	int save;
+	int i;
+
+enter:
+	/* Stopped before the SN is entered, so it's where the match resumes */
+	if (ctx->steps == ctx->check_at && budget_spent(ctx)) {
+		ctx->rc = LOP_ERROR_BUDGET;
+		ctx->resume_cec = cec;
+		ctx->resume_ast = ast;
+		return false;
+	}
+	ctx->steps++;
+
+	sn = ctx->cec[cec].sn;
+	profile_enter(ctx, cec);
+
+	if (ctx->node[ast->id - ctx->node_first].sn == sn) {
+		goto mismatch;
+	}
+
+	/* Left recursion: the SN is entered again without taking anything */
+	for (int p = ctx->cec[cec].parent; p >= 0 && ctx->cec[p].ast == ast; p = ctx->cec[p].parent) {
+		if (ctx->cec[p].sn == sn) {
+			goto mismatch;
+		}
+	}
+
+	ctx->node[ast->id - ctx->node_first].sn = sn;
+
+	if (0) {
+		printf("----------------- 1 ------------------\n");
+		printf("SN:\n");
+		dump_sn_recurse(sn, 0, ctx->kv);
+		printf("AST:\n");
+		LOP_dump_ast(ast);
+	}
+
+	switch (sn->sn_type) {
+	case SN_TYPE_ONEOF:
+	case SN_TYPE_LISTOF:
+		handler_add(ctx, sn, ast, 1, 0);
+
+		if (sn->child_count == 0) {
+			goto mismatch;
+		}
+		if (sn->sn_type == SN_TYPE_LISTOF && items_parallel(ctx, sn, ast)) {
+			next_ast = items_match(ctx, cec, ast, &i);
+			if (next_ast == NULL) {
+				/* An item has failed, it's up to the serial match what takes it */
+				ctx->restart = true;
+				hl->count = hl_count;
+				return false;
+			}
+
+			/* Continue as the serial match does after the last item */
+			ctx->par_frame = ctx->frame_count;
+			ast = next_ast;
+			cec = cec_push(ctx, sn->child[i], ast, cec);
+			goto matched;
+		}
+		if (sn->sn_type == SN_TYPE_LISTOF && stream_listof(ctx, cec)) {
+			stream_begin(ctx, cec, ast);
+		}
+		if (sn->child_count > 1) {
+			frame_push(ctx, CE_ALT, cec, ast)->i = 0;
+		}
+		cec = cec_push(ctx, sn->child[0], ast, cec);
+		goto enter;
+	case SN_TYPE_SEQOF:
+		handler_add(ctx, sn, ast, 1, 0);
+
+		if (sn->child_count == 0) {
+			goto mismatch;
+		}
+		if (sn->child_count > 1 && check_optional(ctx, sn->child[0])) {
+			frame_push(ctx, CE_SEQ, cec, ast)->i = 0;
+		}
+		cec = cec_push(ctx, sn->child[0], ast, cec);
+		goto enter;
+	case SN_TYPE_REF:
+		handler_add(ctx, sn, ast, 1, 0);
+
+		cec = cec_push(ctx, ctx->kv->children[sn->ref].value, ast, cec);
+		goto enter;
+	case SN_TYPE_AST:
+		if (!ast) {
+			goto mismatch;
+		}
+
+		if (sn->type != ast->type) {
+			fail_at(ctx, sn, ast);
+			goto mismatch;
+		}
+
+		if (sn->type < LOP_TYPE_LIST_LAST) {
+			if (sn->list.call != ast->list.call) {
+				fail_at(ctx, sn, ast);
+				goto mismatch;
+			}
+
+			/* Its SN is what LOP_force() needs, in the place of the #set member */
+			if (sn->lazy && ast != ctx->force) {
+				handler_add(ctx, sn, ast, 0, sn->id);
+				break;
+			}
+
+			handler_add(ctx, sn, ast, 1, 0);
+
+			next_ast = ast_head(ctx, ast);
+			if (ctx->rc) {
+				goto mismatch;
+			}
+
+			if (next_ast && sn->child_count) {
+				frame_push(ctx, CE_LIST, cec, ast)->i = 0;
+				ast = next_ast;
+				cec = cec_push(ctx, sn->child[0], ast, cec);
+				goto enter;
+			}
+
+			/* Nothing to match the children with */
+			for (i = 0; i < sn->child_count; i++) {
+				if (!check_optional(ctx, sn->child[i])) {
+					fail_end(ctx, sn->child[i], ast, ast);
+					goto mismatch;
+				}
+			}
+
+			/* Every child is optional and none of them took the elements */
+			if (next_ast) {
+				fail_at(ctx, NULL, next_ast);
+				goto mismatch;
+			}
+
+			handler_add(ctx, sn, NULL, -1, 0);
+		} else {
+			int member = sn_member(sn, ast->symbol.value);
+
+			handler_add(ctx, sn, ast, 0, member);
+
+			if (member < 0) {
+				fail_at(ctx, sn, ast);
+				goto mismatch;
+			}
+		}
+
+		break;
+	default:
+		assert(0);
+	}
+
+matched:
+	profile_success(ctx, cec);
+	if (ctx->cec[cec].sn->cut) {
+		sn_cut(ctx, cec);
+	}
+
+	next_ast = ast_next(ctx, ast);
+	if (ctx->rc) {
+		goto mismatch;
+	}
+
+	if (next_ast == NULL) {
+		if (!sn_ast_up(ctx, cec, ast)) {
+			goto mismatch;
+		}
+		ast = ast->parent;
+		goto success;
+	}
+
+	if (0) {
+		printf("----------------- 2 ------------------\n");
+		printf("SN:\n");
+		dump_sn_recurse(sn, 0, ctx->kv);
+		printf("AST:\n");
+		LOP_dump_ast(next_ast);
+	}
+
+	save = cec;
+
+again:
+	cec = ctx->cec[save].parent;
+
+	while (cec >= 0 && (ctx->cec[cec].sn->sn_type == SN_TYPE_ONEOF || ctx->cec[cec].sn->sn_type == SN_TYPE_REF)) {
+		sn_close(ctx, cec);
+
+		save = cec;
+		cec = ctx->cec[cec].parent;
+	}
+
+	if (cec < 0) {
+		/* We have next_ast, but no SNs left */
+		fail_at(ctx, NULL, next_ast);
+		goto mismatch;
+	}
+
+	if (cec == ctx->stop) {
+		/* Worker: the item has matched */
+		return true;
+	}
+
+	sn = ctx->cec[cec].sn;
+
+	if (0) {
+		printf("----------------- 3 ------------------\n");
+		printf("SN:\n");
+		dump_sn_recurse(sn, 0, ctx->kv);
+		printf("AST:\n");
+		LOP_dump_ast(next_ast);
+	}
+
+	if (sn->sn_type == SN_TYPE_LISTOF) {
+		if (sn->child_count == 0) {
+			sn_close(ctx, cec);
+			save = cec;
+			goto again;
+		}
+
+		if (cec == ctx->stream.cec) {
+			ctx->rc = stream_commit(ctx, next_ast);
+			if (ctx->rc) {
+				goto mismatch;
+			}
+		}
+
+		frame_push(ctx, CE_NEXT_ALT, cec, next_ast)->i = 0;
+		ast = next_ast;
+		cec = cec_push(ctx, sn->child[0], ast, cec);
+		goto enter;
+	}
+
+	if (sn->sn_type == SN_TYPE_SEQOF || sn->sn_type == SN_TYPE_AST) {
+		struct SchemaNode *next = ctx->cec[save].sn->next;
+
+		if (next == NULL) {
+			if (sn->sn_type == SN_TYPE_AST) {
+				fail_at(ctx, NULL, next_ast);
+				goto mismatch;
+			}
+			sn_close(ctx, cec);
+			save = cec;
+			goto again;
+		}
+
+		/* For the list, there is nothing left to do if it fails */
+		if (sn->sn_type == SN_TYPE_SEQOF || (check_optional(ctx, next) && next->next)) {
+			frame_push(ctx, CE_NEXT_SEQ, cec, next_ast)->next = next;
+		}
+		fail_optional_end(ctx, sn, next, next_ast);
+		ast = next_ast;
+		cec = cec_push(ctx, next, ast, cec);
+		goto enter;
+	}
+
+mismatch:
+	if (ctx->rc) {
+		hl->count = hl_count;
+		return false;
+	}
+
+	if (ctx->frame_count <= ctx->par_frame) {
+		ctx->restart = true;
+		hl->count = hl_count;
+		return false;
+	}
+
+	/* Resume the latest frame with something left to try */
+	if (ctx->frame_count == 0) {
+		profile_drop(ctx, 0);
+		hl->count = hl_count;
+		return false;
+	}
+
+	f = &ctx->frame[ctx->frame_count - 1];
+
+	profile_rollback(ctx, f);
+	profile_drop(ctx, f->cec_count);
+	hl->count = f->hl_count;
+	ctx->cec_count = f->cec_count;
+
+	cec = f->cec;
+	sn = ctx->cec[cec].sn;
+	ast = f->ast;
+
+	switch (f->state) {
+	case CE_ALT:
+	case CE_NEXT_ALT:
+		i = ++f->i;
+
+		if (i < sn->child_count) {
+			/* The last child of oneof/listof has nothing to return to */
+			if (f->state == CE_ALT && i == sn->child_count - 1) {
+				ctx->frame_count--;
+			}
+			cec = cec_push(ctx, sn->child[i], ast, cec);
+			goto enter;
+		}
+
+		ctx->frame_count--;
+
+		if (f->state == CE_ALT) {
+			goto mismatch;
+		}
+
+		/* Close the listof and continue with its parent */
+		next_ast = ast;
+		sn_close(ctx, cec);
+		save = cec;
+		goto again;
+	case CE_SEQ:
+	case CE_LIST:
+		i = f->i;
+
+		if (!check_optional(ctx, sn->child[i])) {
+			ctx->frame_count--;
+			goto mismatch;
+		}
+		if (++i == sn->child_count) {
+			/* Every child is optional and none of them took the elements */
+			if (f->state == CE_LIST) {
+				fail_at(ctx, NULL, LOP_list_head(ast));
+			}
+			ctx->frame_count--;
+			goto mismatch;
+		}
+
+		f->i = i;
+		if (f->state == CE_LIST) {
+			ast = LOP_list_head(ast);
+		} else if (!check_optional(ctx, sn->child[i]) || i == sn->child_count - 1) {
+			ctx->frame_count--;
+		}
+		cec = cec_push(ctx, sn->child[i], ast, cec);
+		goto enter;
+	case CE_NEXT_SEQ:
+		if (!check_optional(ctx, f->next)) {
+			ctx->frame_count--;
+			goto mismatch;
+		}
+
+		f->next = f->next->next;
+
+		if (f->next) {
+			struct SchemaNode *next = f->next;
+
+			if (sn->sn_type == SN_TYPE_AST && (!check_optional(ctx, next) || !next->next)) {
+				ctx->frame_count--;
+			}
+			fail_optional_end(ctx, sn, next, ast);
+			cec = cec_push(ctx, next, ast, cec);
+			goto enter;
+		}
+
+		ctx->frame_count--;
+
+		if (sn->sn_type == SN_TYPE_AST) {
+			goto mismatch;
+		}
+
+		/* Close the seqof and continue with its parent */
+		next_ast = ast;
+		sn_close(ctx, cec);
+		save = cec;
+		goto again;
+	}
+
+	assert(0);
+
+success:
+	/* The list content has matched up to the end of the list, it's committed:
+	 * drop the possibilities inside and continue with the list itself */
+	while (ctx->frame_count && ctx->frame[ctx->frame_count - 1].state != CE_LIST) {
+		ctx->frame_count--;
+	}
+
+	if (ctx->frame_count == 0) {
+		return true;
+	}
+
+	f = &ctx->frame[--ctx->frame_count];
+
+	/* The items matched in parallel are committed with the list */
+	if (ctx->frame_count < ctx->par_frame) {
+		ctx->par_frame = -1;
+	}
+
+	ctx->cec_count = f->cec_count;
+
+	cec = f->cec;
+	sn = ctx->cec[cec].sn;
+	ast = f->ast;
+
+	handler_add(ctx, sn, NULL, -1, 0);
+	goto matched;
+}
+
+/* Fewer items per thread aren't worth a thread */
+#define ITEMS_PER_THREAD 256
+
+/* The SN takes exactly one AST node, so its matches of the items don't depend on each other */
+static bool sn_single(struct Context *ctx, struct SchemaNode *sn, int depth)
+{
+	if (depth > 16) {
+		return false;
+	}
+
+	switch (sn->sn_type) {
+	case SN_TYPE_AST:
+		return true;
+	case SN_TYPE_REF:
+		return sn_single(ctx, ctx->kv->children[sn->ref].value, depth + 1);
+	case SN_TYPE_ONEOF:
+		for (int i = 0; i < sn->child_count; i++) {
+			if (!sn_single(ctx, sn->child[i], depth + 1)) {
+				return false;
+			}
+		}
+		return true;
+	default:
+		return false;
+	}
+}
+
+/* Only the first listof at a time, until it's committed with its list */
+static bool items_parallel(struct Context *ctx, struct SchemaNode *sn, struct LOP_ASTNode *ast)
+{
+	int count = 0;
+
+	if (ctx->threads < 2 || ctx->par_frame >= 0 || ctx->item || ctx->lazy || ctx->profile ||
+	    ctx->step_limit != UINT64_MAX || ctx->deadline) {
+		return false;
+	}
+
+	for (; ast && count < 2 * ITEMS_PER_THREAD; ast = ast->next) {
+		count++;
+	}
+	if (count < 2 * ITEMS_PER_THREAD) {
+		return false;
+	}
+
+	for (int i = 0; i < sn->child_count; i++) {
+		if (!sn_single(ctx, sn->child[i], 0)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+struct ItemChunk {
+	struct Context ctx;
+	struct LOP_HandlerList hl;
+	struct SchemaNode *sn;
+	struct LOP_ASTNode **item;
+	int count;
+	/* The child of the listof which has matched the last item */
+	int k;
+	atomic_bool *failed;
+	pthread_t thread;
+	bool started;
+};
+
+/* The contexts the left recursion check of the first item looks at, the listof is the last */
+static int items_chain(struct Context *w, struct Context *ctx, int cec)
+{
+	int parent = ctx->cec[cec].parent;
+
+	if (parent >= 0 && ctx->cec[parent].ast == ctx->cec[cec].ast) {
+		parent = items_chain(w, ctx, parent);
+	} else {
+		parent = -1;
+	}
+
+	return cec_push(w, ctx->cec[cec].sn, ctx->cec[cec].ast, parent);
+}
+
+/* Matches the items the way CE_NEXT_ALT does, but stops at the listof */
+static void *items_chunk(void *arg)
+{
+	struct ItemChunk *c = arg;
+	struct SchemaNode *sn = c->sn;
+	int cec_count = c->ctx.cec_count;
+
+	for (int i = 0; i < c->count && !atomic_load(c->failed); i++) {
+		struct LOP_ASTNode *ast = c->item[i];
+		int k;
+
+		for (k = 0; k < sn->child_count; k++) {
+			c->ctx.cec_count = cec_count;
+			c->ctx.frame_count = 0;
+
+			if (check_entry(&c->ctx, ast, cec_push(&c->ctx, sn->child[k], ast, c->ctx.stop))) {
+				break;
+			}
+		}
+
+		if (k == sn->child_count) {
+			atomic_store(c->failed, true);
+			break;
+		}
+		c->k = k;
+	}
+
+	return NULL;
+}
+
+/* Appends the handlers of the chunk, the compact node indexes it gave are moved after the ones given so far */
+static void items_merge(struct Context *ctx, struct ItemChunk *c, uint32_t base)
+{
+	struct LOP_HandlerList *hl = ctx->hl;
+	struct LOP_HandlerList *w = &c->hl;
+	uint32_t shift = hl->node_count - base;
+
+	handler_reserve(hl, hl->count + w->count);
+
+	if (!hl->compact) {
+		if (w->count) {
+			memcpy(&hl->handler[hl->count], w->handler, w->count * sizeof(*w->handler));
+		}
+		hl->count += w->count;
+		return;
+	}
+
+	for (int i = 0; i < w->count; i++) {
+		struct LOP_CompactHandler h = w->compact_handler[i];
+
+		if (h.node > base) {
+			h.node += shift;
+		}
+		hl->close[hl->count] = w->close[i];
+		hl->compact_handler[hl->count++] = h;
+	}
+
+	node_reserve(hl, hl->node_count + w->node_count);
+	for (int i = 0; i < w->node_count; i++) {
+		hl->node[hl->node_count++] = w->node[i];
+		ctx->node[w->node[i]->id - ctx->node_first].index = hl->node_count;
+	}
+}
+
+/* The items of the listof from ast to the end of the list are split between the threads,
+ * each matches its items into its own handler list, and the lists are appended in order.
+ * The AST nodes of the items are disjoint, so the workers share the MatchNode table.
+ * Returns the last item and the child which has matched it, or NULL if any item has failed. */
+static struct LOP_ASTNode *items_match(struct Context *ctx, int cec, struct LOP_ASTNode *ast, int *k)
+{
+	struct SchemaNode *sn = ctx->cec[cec].sn;
+	struct LOP_ASTNode **item = NULL;
+	struct LOP_ASTNode *last = NULL;
+	struct ItemChunk *chunk;
+	uint32_t base = ctx->hl->node_count;
+	atomic_bool failed = false;
+	int count = 0;
+	int size = 0;
+	int threads;
+
+	for (struct LOP_ASTNode *i = ast; i; i = i->next) {
+		if (count == size) {
+			size = size ? size * 2 : 1024;
+			item = realloc(item, size * sizeof(*item));
+			assert(item);
+		}
+		item[count++] = i;
+	}
+
+	threads = count / ITEMS_PER_THREAD;
+	if (threads > ctx->threads) {
+		threads = ctx->threads;
+	}
+
+	chunk = calloc(threads, sizeof(*chunk));
+	assert(chunk);
+
+	for (int t = 0; t < threads; t++) {
+		struct ItemChunk *c = &chunk[t];
+		int from = (long)count * t / threads;
+		int to = (long)count * (t + 1) / threads;
+
+		c->hl = (struct LOP_HandlerList) {
+			.compact = ctx->hl->compact,
+			.ct = ctx->hl->ct,
+		};
+		c->ctx = (struct Context) {
+			.kv = ctx->kv,
+			.ct = ctx->ct,
+			.hl = &c->hl,
+			.validate = ctx->validate,
+			.node = ctx->node,
+			.node_first = ctx->node_first,
+			.par_frame = -1,
+			/* items_parallel() leaves the matches with a budget to the serial one */
+			.step_limit = UINT64_MAX,
+			.check_at = UINT64_MAX,
+			.items = ast->parent,
+			.node_base = base,
+		};
+		c->ctx.stop = items_chain(&c->ctx, ctx, cec);
+		c->sn = sn;
+		c->item = &item[from];
+		c->count = to - from;
+		c->failed = &failed;
+	}
+
+	/* The first chunk is ours, a thread which can't start is run by us as well */
+	for (int t = 1; t < threads; t++) {
+		chunk[t].started = pthread_create(&chunk[t].thread, NULL, items_chunk, &chunk[t]) == 0;
+		if (!chunk[t].started) {
+			items_chunk(&chunk[t]);
+		}
+	}
+	items_chunk(&chunk[0]);
+
+	for (int t = 1; t < threads; t++) {
+		if (chunk[t].started) {
+			pthread_join(chunk[t].thread, NULL);
+		}
+	}
+
+	if (!failed) {
+		for (int t = 0; t < threads; t++) {
+			items_merge(ctx, &chunk[t], base);
+			fail_merge(&ctx->fail, &chunk[t].ctx.fail);
+		}
+		*k = chunk[threads - 1].k;
+		last = item[count - 1];
+	}
+
+	for (int t = 0; t < threads; t++) {
+		free(chunk[t].ctx.cec);
+		free(chunk[t].ctx.frame);
+		free(chunk[t].hl.handler);
+		free(chunk[t].hl.close);
+		free(chunk[t].hl.node);
+	}
+	free(chunk);
+	free(item);
+
+	return last;
+}
+
+/* The items of the listof can't be backtracked into once they have matched, so they can be passed on */
+static bool stream_listof(struct Context *ctx, int cec)
+{
+	struct SchemaNode *sn = ctx->cec[cec].sn;
+	int save = cec;
+	int p;
+
+	if ((!ctx->item && !ctx->free_items) || ctx->stream.cec >= 0) {
+		return false;
+	}
+
+	/* Another match of an item can't change what follows it */
+	for (int i = 0; i < sn->child_count; i++) {
+		if (!sn_single(ctx, sn->child[i], 0)) {
+			return false;
+		}
+	}
+
+	/* Closing it before an item fails, nothing is after it in its list */
+	for (p = ctx->cec[cec].parent; p >= 0; p = ctx->cec[p].parent) {
+		if (ctx->cec[p].sn->sn_type != SN_TYPE_ONEOF && ctx->cec[p].sn->sn_type != SN_TYPE_REF) {
+			break;
+		}
+		save = p;
+	}
+	if (p < 0 || ctx->cec[p].sn->sn_type != SN_TYPE_AST || ctx->cec[save].sn->next) {
+		return false;
+	}
+
+	/* And nothing is left to try before it */
+	for (int i = ctx->frame_count - 1; i >= 0; i--) {
+		struct CEFrame *f = &ctx->frame[i];
+		struct SchemaNode *fsn = ctx->cec[f->cec].sn;
+
+		if (f->state != CE_LIST || (check_optional(ctx, fsn->child[f->i]) && f->i + 1 < fsn->child_count)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+static void stream_free(struct Context *ctx, struct LOP_ASTNode *n, struct LOP_ASTNode *prev, int begin);
+
+static void stream_begin(struct Context *ctx, int cec, struct LOP_ASTNode *ast)
+{
+	struct LOP_HandlerList *hl = ctx->hl;
+	struct LOP_ASTNode *prev = NULL;
+	int depth = 0;
+
+	for (struct LOP_ASTNode *i = LOP_list_head(ast->parent); i != ast; i = i->next) {
+		prev = i;
+	}
+
+	for (int i = 0; i < hl->count; i++) {
+		depth += LOP_handler_delta(hl, i);
+	}
+
+	if (ctx->stream.last) {
+		stream_free(ctx, ctx->stream.last, ctx->stream.last_prev, ctx->stream.last_begin);
+		ctx->stream.last = NULL;
+	}
+
+	ctx->stream.cec = cec;
+	ctx->stream.frame = ctx->frame_count;
+	ctx->stream.begin = hl->count;
+	ctx->stream.node = hl->node_count;
+	ctx->stream.depth = depth;
+	ctx->stream.item = ast;
+	ctx->stream.prev = prev;
+}
+
+static void stream_free(struct Context *ctx, struct LOP_ASTNode *n, struct LOP_ASTNode *prev, int begin)
+{
+	struct LOP_HandlerList *hl = ctx->hl;
+	struct LOP_ASTNode *parent = n->parent;
+
+	/* The listof and what is opened with it at the first item */
+	for (int i = (hl->count < begin ? hl->count : begin) - 1;
+	     i >= 0 && LOP_handler_node(hl, i) == n; i--) {
+		if (hl->compact) {
+			hl->compact_handler[i].node = 0;
+		} else {
+			hl->handler[i].n = NULL;
+		}
+	}
+
+	if (prev) {
+		prev->next = n->next;
+	} else {
+		parent->list.head = n->next;
+	}
+	if (parent->list.tail == n) {
+		parent->list.tail = prev;
+	}
+
+	n->next = NULL;
+	if (ctx->lazy) {
+		ast_recycle(ctx, n);
+	}
+	LOP_delAST(n);
+}
+
+/* The current item has matched and nothing can backtrack into it: its frames are dropped,
+ * and its handlers are passed to LOP.item() and removed. next is the next item, if any */
+static int stream_commit(struct Context *ctx, struct LOP_ASTNode *next)
+{
+	struct LOP_HandlerList *hl = ctx->hl;
+	struct LOP_HandlerList item = *hl;
+	struct LOP_ASTNode *n = ctx->stream.item;
+	int begin = ctx->stream.begin;
+	int rc = 0;
+
+	ctx->frame_count = ctx->stream.frame;
+	ctx->cec_count = ctx->stream.cec + 1;
+
+	if (ctx->item) {
+		if (hl->compact) {
+			item.compact_handler = &hl->compact_handler[begin];
+		} else {
+			item.handler = &hl->handler[begin];
+		}
+		item.count = hl->count - begin;
+		item.capacity = item.count;
+		item.close = hl->close ? &hl->close[begin] : NULL;
+		LOP_handler_link(&item);
+
+		rc = ctx->item(ctx->item_arg, &item, ctx->stream.depth);
+	}
+
+	/* Nothing refers to the nodes of the item anymore */
+	for (int i = ctx->stream.node; i < hl->node_count; i++) {
+		ctx->node[hl->node[i]->id - ctx->node_first].index = 0;
+	}
+	hl->node_count = ctx->stream.node;
+	hl->count = begin;
+
+	if (ctx->free_items) {
+		if (next) {
+			stream_free(ctx, n, ctx->stream.prev, begin);
+		} else {
+			ctx->stream.last = n;
+			ctx->stream.last_prev = ctx->stream.prev;
+			ctx->stream.last_begin = begin;
+		}
+	}
+
+	ctx->stream.item = next;
+	if (next == NULL) {
+		ctx->stream.cec = -1;
+	}
+
+	return rc;
+}
+
+static int kv_dump_sn(void *arg, struct KVEntry *kv)
+{
+	struct SchemaNode *sn = kv->value;
+
+	printf("%s:\n", kv->key);
+	dump_sn_recurse(sn, 1, arg);
+	return 0;
+}
+
+#include "ErrorReport.c"
+
+/* The schema keyword of the node type */
+static const char *type_name(enum LOP_ASTNodeType type, bool call)
+{
+	switch (type) {
+	case LOP_TYPE_LIST_ROUND: return call ? "call" : "list";
+	case LOP_TYPE_LIST_CURLY: return call ? "struct" : "slist";
+	case LOP_TYPE_LIST_SQUARE: return call ? "aref" : "alist";
+	case LOP_TYPE_LIST_COLON: return call ? "tree" : "tlist";
+	case LOP_TYPE_LIST_STRING: return "fstring";
+	case LOP_TYPE_LIST_OPERATOR_UNARY: return "unary";
+	case LOP_TYPE_LIST_OPERATOR_BINARY: return "binary";
+	case LOP_TYPE_OPERATOR: return "operator";
+	case LOP_TYPE_ID: return "identifier";
+	case LOP_TYPE_NUMBER: return "number";
+	case LOP_TYPE_STRING: return "string";
+	case LOP_TYPE_NIL: return "nil";
+	default:
+		assert(0);
+	}
+	return NULL;
+}
+
+#define DESCRIBE_MEMBERS 3
+
+/* "identifier 'if', 'else' or 'while'", the first few of a larger set and how many more */
+static void sn_describe_set(struct SchemaNode *sn, char *buf, size_t size)
+{
+	struct SymbolSet *set = sn->symbol.members;
+	int shown = set->count > DESCRIBE_MEMBERS ? DESCRIBE_MEMBERS : set->count;
+
+	snprintf(buf + strlen(buf), size - strlen(buf), "%s", type_name(sn->type, false));
+	for (int i = 0; i < shown; i++) {
+		const char *sep = i == 0 ? " " : i + 1 < set->count ? ", " : " or ";
+
+		snprintf(buf + strlen(buf), size - strlen(buf), "%s'%s'", sep, set->value[i]);
+	}
+	if (shown < set->count) {
+		snprintf(buf + strlen(buf), size - strlen(buf), " or one of %d more", set->count - shown);
+	}
+}
+
+/* What the SN takes first, appended to buf: the rule of a ref, the alternatives of oneof */
+static void sn_describe(struct SchemaNode *sn, struct KV *kv, char *buf, size_t size)
+{
+	size_t len = strlen(buf);
+
+	switch (sn->sn_type) {
+	case SN_TYPE_AST:
+		if (sn->type > LOP_TYPE_LIST_LAST && sn->symbol.members) {
+			sn_describe_set(sn, buf, size);
+		} else if (sn->type > LOP_TYPE_LIST_LAST && sn->pattern) {
+			snprintf(buf + len, size - len, "%s matching '%s'", type_name(sn->type, false), sn->symbol.value);
+		} else if (sn->type > LOP_TYPE_LIST_LAST && sn->symbol.value) {
+			snprintf(buf + len, size - len, "%s '%s'", type_name(sn->type, false), sn->symbol.value);
+		} else {
+			snprintf(buf + len, size - len, "%s", type_name(sn->type, sn->type < LOP_TYPE_LIST_LAST && sn->list.call));
+		}
+		break;
+	case SN_TYPE_REF:
+		snprintf(buf + len, size - len, "%s", kv->children[sn->ref].key);
+		break;
+	case SN_TYPE_ONEOF:
+		for (int i = 0; i < sn->child_count; i++) {
+			if (i) {
+				snprintf(buf + strlen(buf), size - strlen(buf), " or ");
+			}
+			sn_describe(sn->child[i], kv, buf, size);
+		}
+		break;
+	case SN_TYPE_LISTOF:
+	case SN_TYPE_SEQOF:
+		if (sn->child_count) {
+			sn_describe(sn->child[0], kv, buf, size);
+		}
+		break;
+	}
+}
+
+/* "expected identifier 'port' or tree, got number '8080'", the end of the list goes last */
+static void fail_describe(struct Failure *f, struct KV *kv, char *buf, size_t size)
+{
+	const char *end = f->root ? "end of file" : "end of list";
+	char name[FAIL_EXPECTED][128];
+	bool eol = false;
+	int count = 0;
+	size_t len;
+
+	snprintf(buf, size, "expected ");
+	for (int i = 0; i < f->count; i++) {
+		int j;
+
+		if (f->expected[i] == NULL) {
+			eol = true;
+			continue;
+		}
+
+		name[count][0] = 0;
+		sn_describe(f->expected[i], kv, name[count], sizeof(name[count]));
+		for (j = 0; j < count && strcmp(name[j], name[count]); j++) {
+		}
+		if (j < count) {
+			continue;
+		}
+
+		len = strlen(buf);
+		snprintf(buf + len, size - len, "%s%s", count ? " or " : "", name[count]);
+		count++;
+	}
+	if (eol) {
+		len = strlen(buf);
+		snprintf(buf + len, size - len, "%s%s", count ? " or " : "", end);
+	}
+
+	len = strlen(buf);
+	if (f->end) {
+		snprintf(buf + len, size - len, ", got %s", end);
+	} else if (f->symbol[0]) {
+		snprintf(buf + len, size - len, ", got %s '%s'", type_name(f->type, false), f->symbol);
+	} else {
+		snprintf(buf + len, size - len, ", got %s", type_name(f->type, f->call));
+	}
+}
+
+/* Numbers the nodes in preorder without recursion, the lists may be long and deep */
+static unsigned ast_number(struct LOP_ASTNode *root)
+{
+	struct LOP_ASTNode *n = root;
+	unsigned id = 0;
+
+	while (n) {
+		n->id = id++;
+
+		if (n->type < LOP_TYPE_LIST_LAST && LOP_list_head(n)) {
+			n = LOP_list_head(n);
+			continue;
+		}
+
+		while (n != root && n->next == NULL) {
+			n = n->parent;
+		}
+		n = n == root ? NULL : n->next;
+	}
+
+	return id;
+}
+
+int LOP_parse(struct LOP_AST *ast, const char *src, size_t len)
+{
+	int rc;
+
+	ast->src = src;
+	ast->len = len;
 
 	/* Translate the source text to the AST */
-	rc = LOP_getAST(&ast, lop->filename, src, len, &schema->operator_table);
+	rc = LOP_getAST(&ast->root, ast->filename, src, len, &ast->schema->operator_table, &ast->limits);
 	if (rc < 0) {
+		ast->root = NULL;
+		ast->error = LOP_getAST_loc();
 		return rc;
 	}
 
-	struct CEContext cec = {
-		.sn = sn,
-		.parent = NULL,
-	};
+	ast->node_count = ast_number(ast->root);
+	return 0;
+}
+
+void LOP_parse_deinit(struct LOP_AST *ast)
+{
+	LOP_delAST(ast->root);
+	ast->root = NULL;
+	ast->node_count = 0;
+}
+
+static bool operators_equal(struct LOP_OperatorTable *a, struct LOP_OperatorTable *b)
+{
+	if (a == b) {
+		return true;
+	}
+	if (a->size != b->size) {
+		return false;
+	}
+
+	for (int i = 0; i < a->size; i++) {
+		if (strcmp(a->data[i].value, b->data[i].value) ||
+		    a->data[i].prio != b->data[i].prio ||
+		    a->data[i].type != b->data[i].type) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Get the top rule from which everything starts */
+static struct SchemaNode *top_rule(struct LOP *lop)
+{
+	struct KV *kv = lop->schema->kv;
+	int kv_key = kv_get_index(kv, lop->top_rule_name, false);
+
+	if (kv_key < 0) {
+		s_report(LOP_ERROR_SCHEMA_MISSING_TOP, lop->top_rule_name);
+		return NULL;
+	}
+	return kv->children[kv_key].value;
+}
+
+/* The match of LOP_init() and friends. It's kept in LOP.suspended when the budget stops it */
+struct LOP_Suspended {
+	struct Context ctx;
+	struct LOP_HandlerList none;
+	const struct LOP_AST *ast;
+	/* LOP_init() and LOP_validate() hand their AST over, see parse_and_match() */
+	struct LOP_AST own;
+	struct SchemaNode *sn;
+	bool validate;
+};
+
+static void match_free(struct LOP_Suspended *m)
+{
+	struct Context *ctx = &m->ctx;
+
+	if (ctx->stream.last) {
+		stream_free(ctx, ctx->stream.last, ctx->stream.last_prev, ctx->stream.last_begin);
+	}
+
+	free(ctx->node);
+	free(ctx->cec);
+	free(ctx->frame);
+	free(ctx->free_id);
+	free(ctx->mark);
+	free(ctx->active);
+
+	LOP_parse_deinit(&m->own);
+	free(m);
+}
+
+/* The furthest mismatch into lop->error, and reported as a syntax error if err_string is set.
+ * The budget only sets lop->error, it's up to the caller whether the match goes on */
+static void match_report(struct LOP *lop, struct Context *ctx, const struct LOP_AST *ast, const char *err_string)
+{
+	struct Failure f = ctx->fail;
+	char detail[512];
+
+	/* Nothing was tried at a node, the rule takes nothing */
+	if (ctx->fail.pos == 0) {
+		fail_at(ctx, NULL, ast->root);
+		ctx->fail.count = 0;
+	}
+
+	if (err_string) {
+		fail_describe(&ctx->fail, ctx->kv, detail, sizeof(detail));
+		report_error(ast->filename, ast->src, ast->len, ctx->fail.loc, err_string, ctx->fail.count ? detail : NULL);
+	}
+	lop->error = ctx->fail.loc;
+
+	/* A resumed match goes on from what it has found so far */
+	ctx->fail = f;
+}
+
+/* Runs the match from resume_cec at resume_ast, until it's done or the budget stops it */
+static int match_run(struct LOP *lop, struct LOP_Suspended *m)
+{
+	struct Context *ctx = &m->ctx;
+	const struct LOP_AST *ast = m->ast;
+	bool matched;
+	int rc = 0;
+
+	ctx->rc = 0;
+	budget_begin(ctx, lop);
 
 	/* Apply sn to the AST and get a tree of handlers to call */
-	if (check_entry(&lop_ctx, ast, &cec)) {
-		lop->ast = ast;
+	matched = check_entry(ctx, ctx->resume_ast, ctx->resume_cec);
+	if (ctx->restart) {
+		memset(ctx->node, 0, ctx->node_size * sizeof(*ctx->node));
+		ctx->hl->count = 0;
+		ctx->hl->node_count = 0;
+		ctx->cec_count = 0;
+		ctx->frame_count = 0;
+		ctx->threads = 0;
+		ctx->par_frame = -1;
+		ctx->restart = false;
+		ctx->fail = (struct Failure) {};
+
+		matched = check_entry(ctx, ast->root, cec_push(ctx, m->sn, ast->root, -1));
+	}
+	lop->steps = ctx->steps;
+
+	/* check_entry() gives back the handlers it was resumed with, the failed match has none */
+	if (!matched && ctx->rc != LOP_ERROR_BUDGET) {
+		ctx->hl->count = 0;
+	}
+
+	if (matched) {
+		if (!m->validate) {
+			LOP_handler_link(&lop->hl);
+		}
+	} else if (ctx->rc == LOP_ERROR_BUDGET) {
+		match_report(lop, ctx, ast, NULL);
+		rc = ctx->rc;
+		/* The lexer of LOP_init_file() doesn't wait */
+		if (!ctx->lazy) {
+			lop->suspended = m;
+			return rc;
+		}
+	} else if (ctx->rc) {
+		rc = ctx->rc;
+		/* The lexer has reported it */
+		if (ctx->lazy && rc <= LOP_ERROR_LEXER_MATCHED) {
+			lop->error = LOP_getAST_loc();
+		}
+	} else {
+		match_report(lop, ctx, ast, "Syntax error");
+		rc = LOP_ERROR_SCHEMA_SYNTAX;
+	}
+
+	/* LOP_init() hands the AST over to LOP_deinit() */
+	if (rc == 0 && !m->validate) {
+		lop->ast = m->own.root;
+		m->own.root = NULL;
+	}
+
+	match_free(m);
+	return rc;
+}
+
+/* own: the AST is LOP_init()'s, so the items may be freed.
+ * lazy: it's being lexed by LOP_getAST_step(), see LOP_init_file() */
+static int lop_match(struct LOP *lop, const struct LOP_AST *ast, bool validate, bool own, bool lazy)
+{
+	struct LOP_Schema *schema = lop->schema;
+	struct KV *kv = schema->kv;
+	struct LOP_Suspended *m;
+	struct Context *ctx;
+	struct SchemaNode *sn;
+
+	/* If you want to see how it's look */
+	if (0) {
+		kv_iterate(kv, kv_dump_sn, kv);
+	}
+
+	/* A new match drops the suspended one */
+	if (lop->suspended) {
+		match_free(lop->suspended);
+		lop->suspended = NULL;
+	}
+	lop->scanned = false;
+
+	sn = top_rule(lop);
+	if (sn == NULL) {
+		return LOP_ERROR_SCHEMA_MISSING_TOP;
+	}
+
+	/* The AST depends on the operators, another table would have made another AST */
+	if (!operators_equal(&ast->schema->operator_table, &schema->operator_table)) {
+		return s_report(LOP_ERROR_SCHEMA_OPERATORS, ast->filename);
+	}
+
+	m = calloc(1, sizeof(*m));
+	assert(m);
+	m->ast = ast;
+	m->sn = sn;
+	m->validate = validate;
+
+	ctx = &m->ctx;
+	*ctx = (struct Context) {
+		.kv = kv,
+		.ct = &schema->callback_table,
+		.hl = validate ? &m->none : &lop->hl,
+		.validate = validate,
+		.threads = lop->threads,
+		.par_frame = -1,
+		.stop = -1,
+		.item = validate ? NULL : lop->item,
+		.item_arg = lop->item_arg,
+		.free_items = validate ? lazy : lop->free_items && lop->item && own,
+		.stream.cec = -1,
+		.lazy = lazy,
+		.node_size = lazy ? 64 : ast->node_count,
+		.profile = lop->profile,
+	};
+
+	ctx->node = calloc(ctx->node_size, sizeof(*ctx->node));
+	assert(ctx->node);
+	if (lop->profile) {
+		assert(lop->profile->schema == schema);
+		ctx->active = calloc(schema->node_count + 1, sizeof(*ctx->active));
+		assert(ctx->active);
+	}
+	if (lazy) {
+		ast_take(ctx, ast->root);
+	}
+
+	if (!validate) {
+		handler_begin(&lop->hl, lop->compact, &schema->callback_table);
+	}
+
+	ctx->resume_ast = ast->root;
+	ctx->resume_cec = cec_push(ctx, sn, ast->root, -1);
+	return match_run(lop, m);
+}
+
+int LOP_match(struct LOP *lop, const struct LOP_AST *ast)
+{
+	return lop_match(lop, ast, false, false, false);
+}
+
+static bool direct_usable(struct LOP *lop, struct SchemaNode *sn);
+static bool direct_match(struct LOP *lop, struct SchemaNode *sn, const char *src, size_t len, size_t window, bool thread,
+			 bool validate);
+static void direct_nodes_free(struct LOP_Nodes *c);
+
+/* The whole AST, then the match */
+static int parse_whole(struct LOP *lop, const char *src, size_t len, bool validate)
+{
+	struct LOP_AST ast = {
+		.schema = lop->schema,
+		.filename = lop->filename,
+		.limits = lop->limits,
+	};
+	int rc;
+
+	rc = LOP_parse(&ast, src, len);
+	if (rc < 0) {
+		lop->error = ast.error;
+		return rc;
+	}
+
+	rc = lop_match(lop, &ast, validate, true, false);
+
+	/* LOP_init() hands the AST over to LOP_deinit(), and a suspended match keeps it */
+	if (rc == 0 && !validate) {
+		lop->ast = ast.root;
+		ast.root = NULL;
+	} else if (lop->suspended) {
+		lop->suspended->own = ast;
+		lop->suspended->ast = &lop->suspended->own;
+		ast.root = NULL;
+	}
+
+	LOP_parse_deinit(&ast);
+	return rc;
+}
+
+static int parse_and_match(struct LOP *lop, const char *src, size_t len, bool validate)
+{
+	struct SchemaNode *sn = top_rule(lop);
+
+	/* Don't parse for nothing */
+	if (sn == NULL) {
+		return LOP_ERROR_SCHEMA_MISSING_TOP;
+	}
+
+	lop->scanned = false;
+	if (direct_usable(lop, sn) && direct_match(lop, sn, src, len, 0, false, validate)) {
+		return 0;
+	}
+
+	return parse_whole(lop, src, len, validate);
+}
+
+int LOP_init(struct LOP *lop, const char *src, size_t len)
+{
+	return parse_and_match(lop, src, len, false);
+}
+
+/* LOP_init_file() can't parse it again once an item is passed on */
+struct ItemPassed {
+	int (*item)(void *arg, const struct LOP_HandlerList *hl, int depth);
+	void *arg;
+	bool passed;
+};
+
+static int item_passed(void *arg, const struct LOP_HandlerList *hl, int depth)
+{
+	struct ItemPassed *p = arg;
+
+	p->passed = true;
+	return p->item(p->arg, hl, depth);
+}
+
+static int parse_file(struct LOP *lop, bool validate)
+{
+	struct LOP_AST ast = {
+		.schema = lop->schema,
+		.filename = lop->filename,
+	};
+	struct SchemaNode *sn = top_rule(lop);
+	struct FileMap source;
+	size_t window = lop->window ? lop->window : 64 * 1024;
+	struct ItemPassed passed = {
+		.item = lop->item,
+		.arg = lop->item_arg,
+	};
+	int rc;
+
+	if (sn == NULL) {
+		return LOP_ERROR_SCHEMA_MISSING_TOP;
+	}
+
+	source = map_file(lop->filename);
+	if (source.fd < 0) {
+		return LOP_ERROR_FILE;
+	}
+	if (source.len) {
+		madvise(source.data, source.len, MADV_SEQUENTIAL);
+	}
+
+	lop->scanned = false;
+	if (direct_usable(lop, sn) && direct_match(lop, sn, source.data, source.len, window, lop->threads > 1, validate)) {
+		unmap_file(source);
+		close(source.fd);
+		return 0;
+	}
+
+	ast.src = source.data;
+	ast.len = source.len;
+
+	rc = LOP_getAST_begin(&ast.root, ast.filename, ast.src, ast.len, &lop->schema->operator_table, &lop->limits,
+			      window, lop->threads > 1);
+	if (rc == 0) {
+		if (lop->item) {
+			lop->item = item_passed;
+			lop->item_arg = &passed;
+		}
+		rc = lop_match(lop, &ast, validate, true, true);
+		lop->item = passed.item;
+		lop->item_arg = passed.arg;
+	}
+	LOP_getAST_end();
+
+	if (rc == 0 && !validate) {
+		lop->ast = ast.root;
 	} else {
-		struct LOP_ASTNode *err = ast_find_err(ast);
+		LOP_delAST(ast.root);
+	}
+
+	/* A colon list on several lines taken before it's closed by ; and called or an operand,
+	 * see LOP_getAST_settled(). It's all parsed again, unless its items are passed on already */
+	if (rc == LOP_ERROR_LEXER_MATCHED && !passed.passed) {
+		rc = parse_whole(lop, source.data, source.len, validate);
+	} else if (rc == LOP_ERROR_LEXER_MATCHED) {
+		report_error(lop->filename, source.data, source.len, lop->error,
+			     "The list is matched already, its items are passed on before it's called or an operand", NULL);
+	}
+
+	unmap_file(source);
+	close(source.fd);
+	return rc;
+}
+
+int LOP_init_file(struct LOP *lop)
+{
+	return parse_file(lop, false);
+}
+
+int LOP_validate_file(struct LOP *lop)
+{
+	return parse_file(lop, true);
+}
+
+int LOP_validate(struct LOP *lop, const char *src, size_t len)
+{
+	return parse_and_match(lop, src, len, true);
+}
+
+int LOP_resume(struct LOP *lop)
+{
+	struct LOP_Suspended *m = lop->suspended;
+
+	assert(m);
+	lop->suspended = NULL;
+	return match_run(lop, m);
+}
 
-		assert(err);
+static struct SchemaNode *schema_node(const struct LOP_Schema *schema, int id);
 
-		/* Get to the head, otherwise the error will point, for example,
-		 * to the :, instead of the first element, which is more convenient. */
-		while (err->type < LOP_TYPE_LIST_LAST) {
-			err = LOP_list_head(err);
+/* The range of the IDs in the subtree. LOP_init_file() doesn't number what the match
+ * hasn't taken, the content of a #lazy list, so it's numbered after the rest */
+static void ast_id_range(struct LOP_ASTNode *n, unsigned *first, unsigned *last, bool number)
+{
+	if (n->id == LOP_AST_NO_ID && number) {
+		n->id = ++*last;
+	} else if (n->id != LOP_AST_NO_ID && !number) {
+		*first = n->id < *first ? n->id : *first;
+		*last = n->id > *last ? n->id : *last;
+	}
+
+	if (n->type < LOP_TYPE_LIST_LAST) {
+		for (struct LOP_ASTNode *c = n->list.head; c; c = c->next) {
+			ast_id_range(c, first, last, number);
 		}
+	}
+}
 
-		report_error(lop->filename, src, len, err->loc, "Syntax error");
-		rc = LOP_ERROR_SCHEMA_SYNTAX;
+int LOP_force(struct LOP *lop, const struct LOP_Handler *h, struct LOP_HandlerList *hl)
+{
+	struct LOP_Schema *schema = lop->schema;
+	struct SchemaNode *sn = schema_node(schema, h->member);
+	struct LOP_AST ast = {
+		.schema = schema,
+		.filename = lop->filename,
+		.root = h->n,
+	};
+	struct Context ctx = {
+		.kv = schema->kv,
+		.ct = &schema->callback_table,
+		.hl = hl,
+		.force = h->n,
+		/* Not stopped by the budget, there's no LOP_resume() of it */
+		.step_limit = UINT64_MAX,
+		.check_at = UINT64_MAX,
+		.threads = lop->threads,
+		.par_frame = -1,
+		.stop = -1,
+		.stream.cec = -1,
+	};
+	unsigned first = UINT_MAX;
+	unsigned last = 0;
+	bool matched;
+	int rc = 0;
+
+	assert(h->delta == 0 && h->n && h->n->type < LOP_TYPE_LIST_LAST);
+	assert(sn && sn->lazy);
+
+	ast_id_range(h->n, &first, &last, false);
+	ast_id_range(h->n, &first, &last, true);
+
+	ctx.node_first = first;
+	ctx.node_size = last - first + 1;
+	ctx.node = calloc(ctx.node_size, sizeof(*ctx.node));
+	assert(ctx.node);
+
+	handler_begin(hl, lop->compact, &schema->callback_table);
+
+	matched = check_entry(&ctx, h->n, cec_push(&ctx, sn, h->n, -1));
+	if (ctx.restart) {
+		/* An item has failed on a thread, as in match_run() */
+		memset(ctx.node, 0, ctx.node_size * sizeof(*ctx.node));
+		hl->count = 0;
+		hl->node_count = 0;
+		ctx.cec_count = 0;
+		ctx.frame_count = 0;
+		ctx.threads = 0;
+		ctx.par_frame = -1;
+		ctx.restart = false;
+		ctx.fail = (struct Failure) {};
+
+		matched = check_entry(&ctx, h->n, cec_push(&ctx, sn, h->n, -1));
+	}
 
-		/* AST has allocs, we must free them */
-		LOP_delAST(ast);
+	if (matched) {
+		LOP_handler_link(hl);
+	} else {
+		hl->count = 0;
+		/* The source isn't kept, the error is reported without its line */
+		match_report(lop, &ctx, &ast, "Syntax error");
+		rc = LOP_ERROR_SCHEMA_SYNTAX;
 	}
 
+	free(ctx.node);
+	free(ctx.cec);
+	free(ctx.frame);
 	return rc;
 }
 
+void LOP_force_deinit(struct LOP_HandlerList *hl)
+{
+	free(hl->handler);
+	free(hl->close);
+	free(hl->node);
+	*hl = (struct LOP_HandlerList) {};
+}
+
 void LOP_deinit(struct LOP *lop)
 {
-	LOP_delAST(lop->ast);
+	if (lop->suspended) {
+		match_free(lop->suspended);
+		lop->suspended = NULL;
+	}
 
-	free(lop->hl.handler);
+	LOP_delAST(lop->ast);
+	direct_nodes_free(lop->nodes);
 
 	lop->ast = NULL;
+	lop->nodes = NULL;
+	lop->scanned = false;
 	lop->hl.count = 0;
+	lop->hl.node_count = 0;
+
+	if (lop->keep_handlers) {
+		return;
+	}
+
+	free(lop->hl.handler);
+	free(lop->hl.close);
+	free(lop->hl.node);
+
 	lop->hl.handler = NULL;
+	lop->hl.capacity = 0;
+	lop->hl.close = NULL;
+	lop->hl.node = NULL;
+	lop->hl.node_capacity = 0;
+}
+
+struct LOP_Handler LOP_handler(const struct LOP_HandlerList *hl, int i)
+{
+	int id;
+
+	if (!hl->compact) {
+		return hl->handler[i];
+	}
+
+	id = LOP_handler_id(hl, i);
+
+	return (struct LOP_Handler) {
+		.key = hl->ct->data[id].name,
+		.n = LOP_handler_node(hl, i),
+		.id = id,
+		.delta = LOP_handler_delta(hl, i),
+		/* Or the member, which shares the slot */
+		.close = LOP_handler_delta(hl, i) >= 0 ? hl->close[i] : 0,
+		.children = LOP_handler_children(hl, i),
+	};
+}
+
+int LOP_handler_id(const struct LOP_HandlerList *hl, int i)
+{
+	if (!hl->compact) {
+		return hl->handler[i].id;
+	}
+
+	return hl->compact_handler[i].id_delta >> 2;
+}
+
+int LOP_handler_delta(const struct LOP_HandlerList *hl, int i)
+{
+	if (!hl->compact) {
+		return hl->handler[i].delta;
+	}
+
+	return (int)(hl->compact_handler[i].id_delta & 3) - 1;
+}
+
+struct LOP_ASTNode *LOP_handler_node(const struct LOP_HandlerList *hl, int i)
+{
+	if (!hl->compact) {
+		return hl->handler[i].n;
+	}
+
+	uint32_t index = hl->compact_handler[i].node;
+
+	if (index == 0 || LOP_handler_delta(hl, i) == -1) {
+		return NULL;
+	}
+	return hl->node[index - 1];
+}
+
+int LOP_handler_member(const struct LOP_HandlerList *hl, int i)
+{
+	if (LOP_handler_delta(hl, i) != 0 || LOP_handler_lazy(hl, i)) {
+		return 0;
+	}
+
+	return hl->compact ? hl->close[i] : hl->handler[i].member;
+}
+
+bool LOP_handler_lazy(const struct LOP_HandlerList *hl, int i)
+{
+	return LOP_handler_delta(hl, i) == 0 && LOP_handler_node(hl, i)->type < LOP_TYPE_LIST_LAST;
+}
+
+int LOP_handler_skip(const struct LOP_HandlerList *hl, int i)
+{
+	if (LOP_handler_delta(hl, i) != 1) {
+		return i + 1;
+	}
+
+	return (hl->compact ? hl->close[i] : hl->handler[i].close) + 1;
+}
+
+int LOP_handler_children(const struct LOP_HandlerList *hl, int i)
+{
+	if (LOP_handler_delta(hl, i) != 1) {
+		return 0;
+	}
+
+	if (!hl->compact) {
+		return hl->handler[i].children;
+	}
+
+	return hl->compact_handler[hl->close[i]].node;
+}
+
+struct HandlerOpen {
+	int open;
+	int children;
+};
+
+/* The handlers are balanced, so a stack of the opened ones is enough */
+void LOP_handler_link(struct LOP_HandlerList *hl)
+{
+	struct HandlerOpen *stack = NULL;
+	int depth = 0;
+	int size = 0;
+
+	for (int i = 0; i < hl->count; i++) {
+		int delta = LOP_handler_delta(hl, i);
+
+		if (delta >= 0 && depth) {
+			stack[depth - 1].children++;
+		}
+
+		if (delta == 1) {
+			if (depth == size) {
+				size = size ? size * 2 : 64;
+				stack = realloc(stack, size * sizeof(*stack));
+				assert(stack);
+			}
+			stack[depth++] = (struct HandlerOpen) { i, 0 };
+		} else if (delta == -1) {
+			assert(depth);
+			depth--;
+
+			int open = stack[depth].open;
+
+			if (hl->compact) {
+				hl->close[open] = i;
+				hl->compact_handler[i].node = stack[depth].children;
+			} else {
+				hl->handler[open].close = i;
+				hl->handler[open].children = stack[depth].children;
+			}
+		}
+	}
+
+	assert(depth == 0);
+	free(stack);
 }
 
+#include "Dispatch.c"
+#include "Profile.c"
+#include "Lint.c"
+#include "Direct.c"
+#include "SchemaCache.c"
+#include "SchemaGen.c"
 #include "RootSchema.c"
@@ -0,0 +1,648 @@
+/* LOP.direct: the match straight from the tokens of LOP_scan_next(), without the AST.
+ *
+ * It takes the rules where the next token always tells which SN takes it: the alternatives
+ * of a oneof/listof don't start with the same AST SN (their FIRST sets don't overlap),
+ * a listof doesn't start with what may follow it, and an optional SN with what comes
+ * in its place. direct_analyze() marks such rules. Their match never backtracks, so it goes
+ * along with the scanner and gives the handlers of the general match as it goes. The nodes
+ * are only made for the handlers which have them, in LOP.nodes. Whatever the scanner or
+ * the match can't take is left to the general match, which reports it. */
+
+struct LOP_Nodes {
+	struct LOP_Nodes *next;
+	size_t used;
+	size_t size;
+	char data[];
+};
+
+#define DIRECT_CHUNK (1 << 20)
+
+static void *direct_alloc(struct LOP_Nodes **nodes, size_t size)
+{
+	struct LOP_Nodes *c = *nodes;
+	void *p;
+
+	size = (size + 7) & ~(size_t)7;
+	if (c == NULL || c->used + size > c->size) {
+		size_t chunk = size > DIRECT_CHUNK ? size : DIRECT_CHUNK;
+
+		c = malloc(sizeof(*c) + chunk);
+		assert(c);
+		c->next = *nodes;
+		c->used = 0;
+		c->size = chunk;
+		*nodes = c;
+	}
+
+	p = c->data + c->used;
+	c->used += size;
+	return p;
+}
+
+static void direct_nodes_free(struct LOP_Nodes *c)
+{
+	while (c) {
+		struct LOP_Nodes *next = c->next;
+
+		free(c);
+		c = next;
+	}
+}
+
+/* The sets are bitmaps of the AST SNs by SchemaNode.id */
+struct DirectAnalysis {
+	struct KV *kv;
+	struct SchemaNode **sn;
+	int count;
+	int words;
+	uint64_t *first;
+	uint64_t *follow;
+	/* FIRST: 1 - being collected, 2 - done */
+	char *state;
+	/* The SN has a choice the next token doesn't tell */
+	bool *bad;
+};
+
+#define DIRECT_SET(a, set, sn) (&(a)->set[(size_t)(sn)->id * (a)->words])
+
+static void direct_collect(struct DirectAnalysis *a, struct SchemaNode *sn)
+{
+	a->sn[sn->id] = sn;
+	for (int i = 0; i < sn->child_count; i++) {
+		direct_collect(a, sn->child[i]);
+	}
+}
+
+static struct SchemaNode *direct_rule(struct KV *kv, struct SchemaNode *ref)
+{
+	return kv->children[ref->ref].value;
+}
+
+static bool direct_union(struct DirectAnalysis *a, uint64_t *to, const uint64_t *from)
+{
+	bool changed = false;
+
+	for (int i = 0; i < a->words; i++) {
+		changed |= (to[i] | from[i]) != to[i];
+		to[i] |= from[i];
+	}
+	return changed;
+}
+
+/* Every SN takes a node, so a seqof starts with its children up to the first one which isn't optional */
+static void direct_first(struct DirectAnalysis *a, struct SchemaNode *sn)
+{
+	uint64_t *set = DIRECT_SET(a, first, sn);
+
+	if (a->state[sn->id] == 2) {
+		return;
+	}
+	/* Left recursion */
+	if (a->state[sn->id] == 1) {
+		a->bad[sn->id] = true;
+		return;
+	}
+	a->state[sn->id] = 1;
+
+	switch (sn->sn_type) {
+	case SN_TYPE_AST:
+		set[sn->id / 64] |= 1ULL << (sn->id % 64);
+		break;
+	case SN_TYPE_REF:
+		direct_first(a, direct_rule(a->kv, sn));
+		direct_union(a, set, DIRECT_SET(a, first, direct_rule(a->kv, sn)));
+		break;
+	case SN_TYPE_ONEOF:
+	case SN_TYPE_LISTOF:
+	case SN_TYPE_SEQOF:
+		for (int i = 0; i < sn->child_count; i++) {
+			direct_first(a, sn->child[i]);
+			direct_union(a, set, DIRECT_SET(a, first, sn->child[i]));
+			if (sn->sn_type == SN_TYPE_SEQOF && !sn->child[i]->optional) {
+				break;
+			}
+		}
+		break;
+	}
+
+	a->state[sn->id] = 2;
+}
+
+/* A node both AST SNs may take */
+static bool direct_atoms(struct SchemaNode *x, struct SchemaNode *y)
+{
+	if (x->type != y->type) {
+		return false;
+	}
+	if (x->type < LOP_TYPE_LIST_LAST) {
+		return x->list.call == y->list.call;
+	}
+	return lint_symbols(x, y, false);
+}
+
+static bool direct_overlap(struct DirectAnalysis *a, const uint64_t *x, const uint64_t *y)
+{
+	for (int i = 0; i < a->count; i++) {
+		if (!(x[i / 64] & (1ULL << (i % 64)))) {
+			continue;
+		}
+		for (int j = 0; j < a->count; j++) {
+			if ((y[j / 64] & (1ULL << (j % 64))) && direct_atoms(a->sn[i], a->sn[j])) {
+				return true;
+			}
+		}
+	}
+	return false;
+}
+
+/* What comes after the child i of a seqof or a list: the next children up to the first one
+ * which isn't optional, and what follows the seqof if they all are */
+static void direct_rest(struct DirectAnalysis *a, struct SchemaNode *p, int i, uint64_t *set)
+{
+	for (i++; i < p->child_count; i++) {
+		direct_union(a, set, DIRECT_SET(a, first, p->child[i]));
+		if (!p->child[i]->optional) {
+			return;
+		}
+	}
+	if (p->sn_type == SN_TYPE_SEQOF) {
+		direct_union(a, set, DIRECT_SET(a, follow, p));
+	}
+}
+
+/* The end of a list is never taken by an SN, so it's left out of FOLLOW */
+static bool direct_follow(struct DirectAnalysis *a, struct SchemaNode *p)
+{
+	bool changed = false;
+
+	switch (p->sn_type) {
+	case SN_TYPE_REF:
+		changed |= direct_union(a, DIRECT_SET(a, follow, direct_rule(a->kv, p)), DIRECT_SET(a, follow, p));
+		break;
+	case SN_TYPE_ONEOF:
+	case SN_TYPE_LISTOF:
+		for (int i = 0; i < p->child_count; i++) {
+			uint64_t *set = DIRECT_SET(a, follow, p->child[i]);
+
+			changed |= direct_union(a, set, DIRECT_SET(a, follow, p));
+			if (p->sn_type == SN_TYPE_LISTOF) {
+				changed |= direct_union(a, set, DIRECT_SET(a, first, p));
+			}
+		}
+		break;
+	case SN_TYPE_SEQOF:
+	case SN_TYPE_AST:
+		for (int i = 0; i < p->child_count; i++) {
+			uint64_t *set = DIRECT_SET(a, follow, p->child[i]);
+			uint64_t *rest = calloc(a->words, sizeof(*rest));
+
+			assert(rest);
+			direct_rest(a, p, i, rest);
+			changed |= direct_union(a, set, rest);
+			free(rest);
+		}
+		break;
+	}
+
+	return changed;
+}
+
+static bool direct_conflict(struct DirectAnalysis *a, struct SchemaNode *p)
+{
+	if (p->lazy) {
+		return true;
+	}
+
+	switch (p->sn_type) {
+	case SN_TYPE_ONEOF:
+	case SN_TYPE_LISTOF:
+		for (int i = 0; i < p->child_count; i++) {
+			for (int j = i + 1; j < p->child_count; j++) {
+				if (direct_overlap(a, DIRECT_SET(a, first, p->child[i]), DIRECT_SET(a, first, p->child[j]))) {
+					return true;
+				}
+			}
+		}
+		return p->sn_type == SN_TYPE_LISTOF && direct_overlap(a, DIRECT_SET(a, first, p), DIRECT_SET(a, follow, p));
+	case SN_TYPE_SEQOF:
+	case SN_TYPE_AST:
+		for (int i = 0; i < p->child_count; i++) {
+			uint64_t *rest;
+			bool overlap;
+
+			if (!p->child[i]->optional) {
+				continue;
+			}
+
+			rest = calloc(a->words, sizeof(*rest));
+			assert(rest);
+			direct_rest(a, p, i, rest);
+			overlap = direct_overlap(a, DIRECT_SET(a, first, p->child[i]), rest);
+			free(rest);
+			if (overlap) {
+				return true;
+			}
+		}
+		return false;
+	default:
+		return false;
+	}
+}
+
+/* An SN with a choice the next token doesn't tell can be reached from sn */
+static bool direct_reach_bad(struct DirectAnalysis *a, struct SchemaNode *sn, bool *seen)
+{
+	if (seen[sn->id]) {
+		return false;
+	}
+	seen[sn->id] = true;
+
+	if (a->bad[sn->id]) {
+		return true;
+	}
+	if (sn->sn_type == SN_TYPE_REF) {
+		return direct_reach_bad(a, direct_rule(a->kv, sn), seen);
+	}
+	for (int i = 0; i < sn->child_count; i++) {
+		if (direct_reach_bad(a, sn->child[i], seen)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+/* SchemaNode.first and .direct, once the schema is numbered */
+static void direct_analyze(struct LOP_Schema *schema)
+{
+	struct DirectAnalysis a = {
+		.kv = schema->kv,
+		.count = schema->node_count,
+		.words = (schema->node_count + 63) / 64,
+	};
+	bool *seen;
+	bool changed;
+
+	a.sn = calloc(a.count + 1, sizeof(*a.sn));
+	a.first = calloc((size_t)a.count * a.words + 1, sizeof(*a.first));
+	a.follow = calloc((size_t)a.count * a.words + 1, sizeof(*a.follow));
+	a.state = calloc(a.count + 1, sizeof(*a.state));
+	a.bad = calloc(a.count + 1, sizeof(*a.bad));
+	seen = calloc(a.count + 1, sizeof(*seen));
+	assert(a.sn && a.first && a.follow && a.state && a.bad && seen);
+
+	for (int i = 0; i < a.kv->count; i++) {
+		direct_collect(&a, a.kv->children[i].value);
+	}
+	for (int i = 0; i < a.count; i++) {
+		direct_first(&a, a.sn[i]);
+	}
+
+	do {
+		changed = false;
+		for (int i = 0; i < a.count; i++) {
+			changed |= direct_follow(&a, a.sn[i]);
+		}
+	} while (changed);
+
+	for (int i = 0; i < a.count; i++) {
+		struct SchemaNode *sn = a.sn[i];
+		const uint64_t *set = DIRECT_SET(&a, first, sn);
+
+		a.bad[i] |= direct_conflict(&a, sn);
+
+		sn->first_count = 0;
+		for (int j = 0; j < a.count; j++) {
+			sn->first_count += (set[j / 64] >> (j % 64)) & 1;
+		}
+		sn->first = calloc(sn->first_count + 1, sizeof(*sn->first));
+		assert(sn->first);
+		for (int j = 0, k = 0; j < a.count; j++) {
+			if (set[j / 64] & (1ULL << (j % 64))) {
+				sn->first[k++] = a.sn[j];
+			}
+		}
+	}
+
+	for (int i = 0; i < a.kv->count; i++) {
+		struct SchemaNode *rule = a.kv->children[i].value;
+
+		memset(seen, 0, a.count * sizeof(*seen));
+		rule->direct = !direct_reach_bad(&a, rule, seen);
+	}
+
+	free(a.sn);
+	free(a.first);
+	free(a.follow);
+	free(a.state);
+	free(a.bad);
+	free(seen);
+}
+
+struct DirectFrame {
+	struct SchemaNode *sn;
+	/* seqof and list: the child being matched, -1 before the first one */
+	int i;
+};
+
+struct Direct {
+	struct KV *kv;
+	const struct LOP_CallbackTable *ct;
+	/* NULL for LOP_validate() */
+	struct LOP_HandlerList *hl;
+	/* The next token */
+	struct LOP_Scan e;
+	/* Its node, once a handler has it, and the compact index */
+	struct LOP_ASTNode *node;
+	uint32_t index;
+	struct LOP_Nodes *nodes;
+
+	struct DirectFrame *frame;
+	int frame_count;
+	int frame_size;
+
+	uint64_t steps;
+};
+
+static bool direct_next(struct Direct *d)
+{
+	d->node = NULL;
+	d->index = 0;
+	return LOP_scan_next(&d->e) == 0;
+}
+
+/* The token is a node which sn may start with */
+static bool direct_starts(struct SchemaNode *sn, const struct LOP_Scan *e)
+{
+	if (e->what != LOP_SCAN_OPEN && e->what != LOP_SCAN_SYMBOL) {
+		return false;
+	}
+
+	for (int i = 0; i < sn->first_count; i++) {
+		struct SchemaNode *a = sn->first[i];
+
+		if (a->type != e->n.type) {
+			continue;
+		}
+		if (e->what == LOP_SCAN_OPEN ? a->list.call == e->n.list.call : sn_member(a, e->n.symbol.value) >= 0) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static struct SchemaNode *direct_pick(struct SchemaNode *sn, const struct LOP_Scan *e)
+{
+	for (int i = 0; i < sn->child_count; i++) {
+		if (direct_starts(sn->child[i], e)) {
+			return sn->child[i];
+		}
+	}
+	return NULL;
+}
+
+static struct LOP_ASTNode *direct_node(struct Direct *d)
+{
+	size_t len = 0;
+
+	if (d->node) {
+		return d->node;
+	}
+
+	if (d->e.what == LOP_SCAN_SYMBOL) {
+		len = strlen(d->e.n.symbol.value) + 1;
+	}
+
+	d->node = direct_alloc(&d->nodes, sizeof(*d->node) + len);
+	*d->node = d->e.n;
+	if (len) {
+		d->node->symbol.value = memcpy(d->node + 1, d->e.n.symbol.value, len);
+	}
+	return d->node;
+}
+
+/* handler_add(), with the node of the token if node is set */
+static void direct_handler(struct Direct *d, struct SchemaNode *sn, bool node, int delta, int member)
+{
+	struct LOP_HandlerList *hl = d->hl;
+	struct LOP_ASTNode *n;
+	int count;
+
+	if (hl == NULL || !sn->cb_count) {
+		return;
+	}
+
+	n = node ? direct_node(d) : NULL;
+	if (n && hl->compact && d->index == 0) {
+		node_reserve(hl, hl->node_count + 1);
+		hl->node[hl->node_count++] = n;
+		d->index = hl->node_count;
+	}
+
+	count = hl->count;
+	handler_reserve(hl, count + sn->cb_count);
+	hl->count = count + sn->cb_count;
+
+	for (int i = 0; i < sn->cb_count; i++) {
+		int id = sn->cb[delta == -1 ? sn->cb_count - 1 - i : i];
+
+		if (hl->compact) {
+			hl->compact_handler[count + i] = (struct LOP_CompactHandler) { id << 2 | (delta + 1), n ? d->index : 0 };
+			hl->close[count + i] = member;
+		} else {
+			hl->handler[count + i] = (struct LOP_Handler) {
+				.key = d->ct->data[id].name,
+				.n = n,
+				.id = id,
+				.delta = delta,
+				.member = member,
+			};
+		}
+	}
+}
+
+static void direct_push(struct Direct *d, struct SchemaNode *sn, int i)
+{
+	if (d->frame_count == d->frame_size) {
+		d->frame_size = d->frame_size ? d->frame_size * 2 : 64;
+		d->frame = realloc(d->frame, d->frame_size * sizeof(*d->frame));
+		assert(d->frame);
+	}
+	d->frame[d->frame_count++] = (struct DirectFrame) { sn, i };
+}
+
+/* check_entry() for a rule marked by direct_analyze(): the SN is entered at the next token
+ * and takes the tokens of its nodes, then the frames below it go on.
+ * false on any mismatch, the general match finds out the rest */
+static bool direct_run(struct Direct *d, struct SchemaNode *sn)
+{
+	struct DirectFrame *f;
+	struct SchemaNode *c;
+	int member;
+
+	if (!direct_next(d)) {
+		return false;
+	}
+
+enter:
+	d->steps++;
+
+	switch (sn->sn_type) {
+	case SN_TYPE_REF:
+		direct_handler(d, sn, true, 1, 0);
+		direct_push(d, sn, 0);
+		sn = direct_rule(d->kv, sn);
+		goto enter;
+	case SN_TYPE_ONEOF:
+	case SN_TYPE_LISTOF:
+		direct_handler(d, sn, true, 1, 0);
+		c = direct_pick(sn, &d->e);
+		if (c == NULL) {
+			return false;
+		}
+		direct_push(d, sn, 0);
+		sn = c;
+		goto enter;
+	case SN_TYPE_SEQOF:
+		direct_handler(d, sn, true, 1, 0);
+		direct_push(d, sn, -1);
+		goto content;
+	case SN_TYPE_AST:
+		if (sn->type < LOP_TYPE_LIST_LAST) {
+			if (d->e.what != LOP_SCAN_OPEN || d->e.n.type != sn->type || d->e.n.list.call != sn->list.call) {
+				return false;
+			}
+			direct_handler(d, sn, true, 1, 0);
+			direct_push(d, sn, -1);
+			if (!direct_next(d)) {
+				return false;
+			}
+			goto content;
+		}
+
+		if (d->e.what != LOP_SCAN_SYMBOL || d->e.n.type != sn->type) {
+			return false;
+		}
+		member = sn_member(sn, d->e.n.symbol.value);
+		if (member < 0) {
+			return false;
+		}
+		direct_handler(d, sn, true, 0, member);
+		if (!direct_next(d)) {
+			return false;
+		}
+		goto up;
+	}
+
+up:
+	/* The top rule has taken the root list */
+	if (d->frame_count == 0) {
+		return d->e.what == LOP_SCAN_END;
+	}
+
+	f = &d->frame[d->frame_count - 1];
+	sn = f->sn;
+
+	switch (sn->sn_type) {
+	case SN_TYPE_LISTOF:
+		c = direct_pick(sn, &d->e);
+		if (c) {
+			sn = c;
+			goto enter;
+		}
+		/* fallthrough */
+	case SN_TYPE_REF:
+	case SN_TYPE_ONEOF:
+		direct_handler(d, sn, false, -1, 0);
+		d->frame_count--;
+		goto up;
+	default:
+		break;
+	}
+
+content:
+	f = &d->frame[d->frame_count - 1];
+	sn = f->sn;
+
+	for (int i = f->i + 1; i < sn->child_count; i++) {
+		c = sn->child[i];
+
+		if (direct_starts(c, &d->e)) {
+			f->i = i;
+			sn = c;
+			goto enter;
+		}
+		if (!c->optional) {
+			return false;
+		}
+	}
+
+	if (sn->sn_type == SN_TYPE_SEQOF) {
+		/* It takes a node at least */
+		if (f->i < 0) {
+			return false;
+		}
+	} else if (d->e.what != LOP_SCAN_CLOSE) {
+		return false;
+	}
+
+	direct_handler(d, sn, false, -1, 0);
+	d->frame_count--;
+	if (sn->sn_type != SN_TYPE_SEQOF && !direct_next(d)) {
+		return false;
+	}
+	goto up;
+}
+
+/* LOP.direct is on, and nothing of the general match is asked for */
+static bool direct_usable(struct LOP *lop, struct SchemaNode *sn)
+{
+	const struct LOP_Limits *l = &lop->limits;
+
+	return lop->direct && sn->direct && !lop->item && !lop->profile && !lop->max_steps && !lop->deadline &&
+	       !l->max_depth && !l->max_nodes && !l->max_symbol && !l->max_bytes;
+}
+
+/* true if it has matched, false leaves nothing behind for the general match */
+static bool direct_match(struct LOP *lop, struct SchemaNode *sn, const char *src, size_t len, size_t window, bool thread,
+			 bool validate)
+{
+	struct Direct d = {
+		.kv = lop->schema->kv,
+		.ct = &lop->schema->callback_table,
+		.hl = validate ? NULL : &lop->hl,
+	};
+	bool matched;
+
+	/* A new match drops the suspended one */
+	if (lop->suspended) {
+		match_free(lop->suspended);
+		lop->suspended = NULL;
+	}
+
+	if (!validate) {
+		handler_begin(&lop->hl, lop->compact, &lop->schema->callback_table);
+	}
+
+	matched = LOP_scan_begin(src, len, &lop->schema->operator_table, window, thread) == 0 && direct_run(&d, sn);
+	/* The general match parses the same source */
+	LOP_scan_end(!matched);
+	free(d.frame);
+
+	if (!matched) {
+		/* Its handlers point into the nodes, even if the general parse fails before it adds any */
+		if (!validate) {
+			handler_begin(&lop->hl, lop->compact, &lop->schema->callback_table);
+		}
+		direct_nodes_free(d.nodes);
+		return false;
+	}
+
+	if (!validate) {
+		LOP_handler_link(&lop->hl);
+		lop->ast = NULL;
+		lop->nodes = d.nodes;
+	}
+	lop->steps = d.steps;
+	lop->scanned = true;
+	return true;
+}
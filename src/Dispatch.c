@@ -0,0 +1,195 @@
+/* Parallel dispatch of a handler list, see LOP_dispatch().
+ *
+ * The subtrees opened by the task callbacks are found with LOP_handler_skip() and split
+ * between the workers in contiguous slices, in the source order. A worker takes its own
+ * tasks from the front of its slice, and once it has none left, steals from the back of
+ * the others. No task makes new ones, so a worker is done when every slice is empty. */
+
+struct DispatchTask {
+	/* Handlers [begin, end) */
+	int begin;
+	int end;
+	/* Handlers opened around it */
+	int depth;
+	void *ctx;
+	int rc;
+};
+
+struct DispatchWorker {
+	struct DispatchShared *s;
+	/* The tasks left in the slice: next << 32 | end */
+	_Atomic uint64_t range;
+	pthread_t thread;
+	bool started;
+	int steals;
+};
+
+struct DispatchShared {
+	const struct LOP_HandlerList *hl;
+	struct LOP_Dispatch *d;
+	struct DispatchTask *task;
+	struct DispatchWorker *worker;
+	int threads;
+};
+
+static int dispatch_take(struct DispatchWorker *w, bool steal)
+{
+	uint64_t range = atomic_load(&w->range);
+
+	for (;;) {
+		uint32_t next = range >> 32;
+		uint32_t end = range;
+		uint64_t left;
+		int task;
+
+		if (next >= end) {
+			return -1;
+		}
+
+		if (steal) {
+			task = end - 1;
+			left = (uint64_t)next << 32 | (end - 1);
+		} else {
+			task = next;
+			left = (uint64_t)(next + 1) << 32 | end;
+		}
+
+		if (atomic_compare_exchange_weak(&w->range, &range, left)) {
+			return task;
+		}
+	}
+}
+
+static void *dispatch_worker(void *arg)
+{
+	struct DispatchWorker *w = arg;
+	struct DispatchShared *s = w->s;
+	struct LOP_Dispatch *d = s->d;
+	int self = w - s->worker;
+
+	for (;;) {
+		int t = dispatch_take(w, false);
+
+		for (int i = 1; t < 0 && i < s->threads; i++) {
+			t = dispatch_take(&s->worker[(self + i) % s->threads], true);
+			w->steals += t >= 0;
+		}
+		if (t < 0) {
+			break;
+		}
+
+		struct DispatchTask *task = &s->task[t];
+		int rc = 0;
+
+		task->ctx = d->task_begin ? d->task_begin(d->arg, s->hl, task->begin, task->depth) : d->arg;
+		for (int i = task->begin; i < task->end && rc == 0; i++) {
+			rc = d->handler(task->ctx, s->hl, i);
+		}
+		task->rc = rc;
+	}
+
+	return NULL;
+}
+
+int LOP_dispatch(const struct LOP_HandlerList *hl, struct LOP_Dispatch *d)
+{
+	struct DispatchShared s = {
+		.hl = hl,
+		.d = d,
+		.threads = d->threads > 1 ? d->threads : 1,
+	};
+	bool *is_task = calloc(hl->ct->size + 1, sizeof(*is_task));
+	int depth = 0;
+	int size = 0;
+	int rc = 0;
+	int t;
+
+	assert(is_task);
+
+	for (int i = 0; d->task && d->task[i]; i++) {
+		int id;
+
+		for (id = 0; id < hl->ct->size; id++) {
+			if (!strcmp(hl->ct->data[id].name, d->task[i])) {
+				break;
+			}
+		}
+		if (id == hl->ct->size) {
+			free(is_task);
+			return LOP_ERROR_SCHEMA_UNKNOWN_CALLBACK;
+		}
+		is_task[id] = true;
+	}
+
+	d->task_count = 0;
+	d->steals = 0;
+
+	for (int i = 0; i < hl->count;) {
+		if (LOP_handler_delta(hl, i) != 1 || !is_task[LOP_handler_id(hl, i)]) {
+			depth += LOP_handler_delta(hl, i);
+			i++;
+			continue;
+		}
+
+		if (d->task_count == size) {
+			size = size ? size * 2 : 64;
+			s.task = realloc(s.task, size * sizeof(*s.task));
+			assert(s.task);
+		}
+		s.task[d->task_count++] = (struct DispatchTask) { i, LOP_handler_skip(hl, i), depth };
+		i = LOP_handler_skip(hl, i);
+	}
+	free(is_task);
+
+	if (s.threads > d->task_count) {
+		s.threads = d->task_count ? d->task_count : 1;
+	}
+
+	s.worker = calloc(s.threads, sizeof(*s.worker));
+	assert(s.worker);
+
+	for (int w = 0; w < s.threads; w++) {
+		uint64_t from = (long)d->task_count * w / s.threads;
+		uint64_t to = (long)d->task_count * (w + 1) / s.threads;
+
+		s.worker[w].s = &s;
+		atomic_init(&s.worker[w].range, from << 32 | to);
+	}
+
+	/* We are the first worker, the ones which can't start just leave their tasks to be stolen */
+	for (int w = 1; w < s.threads; w++) {
+		s.worker[w].started = pthread_create(&s.worker[w].thread, NULL, dispatch_worker, &s.worker[w]) == 0;
+	}
+	dispatch_worker(&s.worker[0]);
+
+	for (int w = 0; w < s.threads; w++) {
+		if (s.worker[w].started) {
+			pthread_join(s.worker[w].thread, NULL);
+		}
+		d->steals += s.worker[w].steals;
+	}
+	free(s.worker);
+
+	/* The rest in order, every task is merged in its place, even after a failure to release it */
+	t = 0;
+	for (int i = 0; i < hl->count;) {
+		if (t < d->task_count && i == s.task[t].begin) {
+			struct DispatchTask *task = &s.task[t++];
+			int merged = d->task_merge ? d->task_merge(d->arg, task->ctx, task->rc) : task->rc;
+
+			if (rc == 0) {
+				rc = merged;
+			}
+			i = task->end;
+			continue;
+		}
+
+		if (rc == 0) {
+			rc = d->handler(d->arg, hl, i);
+		}
+		i++;
+	}
+	free(s.task);
+
+	return rc;
+}
@@ -1,8 +1,14 @@
-static void report_error(const char *filename, const char *string, size_t len, struct LOP_Location loc, const char *err_string)
+/* detail, if any, follows the location. Without the string there is no line to show */
+static void report_error(const char *filename, const char *string, size_t len, struct LOP_Location loc,
+			 const char *err_string, const char *detail)
 {
-	assert(loc.line_offset < len);
+	assert(!string || loc.line_offset <= len);
 
-	fprintf(stderr, "%s in file '%s' at %i:%i\n", err_string, filename, loc.lineno, loc.charno + 1);
+	fprintf(stderr, "%s in file '%s' at %i:%i%s%s\n", err_string, filename, loc.lineno, loc.charno + 1,
+		detail ? ": " : "", detail ? detail : "");
+	if (!string) {
+		return;
+	}
 
 	for (size_t i = loc.line_offset; i < len; i++) {
 		const char *p = &string[i];
@@ -55,17 +55,6 @@ static int kv_add(struct KV *kv, const char *key, void *value)
 	return kv->count;
 }
 
-static void *kv_get(struct KV *kv, const char *key)
-{
-	for (int i = 0; i < kv->count; i++) {
-		if (!strcmp(kv->children[i].key, key)) {
-			return kv->children[i].value;
-		}
-	}
-
-	return NULL;
-}
-
 static int kv_get_index(struct KV *kv, const char *key, bool alloc)
 {
 	for (int i = 0; i < kv->count; i++) {
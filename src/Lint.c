@@ -0,0 +1,505 @@
+/* Static schema analysis, see LOP_schema_lint().
+ *
+ * An SN takes at least one AST node when it's entered, so the schema has no empty loops.
+ * What makes the matcher slow is an alternative which takes the same nodes again after
+ * the previous one has failed, and listof items whose boundaries aren't fixed: a mismatch
+ * after the list backtracks through every way to split it. The answers are conservative,
+ * a comparison which goes too deep through the refs gives up with "maybe". */
+
+#define LINT_DEPTH 16
+#define LINT_STEPS 100000
+
+struct Lint {
+	const struct LOP_Schema *schema;
+	struct KV *kv;
+	void (*report)(void *arg, const struct LOP_LintFinding *f);
+	void *arg;
+	/* The rule being walked */
+	int rule;
+	int high;
+	int steps;
+	/* lint_left(): the rules already entered */
+	bool *entered;
+};
+
+static struct SchemaNode *lint_rule(struct Lint *l, struct SchemaNode *ref)
+{
+	return l->kv->children[ref->ref].value;
+}
+
+static void lint_report(struct Lint *l, enum LOP_LintSeverity severity, int rule, struct SchemaNode *sn,
+	const char *fmt, ...)
+{
+	char message[512];
+	struct LOP_LintFinding f = {
+		.severity = severity,
+		.rule = l->kv->children[rule].key,
+		.loc = sn->loc,
+		.message = message,
+	};
+	va_list ap;
+
+	va_start(ap, fmt);
+	vsnprintf(message, sizeof(message), fmt, ap);
+	va_end(ap);
+
+	l->high += severity == LOP_LINT_HIGH;
+	if (l->report) {
+		l->report(l->arg, &f);
+	}
+}
+
+/* Some value of b, or every one if all, is a value of a too. An SN without a value takes any,
+ * and #pattern too many to list: one is never covered by a list of values */
+static bool lint_symbols(struct SchemaNode *a, struct SchemaNode *b, bool all)
+{
+	int count = b->symbol.members ? b->symbol.members->count : 1;
+
+	if (!a->symbol.value || !b->symbol.value) {
+		return !all || !a->symbol.value;
+	}
+	if (b->pattern && a->pattern) {
+		return pattern_product(a->symbol.dfa, b->symbol.dfa, all);
+	}
+	if (b->pattern) {
+		return !all && lint_symbols(b, a, false);
+	}
+
+	for (int i = 0; i < count; i++) {
+		const char *value = b->symbol.members ? b->symbol.members->value[i] : b->symbol.value;
+
+		if ((sn_member(a, value) >= 0) != all) {
+			return !all;
+		}
+	}
+	return all;
+}
+
+static bool lint_overlap(struct Lint *l, struct SchemaNode *a, struct SchemaNode *b, int depth, bool head);
+
+/* The lists can start with the same element, or both be empty */
+static bool lint_overlap_content(struct Lint *l, struct SchemaNode *a, struct SchemaNode *b, int depth)
+{
+	bool a_empty = true;
+	bool b_empty = true;
+
+	for (int i = 0; i < a->child_count; i++) {
+		a_empty &= a->child[i]->optional;
+	}
+	for (int i = 0; i < b->child_count; i++) {
+		b_empty &= b->child[i]->optional;
+	}
+	if (a_empty && b_empty) {
+		return true;
+	}
+
+	for (int i = 0; i < a->child_count; i++) {
+		for (int j = 0; j < b->child_count; j++) {
+			if (lint_overlap(l, a->child[i], b->child[j], depth, false)) {
+				return true;
+			}
+			if (!b->child[j]->optional) {
+				break;
+			}
+		}
+		if (!a->child[i]->optional) {
+			break;
+		}
+	}
+	return false;
+}
+
+/* a and b can take the same first node. With head, the lists are told apart by their first elements */
+static bool lint_overlap(struct Lint *l, struct SchemaNode *a, struct SchemaNode *b, int depth, bool head)
+{
+	if (depth > LINT_DEPTH || ++l->steps > LINT_STEPS) {
+		return true;
+	}
+
+	switch (a->sn_type) {
+	case SN_TYPE_REF:
+		return lint_overlap(l, lint_rule(l, a), b, depth + 1, head);
+	case SN_TYPE_ONEOF:
+	case SN_TYPE_LISTOF:
+		for (int i = 0; i < a->child_count; i++) {
+			if (lint_overlap(l, a->child[i], b, depth, head)) {
+				return true;
+			}
+		}
+		return false;
+	case SN_TYPE_SEQOF:
+		for (int i = 0; i < a->child_count; i++) {
+			if (lint_overlap(l, a->child[i], b, depth, head)) {
+				return true;
+			}
+			if (!a->child[i]->optional) {
+				break;
+			}
+		}
+		return false;
+	case SN_TYPE_AST:
+		break;
+	}
+
+	if (b->sn_type != SN_TYPE_AST) {
+		return lint_overlap(l, b, a, depth, head);
+	}
+
+	if (a->type != b->type) {
+		return false;
+	}
+	if (a->type > LOP_TYPE_LIST_LAST) {
+		return lint_symbols(a, b, false);
+	}
+	if (a->list.call != b->list.call) {
+		return false;
+	}
+	/* #lazy takes any content */
+	return !head || a->lazy || b->lazy || lint_overlap_content(l, a, b, depth);
+}
+
+static bool lint_covers(struct Lint *l, struct SchemaNode *a, struct SchemaNode *b, int depth);
+
+/* Child by child, and optional where b's one is */
+static bool lint_covers_content(struct Lint *l, struct SchemaNode *a, struct SchemaNode *b, int depth)
+{
+	if (a->child_count != b->child_count) {
+		return false;
+	}
+
+	for (int i = 0; i < a->child_count; i++) {
+		if ((b->child[i]->optional && !a->child[i]->optional) ||
+		    !lint_covers(l, a->child[i], b->child[i], depth)) {
+			return false;
+		}
+	}
+	return true;
+}
+
+/* Everything b takes, a takes too */
+static bool lint_covers(struct Lint *l, struct SchemaNode *a, struct SchemaNode *b, int depth)
+{
+	if (depth > LINT_DEPTH || ++l->steps > LINT_STEPS) {
+		return false;
+	}
+	if (a == b) {
+		return true;
+	}
+
+	if (b->sn_type == SN_TYPE_REF) {
+		return lint_covers(l, a, lint_rule(l, b), depth + 1);
+	}
+	if (b->sn_type == SN_TYPE_ONEOF) {
+		for (int i = 0; i < b->child_count; i++) {
+			if (!lint_covers(l, a, b->child[i], depth)) {
+				return false;
+			}
+		}
+		return b->child_count > 0;
+	}
+
+	switch (a->sn_type) {
+	case SN_TYPE_REF:
+		return lint_covers(l, lint_rule(l, a), b, depth + 1);
+	case SN_TYPE_ONEOF:
+		for (int i = 0; i < a->child_count; i++) {
+			if (lint_covers(l, a->child[i], b, depth)) {
+				return true;
+			}
+		}
+		return false;
+	case SN_TYPE_LISTOF:
+		/* A listof can stop after any item */
+		if (b->sn_type != SN_TYPE_LISTOF) {
+			for (int i = 0; i < a->child_count; i++) {
+				if (lint_covers(l, a->child[i], b, depth)) {
+					return true;
+				}
+			}
+			return false;
+		}
+
+		for (int i = 0; i < b->child_count; i++) {
+			int j;
+
+			for (j = 0; j < a->child_count && !lint_covers(l, a->child[j], b->child[i], depth); j++) {
+			}
+			if (j == a->child_count) {
+				return false;
+			}
+		}
+		return b->child_count > 0;
+	case SN_TYPE_SEQOF:
+		return b->sn_type == SN_TYPE_SEQOF && lint_covers_content(l, a, b, depth);
+	case SN_TYPE_AST:
+		break;
+	}
+
+	if (b->sn_type != SN_TYPE_AST || a->type != b->type) {
+		return false;
+	}
+	if (a->type > LOP_TYPE_LIST_LAST) {
+		return lint_symbols(a, b, true);
+	}
+	return a->list.call == b->list.call && (a->lazy || lint_covers_content(l, a, b, depth));
+}
+
+/* The AST nodes the SN takes, -1 if it varies */
+static int lint_length(struct Lint *l, struct SchemaNode *sn, int depth)
+{
+	int length = 0;
+
+	switch (sn->sn_type) {
+	case SN_TYPE_AST:
+		return 1;
+	case SN_TYPE_REF:
+		/* Deep enough it's a recursion through a list, which takes one node */
+		return depth > LINT_DEPTH ? 1 : lint_length(l, lint_rule(l, sn), depth + 1);
+	case SN_TYPE_LISTOF:
+		return -1;
+	case SN_TYPE_SEQOF:
+		for (int i = 0; i < sn->child_count; i++) {
+			int n = lint_length(l, sn->child[i], depth);
+
+			if (n < 0 || sn->child[i]->optional) {
+				return -1;
+			}
+			length += n;
+		}
+		return length;
+	case SN_TYPE_ONEOF:
+		for (int i = 0; i < sn->child_count; i++) {
+			int n = lint_length(l, sn->child[i], depth);
+
+			if (n < 0 || (i && n != length)) {
+				return -1;
+			}
+			length = n;
+		}
+		return length;
+	}
+	return 1;
+}
+
+/* A node after the first one the SN takes can start an item */
+static bool lint_rest(struct Lint *l, struct SchemaNode *sn, struct SchemaNode *items, int depth)
+{
+	if (depth > LINT_DEPTH) {
+		return false;
+	}
+
+	switch (sn->sn_type) {
+	case SN_TYPE_AST:
+		return false;
+	case SN_TYPE_REF:
+		return lint_rest(l, lint_rule(l, sn), items, depth + 1);
+	case SN_TYPE_LISTOF:
+	case SN_TYPE_SEQOF:
+		for (int i = 0; i < sn->child_count; i++) {
+			if ((i || sn->sn_type == SN_TYPE_LISTOF) && lint_overlap(l, sn->child[i], items, depth, true)) {
+				return true;
+			}
+			if (lint_rest(l, sn->child[i], items, depth)) {
+				return true;
+			}
+		}
+		return false;
+	case SN_TYPE_ONEOF:
+		for (int i = 0; i < sn->child_count; i++) {
+			if (lint_rest(l, sn->child[i], items, depth)) {
+				return true;
+			}
+		}
+		return false;
+	}
+	return false;
+}
+
+/* The SN can stop before a node it could have taken, and which can start an item:
+ * the items can be split in more than one way */
+static bool lint_split(struct Lint *l, struct SchemaNode *sn, struct SchemaNode *items, int depth)
+{
+	bool optional = true;
+
+	if (depth > LINT_DEPTH) {
+		return false;
+	}
+
+	switch (sn->sn_type) {
+	case SN_TYPE_AST:
+		return false;
+	case SN_TYPE_REF:
+		return lint_split(l, lint_rule(l, sn), items, depth + 1);
+	case SN_TYPE_LISTOF:
+		/* It can stop after any item */
+		return lint_rest(l, sn, items, depth);
+	case SN_TYPE_SEQOF:
+		/* It can stop where the rest is optional */
+		for (int i = sn->child_count - 1; i >= 0 && optional; i--) {
+			if (lint_split(l, sn->child[i], items, depth) ||
+			    (i && sn->child[i]->optional && lint_overlap(l, sn->child[i], items, depth, true))) {
+				return true;
+			}
+			optional = sn->child[i]->optional;
+		}
+		return false;
+	case SN_TYPE_ONEOF:
+		for (int i = 0; i < sn->child_count; i++) {
+			if (lint_split(l, sn->child[i], items, depth)) {
+				return true;
+			}
+		}
+		/* A shorter alternative can take the beginning of a longer one */
+		return lint_length(l, sn, depth) < 0 && lint_rest(l, sn, items, depth);
+	}
+	return false;
+}
+
+/* The ref to rule which sn reaches without taking a node, if any. The rules before it
+ * have been checked already, a cycle through them is reported there */
+static struct SchemaNode *lint_left(struct Lint *l, struct SchemaNode *sn, int rule, int *in, int cur)
+{
+	struct SchemaNode *ref;
+
+	switch (sn->sn_type) {
+	case SN_TYPE_AST:
+		return NULL;
+	case SN_TYPE_REF:
+		if (sn->ref == rule) {
+			*in = cur;
+			return sn;
+		}
+		if (sn->ref < rule || l->entered[sn->ref]) {
+			return NULL;
+		}
+		l->entered[sn->ref] = true;
+		return lint_left(l, lint_rule(l, sn), rule, in, sn->ref);
+	case SN_TYPE_ONEOF:
+	case SN_TYPE_LISTOF:
+	case SN_TYPE_SEQOF:
+		for (int i = 0; i < sn->child_count; i++) {
+			ref = lint_left(l, sn->child[i], rule, in, cur);
+			if (ref) {
+				return ref;
+			}
+			if (sn->sn_type == SN_TYPE_SEQOF && !sn->child[i]->optional) {
+				break;
+			}
+		}
+		return NULL;
+	}
+	return NULL;
+}
+
+static void lint_alternatives(struct Lint *l, struct SchemaNode *sn)
+{
+	const char *what = sn->sn_type == SN_TYPE_ONEOF ? "oneof" : "listof";
+	char a[256];
+	char b[256];
+
+	for (int i = 0; i < sn->child_count; i++) {
+		struct SchemaNode *c = sn->child[i];
+		bool shadowed = false;
+
+		profile_label(l->schema, c, b, sizeof(b));
+
+		if (c->optional) {
+			lint_report(l, LOP_LINT_LOW, l->rule, c, "#optional has no effect on an alternative of %s", what);
+		}
+
+		for (int j = 0; j < i && !shadowed; j++) {
+			if (lint_covers(l, sn->child[j], c, 0)) {
+				profile_label(l->schema, sn->child[j], a, sizeof(a));
+				lint_report(l, LOP_LINT_HIGH, l->rule, c,
+					    "%s alternative %d (%s) is shadowed by alternative %d (%s): it takes nothing that one doesn't",
+					    what, i + 1, b, j + 1, a);
+				shadowed = true;
+			}
+		}
+
+		for (int j = 0; j < i && !shadowed; j++) {
+			if (lint_overlap(l, sn->child[j], c, 0, true)) {
+				profile_label(l->schema, sn->child[j], a, sizeof(a));
+				lint_report(l, LOP_LINT_MEDIUM, l->rule, c,
+					    "%s alternative %d (%s) can start like alternative %d (%s): it's matched again after that one fails",
+					    what, i + 1, b, j + 1, a);
+				break;
+			}
+		}
+	}
+
+	if (sn->sn_type == SN_TYPE_LISTOF) {
+		for (int i = 0; i < sn->child_count; i++) {
+			if (lint_split(l, sn->child[i], sn, 0)) {
+				lint_report(l, LOP_LINT_HIGH, l->rule, sn,
+					    "listof items can be split in more than one way: a mismatch after the list tries every split");
+				break;
+			}
+		}
+	}
+}
+
+static void lint_sn(struct Lint *l, struct SchemaNode *sn)
+{
+	bool optional = true;
+
+	switch (sn->sn_type) {
+	case SN_TYPE_ONEOF:
+	case SN_TYPE_LISTOF:
+		lint_alternatives(l, sn);
+		break;
+	case SN_TYPE_SEQOF:
+		for (int i = 0; i < sn->child_count; i++) {
+			optional &= sn->child[i]->optional;
+		}
+		if (sn->child_count && optional) {
+			lint_report(l, LOP_LINT_LOW, l->rule, sn,
+				    "every child of seqof is #optional, but it takes at least one of them");
+		}
+		break;
+	default:
+		break;
+	}
+
+	for (int i = 0; i < sn->child_count; i++) {
+		lint_sn(l, sn->child[i]);
+	}
+}
+
+int LOP_schema_lint(const struct LOP_Schema *schema,
+	void (*report)(void *arg, const struct LOP_LintFinding *f), void *arg)
+{
+	struct Lint l = {
+		.schema = schema,
+		.kv = schema->kv,
+		.report = report,
+		.arg = arg,
+	};
+
+	l.entered = calloc(l.kv->count + 1, sizeof(*l.entered));
+	assert(l.entered);
+
+	for (l.rule = 0; l.rule < l.kv->count; l.rule++) {
+		struct SchemaNode *sn = l.kv->children[l.rule].value;
+		struct SchemaNode *ref;
+		int in = l.rule;
+
+		if (sn->optional) {
+			lint_report(&l, LOP_LINT_LOW, l.rule, sn, "#optional has no effect on a rule");
+		}
+
+		memset(l.entered, 0, l.kv->count * sizeof(*l.entered));
+		ref = lint_left(&l, sn, l.rule, &in, l.rule);
+		if (ref) {
+			lint_report(&l, LOP_LINT_HIGH, in, ref,
+				    "rule '%s' reaches itself here without taking a node: the matcher stops this path as left recursion",
+				    l.kv->children[l.rule].key);
+		}
+
+		l.steps = 0;
+		lint_sn(&l, sn);
+	}
+
+	free(l.entered);
+	return l.high;
+}
@@ -0,0 +1,443 @@
+/* #pattern: the symbol must match a regular expression, compiled into a DFA with the schema.
+ *
+ * The expression is a subset of ERE: literals, '.', [classes] with ranges and ^,
+ * \d \w \s and \ to escape, (groups), | and the * + ? repeats. It always takes the whole
+ * symbol, so the ^ and $ anchors are implied and may be left out. It's parsed into
+ * a Thompson NFA, and the NFA into a DFA by the subset construction. The bytes no
+ * part of the expression tells apart share a class, so the DFA table is small and
+ * the match is one load per byte. SchemaGen.c emits the same tables. */
+
+#define PATTERN_STATES 256
+
+struct Pattern {
+	uint8_t class[256];
+	int classes;
+	/* By state and class, state 0 is the dead one and 1 the start */
+	uint16_t *next;
+	bool *accept;
+	int count;
+};
+
+static bool pattern_match(const struct Pattern *p, const char *str)
+{
+	uint32_t s = 1;
+
+	for (; *str && s; str++) {
+		s = p->next[s * p->classes + p->class[(unsigned char)*str]];
+	}
+
+	return p->accept[s];
+}
+
+enum PNType {
+	/* One of the bytes to out */
+	PN_BYTES,
+	/* Either of out and out1, -1 is none */
+	PN_EMPTY,
+	PN_MATCH,
+};
+
+struct PNState {
+	enum PNType type;
+	uint8_t bytes[32];
+	int out;
+	int out1;
+};
+
+/* Start and end of the NFA of a part of the expression, the end is PN_EMPTY with no out yet */
+struct PNFragment {
+	int start;
+	int end;
+};
+
+struct PatternParser {
+	const char *src;
+	const char *p;
+	const char *err;
+	struct PNState *state;
+	int count;
+};
+
+static int pn_state(struct PatternParser *pp, enum PNType type)
+{
+	pp->count++;
+	pp->state = realloc(pp->state, pp->count * sizeof(*pp->state));
+	assert(pp->state);
+
+	pp->state[pp->count - 1] = (struct PNState) {
+		.type = type,
+		.out = -1,
+		.out1 = -1,
+	};
+	return pp->count - 1;
+}
+
+static void pn_byte(struct PNState *s, unsigned char c)
+{
+	s->bytes[c / 8] |= 1 << (c % 8);
+}
+
+static bool pn_has(const struct PNState *s, unsigned char c)
+{
+	return s->bytes[c / 8] & (1 << (c % 8));
+}
+
+/* \d, \w and \s, or the escaped byte itself */
+static void pn_escape(struct PNState *s, unsigned char c)
+{
+	switch (c) {
+	case 'd':
+	case 'w':
+	case 's':
+		for (int i = 0; i < 256; i++) {
+			if ((c == 'd' && isdigit(i)) || (c == 'w' && (isalnum(i) || i == '_')) || (c == 's' && isspace(i))) {
+				pn_byte(s, i);
+			}
+		}
+		break;
+	default:
+		pn_byte(s, c);
+	}
+}
+
+static struct PNFragment pn_bytes(struct PatternParser *pp)
+{
+	int s = pn_state(pp, PN_BYTES);
+	int e = pn_state(pp, PN_EMPTY);
+	struct PNState *st = &pp->state[s];
+	bool negate = false;
+
+	st->out = e;
+
+	if (*pp->p == '.') {
+		memset(st->bytes, 0xff, sizeof(st->bytes));
+		pp->p++;
+	} else if (*pp->p == '\\') {
+		if (!pp->p[1]) {
+			pp->err = "\\ at the end";
+		} else {
+			pn_escape(st, pp->p[1]);
+			pp->p += 2;
+		}
+	} else if (*pp->p == '[') {
+		pp->p++;
+		if (*pp->p == '^') {
+			negate = true;
+			pp->p++;
+		}
+		/* ] right after [ is a byte of the class */
+		do {
+			unsigned char from = *pp->p;
+
+			if (!from) {
+				pp->err = "[ without ]";
+				break;
+			}
+			if (from == '\\' && pp->p[1]) {
+				pn_escape(st, pp->p[1]);
+				pp->p += 2;
+				continue;
+			}
+			if (pp->p[1] == '-' && pp->p[2] && pp->p[2] != ']') {
+				for (int c = from; c <= (unsigned char)pp->p[2]; c++) {
+					pn_byte(st, c);
+				}
+				pp->p += 3;
+			} else {
+				pn_byte(st, from);
+				pp->p++;
+			}
+		} while (*pp->p != ']');
+		if (!pp->err) {
+			pp->p++;
+		}
+		if (negate) {
+			for (int i = 0; i < sizeof(st->bytes); i++) {
+				st->bytes[i] = ~st->bytes[i];
+			}
+		}
+	} else {
+		pn_byte(st, *pp->p++);
+	}
+
+	return (struct PNFragment) { s, e };
+}
+
+static struct PNFragment pn_alt(struct PatternParser *pp);
+
+static struct PNFragment pn_repeat(struct PatternParser *pp)
+{
+	struct PNFragment f;
+
+	if (*pp->p == '(') {
+		pp->p++;
+		f = pn_alt(pp);
+		if (*pp->p != ')') {
+			pp->err = pp->err ? pp->err : "( without )";
+			return f;
+		}
+		pp->p++;
+	} else if (strchr("*+?", *pp->p)) {
+		pp->err = "Nothing to repeat";
+		return (struct PNFragment) { 0, 0 };
+	} else {
+		f = pn_bytes(pp);
+	}
+
+	while (*pp->p && strchr("*+?", *pp->p) && !pp->err) {
+		int s = pn_state(pp, PN_EMPTY);
+		int e = pn_state(pp, PN_EMPTY);
+		char op = *pp->p++;
+
+		pp->state[s].out = f.start;
+		pp->state[f.end].out = e;
+		if (op != '+') {
+			/* Skip it */
+			pp->state[s].out1 = e;
+		}
+		if (op != '?') {
+			/* And again */
+			pp->state[f.end].out1 = f.start;
+		}
+		f = (struct PNFragment) { s, e };
+	}
+
+	return f;
+}
+
+static struct PNFragment pn_concat(struct PatternParser *pp)
+{
+	int e = pn_state(pp, PN_EMPTY);
+	struct PNFragment f = { e, e };
+
+	while (*pp->p && *pp->p != '|' && *pp->p != ')' && !pp->err) {
+		struct PNFragment next;
+
+		/* The anchors are implied */
+		if ((*pp->p == '^' && pp->p == pp->src) || (*pp->p == '$' && !pp->p[1])) {
+			pp->p++;
+			continue;
+		}
+
+		next = pn_repeat(pp);
+		pp->state[f.end].out = next.start;
+		f.end = next.end;
+	}
+
+	return f;
+}
+
+static struct PNFragment pn_alt(struct PatternParser *pp)
+{
+	struct PNFragment f = pn_concat(pp);
+
+	while (*pp->p == '|' && !pp->err) {
+		struct PNFragment other;
+		int s = pn_state(pp, PN_EMPTY);
+		int e = pn_state(pp, PN_EMPTY);
+
+		pp->p++;
+		other = pn_concat(pp);
+
+		pp->state[s].out = f.start;
+		pp->state[s].out1 = other.start;
+		pp->state[f.end].out = e;
+		pp->state[other.end].out = e;
+		f = (struct PNFragment) { s, e };
+	}
+
+	return f;
+}
+
+/* The NFA states reachable from the set without taking a byte, added to it */
+static void pn_closure(struct PatternParser *pp, uint64_t *set, int *stack)
+{
+	int depth = 0;
+
+	for (int i = 0; i < pp->count; i++) {
+		if (set[i / 64] & (1ULL << (i % 64))) {
+			stack[depth++] = i;
+		}
+	}
+
+	while (depth) {
+		struct PNState *s = &pp->state[stack[--depth]];
+		int out[2] = { s->out, s->out1 };
+
+		if (s->type != PN_EMPTY) {
+			continue;
+		}
+		for (int k = 0; k < 2; k++) {
+			if (out[k] >= 0 && !(set[out[k] / 64] & (1ULL << (out[k] % 64)))) {
+				set[out[k] / 64] |= 1ULL << (out[k] % 64);
+				stack[depth++] = out[k];
+			}
+		}
+	}
+}
+
+/* Bytes which every PN_BYTES state takes or leaves together share a class */
+static void pattern_classes(struct Pattern *p, struct PatternParser *pp)
+{
+	p->classes = 1;
+	memset(p->class, 0, sizeof(p->class));
+
+	for (int i = 0; i < pp->count; i++) {
+		int split[256][2];
+
+		if (pp->state[i].type != PN_BYTES) {
+			continue;
+		}
+
+		memset(split, -1, sizeof(split));
+		for (int c = 0; c < 256; c++) {
+			int in = pn_has(&pp->state[i], c);
+			int *to = &split[p->class[c]][in];
+
+			if (*to < 0) {
+				/* The first half keeps the class */
+				*to = split[p->class[c]][!in] < 0 ? p->class[c] : p->classes++;
+			}
+			p->class[c] = *to;
+		}
+	}
+}
+
+/* NULL with *err set if the expression is broken, or takes too many DFA states */
+static struct Pattern *pattern_compile(const char *src, const char **err)
+{
+	struct PatternParser pp = { .src = src, .p = src };
+	struct PNFragment f = pn_alt(&pp);
+	struct Pattern *p = NULL;
+	int words;
+	uint64_t *sets = NULL;
+	uint64_t *set;
+	int *stack = NULL;
+	int byte[256];
+
+	if (!pp.err && *pp.p) {
+		pp.err = ") without (";
+	}
+	if (pp.err) {
+		goto out;
+	}
+
+	pp.state[f.end].type = PN_MATCH;
+	words = (pp.count + 63) / 64;
+
+	p = calloc(1, sizeof(*p));
+	assert(p);
+	pattern_classes(p, &pp);
+
+	/* A byte of every class to move the sets by */
+	for (int c = 255; c >= 0; c--) {
+		byte[p->class[c]] = c;
+	}
+
+	sets = calloc((PATTERN_STATES + 1) * words, sizeof(*sets));
+	stack = calloc(pp.count, sizeof(*stack));
+	p->next = calloc(PATTERN_STATES * p->classes, sizeof(*p->next));
+	p->accept = calloc(PATTERN_STATES, sizeof(*p->accept));
+	assert(sets && stack && p->next && p->accept);
+
+	/* 0 is the empty set, which never leaves itself */
+	set = &sets[words];
+	set[f.start / 64] |= 1ULL << (f.start % 64);
+	pn_closure(&pp, set, stack);
+	p->count = 2;
+
+	for (int d = 1; d < p->count && !pp.err; d++) {
+		for (int i = 0; i < pp.count; i++) {
+			p->accept[d] |= pp.state[i].type == PN_MATCH && (sets[d * words + i / 64] & (1ULL << (i % 64)));
+		}
+
+		for (int c = 0; c < p->classes; c++) {
+			int to;
+
+			/* The next set is built in the free slot, and kept if it's new */
+			set = &sets[p->count * words];
+			memset(set, 0, words * sizeof(*set));
+			for (int i = 0; i < pp.count; i++) {
+				struct PNState *s = &pp.state[i];
+
+				if ((sets[d * words + i / 64] & (1ULL << (i % 64))) && s->type == PN_BYTES && pn_has(s, byte[c])) {
+					set[s->out / 64] |= 1ULL << (s->out % 64);
+				}
+			}
+			pn_closure(&pp, set, stack);
+
+			for (to = 0; to < p->count && memcmp(&sets[to * words], set, words * sizeof(*set)); to++) {
+			}
+			if (to == p->count) {
+				if (p->count == PATTERN_STATES) {
+					pp.err = "Too many states";
+					break;
+				}
+				p->count++;
+			}
+			p->next[d * p->classes + c] = to;
+		}
+	}
+
+out:
+	if (pp.err) {
+		if (p) {
+			free(p->next);
+			free(p->accept);
+			free(p);
+		}
+		p = NULL;
+		*err = pp.err;
+	}
+	free(sets);
+	free(stack);
+	free(pp.state);
+	return p;
+}
+
+/* Some symbol is taken by both, or if all, every symbol b takes is taken by a too.
+ * The pairs of states the DFAs can be in together are walked, for LOP_schema_lint() */
+static bool pattern_product(const struct Pattern *a, const struct Pattern *b, bool all)
+{
+	bool *seen = calloc(a->count * b->count, sizeof(*seen));
+	int *queue = calloc(a->count * b->count, sizeof(*queue));
+	int head = 0;
+	int tail = 0;
+	bool found = false;
+
+	assert(seen && queue);
+
+	seen[1 * b->count + 1] = true;
+	queue[tail++] = 1 * b->count + 1;
+
+	while (head < tail && !found) {
+		int s = queue[head] / b->count;
+		int t = queue[head++] % b->count;
+
+		found = all ? b->accept[t] && !a->accept[s] : a->accept[s] && b->accept[t];
+
+		/* A symbol has no NUL */
+		for (int c = 1; c < 256; c++) {
+			int next = a->next[s * a->classes + a->class[c]] * b->count + b->next[t * b->classes + b->class[c]];
+
+			if (!seen[next]) {
+				seen[next] = true;
+				queue[tail++] = next;
+			}
+		}
+	}
+
+	free(seen);
+	free(queue);
+	return found != all;
+}
+
+static void pattern_free(struct Pattern *p)
+{
+	if (!p) {
+		return;
+	}
+	free(p->next);
+	free(p->accept);
+	free(p);
+}
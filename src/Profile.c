@@ -0,0 +1,148 @@
+/* Per-SN schema profile, see LOP.profile.
+ *
+ * The SNs are numbered once the schema is built, so the matcher finds the counters of
+ * an SN by SchemaNode.id. The counting itself is done by profile_enter() and friends.
+ * The path of an SN names what the SNs down to it take rather than their positions,
+ * so it stays the same when an alternative is added next to it. */
+
+static void sn_number(struct SchemaNode *sn, int *id)
+{
+	sn->id = (*id)++;
+
+	for (int i = 0; i < sn->child_count; i++) {
+		sn_number(sn->child[i], id);
+	}
+}
+
+/* SchemaNode.id, the rules in the schema order and the SNs inside them depth first */
+static void schema_number(struct LOP_Schema *schema)
+{
+	int id = 0;
+
+	for (int i = 0; i < schema->kv->count; i++) {
+		sn_number(schema->kv->children[i].value, &id);
+	}
+	schema->node_count = id;
+}
+
+/* The SN numbered id, NULL if none */
+static struct SchemaNode *schema_node(const struct LOP_Schema *schema, int id)
+{
+	struct SchemaNode *sn = NULL;
+
+	/* The last rule, and then the last child, numbered before it */
+	for (int i = 0; i < schema->kv->count && ((struct SchemaNode *)schema->kv->children[i].value)->id <= id; i++) {
+		sn = schema->kv->children[i].value;
+	}
+	while (sn && sn->id != id) {
+		struct SchemaNode *c = NULL;
+
+		for (int i = 0; i < sn->child_count && sn->child[i]->id <= id; i++) {
+			c = sn->child[i];
+		}
+		sn = c;
+	}
+
+	return sn;
+}
+
+/* "tree @item", "number 'port'", a ref is the rule name */
+static void profile_label(const struct LOP_Schema *schema, struct SchemaNode *sn, char *buf, size_t size)
+{
+	size_t len;
+
+	buf[0] = 0;
+	switch (sn->sn_type) {
+	case SN_TYPE_AST:
+	case SN_TYPE_REF:
+		sn_describe(sn, schema->kv, buf, size);
+		break;
+	case SN_TYPE_ONEOF:
+		snprintf(buf, size, "oneof");
+		break;
+	case SN_TYPE_LISTOF:
+		snprintf(buf, size, "listof");
+		break;
+	case SN_TYPE_SEQOF:
+		snprintf(buf, size, "seqof");
+		break;
+	}
+
+	for (int i = 0; i < sn->cb_count; i++) {
+		len = strlen(buf);
+		snprintf(buf + len, size - len, " @%s", schema->callback_table.data[sn->cb[i]].name);
+	}
+}
+
+static void profile_path(struct LOP_Profile *p, struct SchemaNode *sn, const char *path, bool rule)
+{
+	char label[256];
+	char other[256];
+
+	p->node[sn->id].path = strdup(path);
+	p->node[sn->id].rule = rule;
+	assert(p->node[sn->id].path);
+
+	for (int i = 0; i < sn->child_count; i++) {
+		size_t size = strlen(path) + sizeof(label) + 16;
+		char *child = malloc(size);
+		int same = 0;
+
+		assert(child);
+
+		/* The repeated siblings are told apart by their number */
+		profile_label(p->schema, sn->child[i], label, sizeof(label));
+		for (int j = 0; j < i; j++) {
+			profile_label(p->schema, sn->child[j], other, sizeof(other));
+			same += !strcmp(label, other);
+		}
+
+		if (same) {
+			snprintf(child, size, "%s/%s#%d", path, label, same + 1);
+		} else {
+			snprintf(child, size, "%s/%s", path, label);
+		}
+		profile_path(p, sn->child[i], child, false);
+		free(child);
+	}
+}
+
+void LOP_profile_init(struct LOP_Profile *p, const struct LOP_Schema *schema)
+{
+	struct KV *kv = schema->kv;
+
+	*p = (struct LOP_Profile) {
+		.schema = schema,
+		.count = schema->node_count,
+	};
+
+	p->node = calloc(p->count + 1, sizeof(*p->node));
+	assert(p->node);
+
+	for (int i = 0; i < kv->count; i++) {
+		profile_path(p, kv->children[i].value, kv->children[i].key, true);
+	}
+}
+
+void LOP_profile_deinit(struct LOP_Profile *p)
+{
+	for (int i = 0; i < p->count; i++) {
+		free(p->node[i].path);
+	}
+	free(p->node);
+
+	p->node = NULL;
+	p->count = 0;
+}
+
+void LOP_profile_dump(const struct LOP_Profile *p, FILE *out)
+{
+	for (int i = 0; i < p->count; i++) {
+		struct LOP_ProfileNode *n = &p->node[i];
+
+		fprintf(out, "%s\t%llu\t%llu\t%llu\t%llu\t%d\t%.3f\n", n->path,
+			(unsigned long long)n->attempts, (unsigned long long)n->successes,
+			(unsigned long long)n->failures, (unsigned long long)n->rollbacks,
+			n->max_depth, n->ns / 1e3);
+	}
+}
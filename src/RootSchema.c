@@ -119,8 +119,9 @@ SN_NEW( \
 
 #define SN_CB(handler) \
 do { \
-	c->key = strdup(#handler); \
-	kv_add(r->kv, #handler, handler); \
+	int id = ct_add(&schema.callback_table, #handler); \
+	schema.callback_table.data[id].fn = handler; \
+	sn_add_cb(c, id); \
 } while (0)
 
 static struct SchemaNode *sn_create()
@@ -157,12 +158,28 @@ static void sn_free(struct SchemaNode *sn)
 	}
 	free(sn->child);
 	if (sn->sn_type == SN_TYPE_AST && sn->type > LOP_TYPE_LIST_LAST) {
+		/* The first member is symbol.value */
+		for (int i = 1; sn->symbol.members && i < sn->symbol.members->count; i++) {
+			free(sn->symbol.members->value[i]);
+		}
+		set_free(sn->symbol.members);
+		pattern_free(sn->symbol.dfa);
 		free(sn->symbol.value);
 	}
-	free((void *)sn->key);
+	free(sn->cb);
+	free(sn->first);
 	free(sn);
 }
 
+static void sn_add_cb(struct SchemaNode *c, int id)
+{
+	c->cb_count++;
+	c->cb = realloc(c->cb, c->cb_count * sizeof(*c->cb));
+	assert(c->cb);
+
+	c->cb[c->cb_count - 1] = id;
+}
+
 static void sn_set_symbol_type(struct SchemaNode *c, enum LOP_ASTNodeType type)
 {
 	c->sn_type = SN_TYPE_AST;
@@ -259,13 +276,57 @@ static void sn_set_symbol(struct SchemaNode *c, const char *value)
 	assert(c->symbol.value);
 }
 
+/* The values after the first one go to the members, to be checked for #set once the SN is done */
+static void sn_add_symbol(struct SchemaNode *c, const char *value)
+{
+	char *member;
+
+	if (c->symbol.value == NULL) {
+		sn_set_symbol(c, value);
+		return;
+	}
+
+	if (c->symbol.members == NULL) {
+		c->symbol.members = calloc(1, sizeof(*c->symbol.members));
+		assert(c->symbol.members);
+		set_add(c->symbol.members, c->symbol.value);
+	}
+
+	member = strdup(value);
+	assert(member);
+	set_add(c->symbol.members, member);
+}
+
 static void sn_set_optional(struct SchemaNode *c)
 {
 	c->optional = true;
 }
 
+static void sn_set_cut(struct SchemaNode *c)
+{
+	c->cut = true;
+}
+
+static void sn_set_set(struct SchemaNode *c)
+{
+	c->set = true;
+}
+
+static void sn_set_pattern(struct SchemaNode *c)
+{
+	c->pattern = true;
+}
+
+static void sn_set_lazy(struct SchemaNode *c)
+{
+	c->lazy = true;
+}
+
 struct Runtime {
 	struct LOP_Schema *schema;
+	/* The user schema, for the errors */
+	const char *src;
+	size_t len;
 
 	int unary_count;
 	int binary_count;
@@ -273,8 +334,6 @@ struct Runtime {
 
 	const char *key;
 	struct SchemaNode *sn;
-
-	struct KV *kv;
 };
 
 static void ot_add(struct LOP_OperatorTable *table, const char *operator_string, int prio, unsigned type)
@@ -301,6 +360,38 @@ static void ot_destroy(struct LOP_OperatorTable *table)
 	free(table->data);
 }
 
+/* Returns the ID of the callback, the new names are appended */
+static int ct_add(struct LOP_CallbackTable *table, const char *name)
+{
+	struct LOP_Callback *cb;
+
+	for (int i = 0; i < table->size; i++) {
+		if (!strcmp(table->data[i].name, name)) {
+			return i;
+		}
+	}
+
+	table->size++;
+	table->data = realloc(table->data, table->size * sizeof(*table->data));
+	assert(table->data);
+
+	cb = &table->data[table->size - 1];
+
+	cb->name = strdup(name);
+	assert(cb->name);
+	cb->fn = NULL;
+
+	return table->size - 1;
+}
+
+static void ct_destroy(struct LOP_CallbackTable *table)
+{
+	for (int i = 0; i < table->size; i++) {
+		free((void *)table->data[i].name);
+	}
+	free(table->data);
+}
+
 static int cb_unary(struct Runtime *r, struct LOP_ASTNode *n, int delta)
 {
 	struct LOP_Schema *schema = r->schema;
@@ -343,11 +434,56 @@ static int cb_kv_set_key(struct Runtime *r, struct LOP_ASTNode *n, int delta)
 	return 0;
 }
 
+/* The SN has all of its values and options: #set gets its lookup, #pattern its DFA */
+static int sn_done(struct Runtime *r, struct SchemaNode *sn)
+{
+	const char *err_string = NULL;
+	const char *detail = NULL;
+	bool symbol = sn->sn_type == SN_TYPE_AST && sn->type > LOP_TYPE_LIST_LAST;
+
+	if (sn->set && (!symbol || sn->symbol.value == NULL)) {
+		err_string = "#set without the values";
+	} else if (sn->pattern && (!symbol || sn->symbol.value == NULL)) {
+		err_string = "#pattern without the value";
+	} else if (sn->pattern && (sn->set || sn->symbol.members)) {
+		err_string = "#pattern with several values";
+	} else if (symbol && sn->symbol.members && !sn->set) {
+		err_string = "Several values without #set";
+	} else if (sn->lazy && (sn->sn_type != SN_TYPE_AST || symbol)) {
+		err_string = "#lazy is for the lists only";
+	} else if (sn->lazy && !sn->cb_count) {
+		/* LOP_force() would never see it */
+		err_string = "#lazy without a callback";
+	} else if (sn->pattern && !(sn->symbol.dfa = pattern_compile(sn->symbol.value, &detail))) {
+		err_string = "Bad #pattern";
+	}
+	if (err_string) {
+		report_error(r->schema->filename, r->src, r->len, sn->loc, err_string, detail);
+		return LOP_ERROR_SCHEMA_SYNTAX;
+	}
+
+	if (sn->set) {
+		if (sn->symbol.members == NULL) {
+			sn->symbol.members = calloc(1, sizeof(*sn->symbol.members));
+			assert(sn->symbol.members);
+			set_add(sn->symbol.members, sn->symbol.value);
+		}
+		set_build(sn->symbol.members);
+	}
+	return 0;
+}
+
 static int cb_sn_create(struct Runtime *r, struct LOP_ASTNode *n, int delta)
 {
 	if (delta == 1) {
 		struct SchemaNode *c = sn_create();
+		struct LOP_ASTNode *at = n;
 
+		/* Where the declaration begins, rather than the colon of its tree */
+		while (at->type < LOP_TYPE_LIST_LAST && at->list.head) {
+			at = at->list.head;
+		}
+		c->loc = at->loc;
 		if (r->sn) {
 			sn_append(r->sn, c);
 		} else {
@@ -356,28 +492,23 @@ static int cb_sn_create(struct Runtime *r, struct LOP_ASTNode *n, int delta)
 
 		r->sn = c;
 	} else if (delta == -1) {
+		int rc = sn_done(r, r->sn);
+
 		r->sn = r->sn->parent;
+		return rc;
 	}
 	return 0;
 }
 
 static int cb_sn_set_symbol(struct Runtime *r, struct LOP_ASTNode *n, int delta)
 {
-	sn_set_symbol(r->sn, LOP_symbol_value(n));
+	sn_add_symbol(r->sn, LOP_symbol_value(n));
 	return 0;
 }
 
 static int cb_sn_set_cb(struct Runtime *r, struct LOP_ASTNode *n, int delta)
 {
-	const char *k = LOP_symbol_value(n);
-
-	if (r->sn->key) {
-		r->sn->key = realloc((char *)r->sn->key, strlen(r->sn->key) + strlen(k) + 1 + 1);
-		strcat((char *)r->sn->key, "\t");
-		strcat((char *)r->sn->key, k);
-	} else {
-		r->sn->key = strdup(k);
-	}
+	sn_add_cb(r->sn, ct_add(&r->schema->callback_table, LOP_symbol_value(n)));
 	return 0;
 }
 
@@ -387,6 +518,30 @@ static int cb_sn_set_optional(struct Runtime *r, struct LOP_ASTNode *n, int delt
 	return 0;
 }
 
+static int cb_sn_set_cut(struct Runtime *r, struct LOP_ASTNode *n, int delta)
+{
+	sn_set_cut(r->sn);
+	return 0;
+}
+
+static int cb_sn_set_set(struct Runtime *r, struct LOP_ASTNode *n, int delta)
+{
+	sn_set_set(r->sn);
+	return 0;
+}
+
+static int cb_sn_set_pattern(struct Runtime *r, struct LOP_ASTNode *n, int delta)
+{
+	sn_set_pattern(r->sn);
+	return 0;
+}
+
+static int cb_sn_set_lazy(struct Runtime *r, struct LOP_ASTNode *n, int delta)
+{
+	sn_set_lazy(r->sn);
+	return 0;
+}
+
 static int cb_sn_set_oneof(struct Runtime *r, struct LOP_ASTNode *n, int delta)
 {
 	sn_set_oneof(r->sn);
@@ -501,7 +656,7 @@ static int cb_sn_set_unary(struct Runtime *r, struct LOP_ASTNode *n, int delta)
 	return 0;
 }
 
-static struct LOP_Schema root_schema_init(struct Runtime *r)
+static struct LOP_Schema root_schema_init(void)
 {
 	struct LOP_Schema schema = {
 		.kv = kv_alloc(),
@@ -525,7 +680,7 @@ static struct LOP_Schema root_schema_init(struct Runtime *r)
 		);
 	);
 	KV_ADD("optable",
-		SN_TREE(
+		SN_TLIST(
 			SN_UNARY(
 				SN_OPERATOR(
 					sn_set_symbol(c, "#");
@@ -670,9 +825,14 @@ static struct LOP_Schema root_schema_init(struct Runtime *r)
 					SN_IDENTIFIER(
 						sn_set_symbol(c, "identifier");
 					);
-					SN_STRING(
+					SN_REF("option",
 						sn_set_optional(c);
-						SN_CB(cb_sn_set_symbol);
+					);
+					SN_LISTOF(
+						sn_set_optional(c);
+						SN_STRING(
+							SN_CB(cb_sn_set_symbol);
+						);
 					);
 					SN_REF("option",
 						sn_set_optional(c);
@@ -688,9 +848,14 @@ static struct LOP_Schema root_schema_init(struct Runtime *r)
 					SN_IDENTIFIER(
 						sn_set_symbol(c, "number");
 					);
-					SN_STRING(
+					SN_REF("option",
 						sn_set_optional(c);
-						SN_CB(cb_sn_set_symbol);
+					);
+					SN_LISTOF(
+						sn_set_optional(c);
+						SN_STRING(
+							SN_CB(cb_sn_set_symbol);
+						);
 					);
 					SN_REF("option",
 						sn_set_optional(c);
@@ -706,9 +871,14 @@ static struct LOP_Schema root_schema_init(struct Runtime *r)
 					SN_IDENTIFIER(
 						sn_set_symbol(c, "string");
 					);
-					SN_STRING(
+					SN_REF("option",
+						sn_set_optional(c);
+					);
+					SN_LISTOF(
 						sn_set_optional(c);
-						SN_CB(cb_sn_set_symbol);
+						SN_STRING(
+							SN_CB(cb_sn_set_symbol);
+						);
 					);
 					SN_REF("option",
 						sn_set_optional(c);
@@ -724,9 +894,14 @@ static struct LOP_Schema root_schema_init(struct Runtime *r)
 					SN_IDENTIFIER(
 						sn_set_symbol(c, "operator");
 					);
-					SN_STRING(
+					SN_REF("option",
+						sn_set_optional(c);
+					);
+					SN_LISTOF(
 						sn_set_optional(c);
-						SN_CB(cb_sn_set_symbol);
+						SN_STRING(
+							SN_CB(cb_sn_set_symbol);
+						);
 					);
 					SN_REF("option",
 						sn_set_optional(c);
@@ -890,12 +1065,9 @@ static struct LOP_Schema root_schema_init(struct Runtime *r)
 		);
 	);
 	KV_ADD("option",
-		SN_SEQOF(
-			SN_REF("handler",
-				sn_set_optional(c);
-			);
+		SN_LISTOF(
+			SN_REF("handler");
 			SN_UNARY(
-				sn_set_optional(c);
 				SN_CB(cb_sn_set_optional);
 				SN_OPERATOR(
 					sn_set_symbol(c, "#");
@@ -904,6 +1076,42 @@ static struct LOP_Schema root_schema_init(struct Runtime *r)
 					sn_set_symbol(c, "optional");
 				);
 			);
+			SN_UNARY(
+				SN_CB(cb_sn_set_cut);
+				SN_OPERATOR(
+					sn_set_symbol(c, "#");
+				);
+				SN_IDENTIFIER(
+					sn_set_symbol(c, "cut");
+				);
+			);
+			SN_UNARY(
+				SN_CB(cb_sn_set_set);
+				SN_OPERATOR(
+					sn_set_symbol(c, "#");
+				);
+				SN_IDENTIFIER(
+					sn_set_symbol(c, "set");
+				);
+			);
+			SN_UNARY(
+				SN_CB(cb_sn_set_pattern);
+				SN_OPERATOR(
+					sn_set_symbol(c, "#");
+				);
+				SN_IDENTIFIER(
+					sn_set_symbol(c, "pattern");
+				);
+			);
+			SN_UNARY(
+				SN_CB(cb_sn_set_lazy);
+				SN_OPERATOR(
+					sn_set_symbol(c, "#");
+				);
+				SN_IDENTIFIER(
+					sn_set_symbol(c, "lazy");
+				);
+			);
 		);
 	);
 	KV_ADD("ref_one",
@@ -929,10 +1137,12 @@ static int kv_check(void *arg, struct KVEntry *kv)
 	return 0;
 }
 
-static void call_handlers(struct Runtime *r, struct LOP *lop)
+/* Stops at the first callback which fails, and returns its error */
+static int call_handlers(struct Runtime *r, struct LOP *lop)
 {
 	struct LOP_HandlerList *hl = &lop->hl;
 	int delta = 0;
+	int rc;
 
 	for (int i = 0; i < hl->count; i++) {
 		struct LOP_Handler *h = &hl->handler[i];
@@ -946,9 +1156,13 @@ static void call_handlers(struct Runtime *r, struct LOP *lop)
 			delta++;
 		}
 
-		cb = kv_get(r->kv, h->key);
-		cb(r, h->n, h->delta);
+		cb = lop->schema->callback_table.data[h->id].fn;
+		rc = cb(r, h->n, h->delta);
+		if (rc) {
+			return rc;
+		}
 	}
+	return 0;
 }
 
 int LOP_schema_init(struct LOP_Schema *schema, const char *src, size_t len)
@@ -956,7 +1170,8 @@ int LOP_schema_init(struct LOP_Schema *schema, const char *src, size_t len)
 	struct LOP_Schema root_schema = {};
 	struct Runtime r = {
 		.schema = schema,
-		.kv = kv_alloc(),
+		.src = src,
+		.len = len,
 	};
 	int rc = 0;
 
@@ -964,9 +1179,11 @@ int LOP_schema_init(struct LOP_Schema *schema, const char *src, size_t len)
 	assert(schema->operator_table.size == 0);
 	assert(schema->operator_table.data == NULL);
 	assert(schema->kv == NULL);
+	assert(schema->callback_table.size == 0);
+	assert(schema->callback_table.data == NULL);
 
 	/* Prepare root schema to parse user schema */
-	root_schema = root_schema_init(&r);
+	root_schema = root_schema_init();
 
 	/* Alocate KV storage where rules from user schema will be stored */
 	schema->kv = kv_alloc();
@@ -979,20 +1196,23 @@ int LOP_schema_init(struct LOP_Schema *schema, const char *src, size_t len)
 
 	/* Parse user schema and fill schema with rules and operators table */
 	rc = LOP_init(&lop, src, len);
+	if (rc == 0) {
+		rc = call_handlers(&r, &lop);
+	}
 	if (rc == 0) {
 		const char *err_key = NULL;
 
-		call_handlers(&r, &lop);
-
 		/* Ensure that all references to the rules refer to the existed rules in the user schema */
 		kv_iterate(schema->kv, kv_check, &err_key);
 		if (err_key) {
 			rc = s_report(LOP_ERROR_SCHEMA_MISSING_RULE, err_key);
+		} else {
+			schema_number(schema);
+			direct_analyze(schema);
 		}
 	}
 
 	LOP_deinit(&lop);
-	kv_free(r.kv, NULL);
 
 	/* Root schema is on the stack, we must free its internal allocs */
 	LOP_schema_deinit(&root_schema);
@@ -1001,11 +1221,33 @@ int LOP_schema_init(struct LOP_Schema *schema, const char *src, size_t len)
 
 void LOP_schema_deinit(struct LOP_Schema *schema)
 {
-	kv_free(schema->kv, (free_value_t)sn_free);
+	if (schema->blob) {
+		schema_blob_free(schema);
+	} else {
+		kv_free(schema->kv, (free_value_t)sn_free);
 
-	ot_destroy(&schema->operator_table);
+		ot_destroy(&schema->operator_table);
+		ct_destroy(&schema->callback_table);
+	}
 
 	schema->kv = NULL;
 	schema->operator_table.size = 0;
 	schema->operator_table.data = NULL;
+	schema->callback_table.size = 0;
+	schema->callback_table.data = NULL;
+	schema->node_count = 0;
+}
+
+int LOP_schema_bind(struct LOP_Schema *schema, const char *name, void *fn)
+{
+	struct LOP_CallbackTable *table = &schema->callback_table;
+
+	for (int i = 0; i < table->size; i++) {
+		if (!strcmp(table->data[i].name, name)) {
+			table->data[i].fn = fn;
+			return i;
+		}
+	}
+
+	return LOP_ERROR_SCHEMA_UNKNOWN_CALLBACK;
 }
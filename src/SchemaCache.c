@@ -0,0 +1,658 @@
+#include <errno.h>
+#include <stdint.h>
+#include <sys/stat.h>
+
+#include "FileMap.h"
+
+/* Compiled schema blob layout:
+ *
+ *	struct SchemaBlobHeader
+ *	struct SchemaBlobRule[rule_count]
+ *	struct SchemaBlobNode[node_count]
+ *	uint32_t child[child_count]
+ *	int32_t cb[cb_count]
+ *	uint32_t member[member_count]
+ *	uint32_t callback[callback_count]
+ *	struct SchemaBlobOp[op_count]
+ *	char strings[strings_size]
+ *
+ * Strings are referenced by their offset in the string pool, nodes by their index,
+ * callback names (the callback table) by their ID. The #set values are strings as well,
+ * their lookup is built again on load, and so is the DFA of #pattern from its value.
+ * The blob is only valid for the same build of the library (native endianness and
+ * the same enum values), which is guarded by the version field. */
+
+#define SCHEMA_BLOB_MAGIC "LOPS"
+#define SCHEMA_BLOB_VERSION 7
+#define SCHEMA_BLOB_NONE UINT32_MAX
+
+struct SchemaBlobHeader {
+	char magic[4];
+	uint32_t version;
+	uint64_t hash;
+	uint32_t size;
+	uint32_t rule_count;
+	uint32_t node_count;
+	uint32_t child_count;
+	uint32_t cb_count;
+	uint32_t member_count;
+	uint32_t callback_count;
+	uint32_t op_count;
+	uint32_t strings_size;
+};
+
+struct SchemaBlobRule {
+	uint32_t key;
+	uint32_t node;
+};
+
+struct SchemaBlobNode {
+	uint8_t sn_type;
+	uint8_t optional;
+	uint8_t cut;
+	uint8_t type;
+	uint8_t call;
+	uint8_t set;
+	uint8_t pattern;
+	uint8_t lazy;
+	int32_t ref;
+	uint32_t symbol;
+	uint32_t child;
+	uint32_t child_count;
+	uint32_t cb;
+	uint32_t cb_count;
+	/* #set */
+	uint32_t member;
+	uint32_t member_count;
+	/* Where it's declared in the schema source */
+	uint32_t lineno;
+	uint32_t charno;
+};
+
+struct SchemaBlobOp {
+	uint32_t value;
+	int32_t prio;
+	uint32_t type;
+};
+
+/* What LOP_schema_load() allocates instead of the separate SchemaNodes */
+struct LOP_SchemaBlob {
+	struct FileMap map;
+	struct SchemaNode *node;
+	uint32_t node_count;
+	struct SchemaNode **child;
+};
+
+/* FNV-1a */
+static uint64_t schema_hash(const char *src, size_t len)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (size_t i = 0; i < len; i++) {
+		hash ^= (unsigned char)src[i];
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+struct BlobWriter {
+	struct SchemaBlobHeader header;
+
+	struct SchemaBlobNode *node;
+	uint32_t *child;
+	int32_t *cb;
+	uint32_t *member;
+	char *strings;
+
+	struct KV *kv;
+};
+
+static uint32_t bw_string(struct BlobWriter *bw, const char *str)
+{
+	uint32_t offset = bw->header.strings_size;
+	size_t len;
+
+	if (str == NULL) {
+		return SCHEMA_BLOB_NONE;
+	}
+
+	len = strlen(str) + 1;
+
+	bw->header.strings_size += len;
+	bw->strings = realloc(bw->strings, bw->header.strings_size);
+	assert(bw->strings);
+
+	memcpy(bw->strings + offset, str, len);
+
+	return offset;
+}
+
+static uint32_t bw_node(struct BlobWriter *bw, struct SchemaNode *sn)
+{
+	uint32_t index = bw->header.node_count++;
+	uint32_t child;
+
+	bw->node = realloc(bw->node, bw->header.node_count * sizeof(*bw->node));
+	assert(bw->node);
+
+	/* Children are stored contiguously, so reserve the slots before recursing */
+	child = bw->header.child_count;
+	bw->header.child_count += sn->child_count;
+	bw->child = realloc(bw->child, bw->header.child_count * sizeof(*bw->child));
+	if (bw->header.child_count) {
+		assert(bw->child);
+	}
+
+	bw->node[index] = (struct SchemaBlobNode) {
+		.sn_type = sn->sn_type,
+		.optional = sn->optional,
+		.cut = sn->cut,
+		.set = sn->set,
+		.pattern = sn->pattern,
+		.lazy = sn->lazy,
+		.type = sn->type,
+		.ref = sn->ref,
+		.symbol = SCHEMA_BLOB_NONE,
+		.child = child,
+		.child_count = sn->child_count,
+		.cb = bw->header.cb_count,
+		.cb_count = sn->cb_count,
+		.lineno = sn->loc.lineno,
+		.charno = sn->loc.charno,
+	};
+
+	bw->header.cb_count += sn->cb_count;
+	bw->cb = realloc(bw->cb, bw->header.cb_count * sizeof(*bw->cb));
+	if (bw->header.cb_count) {
+		assert(bw->cb);
+	}
+	for (int i = 0; i < sn->cb_count; i++) {
+		bw->cb[bw->node[index].cb + i] = sn->cb[i];
+	}
+
+	if (sn->sn_type == SN_TYPE_AST) {
+		if (sn->type < LOP_TYPE_LIST_LAST) {
+			bw->node[index].call = sn->list.call;
+		} else {
+			bw->node[index].symbol = bw_string(bw, sn->symbol.value);
+		}
+	}
+
+	if (sn->sn_type == SN_TYPE_AST && sn->type > LOP_TYPE_LIST_LAST && sn->symbol.members) {
+		struct SymbolSet *set = sn->symbol.members;
+		uint32_t member = bw->header.member_count;
+
+		bw->header.member_count += set->count;
+		bw->member = realloc(bw->member, bw->header.member_count * sizeof(*bw->member));
+		assert(bw->member);
+
+		bw->node[index].member = member;
+		bw->node[index].member_count = set->count;
+		for (int i = 0; i < set->count; i++) {
+			bw->member[member + i] = bw_string(bw, set->value[i]);
+		}
+	}
+
+	for (int i = 0; i < sn->child_count; i++) {
+		uint32_t c = bw_node(bw, sn->child[i]);
+
+		bw->child[child + i] = c;
+	}
+
+	return index;
+}
+
+static int bw_write(int fd, const void *data, size_t len)
+{
+	const char *p = data;
+
+	while (len) {
+		ssize_t rc = write(fd, p, len);
+
+		if (rc < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+
+		p += rc;
+		len -= rc;
+	}
+
+	return 0;
+}
+
+int LOP_schema_save(struct LOP_Schema *schema, const char *filename, const char *src, size_t len)
+{
+	struct BlobWriter bw = {
+		.header = {
+			.magic = SCHEMA_BLOB_MAGIC,
+			.version = SCHEMA_BLOB_VERSION,
+			.hash = schema_hash(src, len),
+		},
+		.kv = schema->kv,
+	};
+	struct KV *kv = schema->kv;
+	struct SchemaBlobRule *rule;
+	struct SchemaBlobOp *op;
+	uint32_t *callback;
+	char *tmp;
+	int fd;
+	int rc = 0;
+
+	rule = calloc(kv->count + 1, sizeof(*rule));
+	op = calloc(schema->operator_table.size + 1, sizeof(*op));
+	callback = calloc(schema->callback_table.size + 1, sizeof(*callback));
+	assert(rule && op && callback);
+
+	bw.header.rule_count = kv->count;
+	for (int i = 0; i < kv->count; i++) {
+		rule[i].key = bw_string(&bw, kv->children[i].key);
+		rule[i].node = bw_node(&bw, kv->children[i].value);
+	}
+
+	bw.header.op_count = schema->operator_table.size;
+	for (int i = 0; i < schema->operator_table.size; i++) {
+		struct LOP_Operator *o = &schema->operator_table.data[i];
+
+		op[i] = (struct SchemaBlobOp) {
+			.value = bw_string(&bw, o->value),
+			.prio = o->prio,
+			.type = o->type,
+		};
+	}
+
+	bw.header.callback_count = schema->callback_table.size;
+	for (int i = 0; i < schema->callback_table.size; i++) {
+		callback[i] = bw_string(&bw, schema->callback_table.data[i].name);
+	}
+
+	bw.header.size = sizeof(bw.header) +
+		bw.header.rule_count * sizeof(*rule) +
+		bw.header.node_count * sizeof(*bw.node) +
+		bw.header.child_count * sizeof(*bw.child) +
+		bw.header.cb_count * sizeof(*bw.cb) +
+		bw.header.member_count * sizeof(*bw.member) +
+		bw.header.callback_count * sizeof(*callback) +
+		bw.header.op_count * sizeof(*op) +
+		bw.header.strings_size;
+
+	/* Write to the side and rename, so the concurrent loaders never see a partial blob */
+	tmp = malloc(strlen(filename) + sizeof(".tmp"));
+	assert(tmp);
+	strcpy(tmp, filename);
+	strcat(tmp, ".tmp");
+
+	fd = open(tmp, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (fd < 0) {
+		perror("open");
+		rc = LOP_ERROR_SCHEMA_CACHE;
+		goto out;
+	}
+
+	if (bw_write(fd, &bw.header, sizeof(bw.header)) ||
+		bw_write(fd, rule, bw.header.rule_count * sizeof(*rule)) ||
+		bw_write(fd, bw.node, bw.header.node_count * sizeof(*bw.node)) ||
+		bw_write(fd, bw.child, bw.header.child_count * sizeof(*bw.child)) ||
+		bw_write(fd, bw.cb, bw.header.cb_count * sizeof(*bw.cb)) ||
+		bw_write(fd, bw.member, bw.header.member_count * sizeof(*bw.member)) ||
+		bw_write(fd, callback, bw.header.callback_count * sizeof(*callback)) ||
+		bw_write(fd, op, bw.header.op_count * sizeof(*op)) ||
+		bw_write(fd, bw.strings, bw.header.strings_size)) {
+		perror("write");
+		rc = LOP_ERROR_SCHEMA_CACHE;
+	}
+
+	close(fd);
+
+	if (rc == 0 && rename(tmp, filename)) {
+		perror("rename");
+		rc = LOP_ERROR_SCHEMA_CACHE;
+	}
+
+	if (rc < 0) {
+		unlink(tmp);
+	}
+
+out:
+	free(tmp);
+	free(rule);
+	free(op);
+	free(callback);
+	free(bw.node);
+	free(bw.child);
+	free(bw.cb);
+	free(bw.member);
+	free(bw.strings);
+	return rc;
+}
+
+/* The sections of a mapped blob */
+struct BlobReader {
+	const struct SchemaBlobHeader *header;
+	const struct SchemaBlobRule *rule;
+	const struct SchemaBlobNode *node;
+	const uint32_t *child;
+	const int32_t *cb;
+	const uint32_t *member;
+	const uint32_t *callback;
+	const struct SchemaBlobOp *op;
+	const char *strings;
+};
+
+/* The last string ends the section, so every one which starts inside it ends there too */
+static bool br_string(const struct BlobReader *br, uint32_t offset, bool optional)
+{
+	return offset < br->header->strings_size || (optional && offset == SCHEMA_BLOB_NONE);
+}
+
+static bool br_range(uint32_t first, uint32_t count, uint32_t total)
+{
+	return first <= total && count <= total - first;
+}
+
+static bool br_node(const struct BlobReader *br, uint32_t index)
+{
+	const struct SchemaBlobHeader *header = br->header;
+	const struct SchemaBlobNode *bn = &br->node[index];
+	bool symbol = bn->sn_type == SN_TYPE_AST && bn->type > LOP_TYPE_LIST_LAST;
+
+	if (bn->sn_type > SN_TYPE_REF ||
+		(bn->sn_type == SN_TYPE_AST && (bn->type > LOP_TYPE_NIL || bn->type == LOP_TYPE_LIST_LAST_CALLABLE ||
+						bn->type == LOP_TYPE_LIST_LAST)) ||
+		(bn->sn_type == SN_TYPE_REF && (bn->ref < 0 || (uint32_t)bn->ref >= header->rule_count)) ||
+		!br_range(bn->child, bn->child_count, header->child_count) ||
+		!br_range(bn->cb, bn->cb_count, header->cb_count) ||
+		!br_range(bn->member, bn->member_count, header->member_count) ||
+		(symbol && !br_string(br, bn->symbol, true)) ||
+		(bn->set && (!symbol || !bn->member_count)) ||
+		(bn->member_count && !bn->set) ||
+		(bn->pattern && (!symbol || bn->symbol == SCHEMA_BLOB_NONE))) {
+		return false;
+	}
+
+	/* The children follow their parent, so they can't make a loop */
+	for (uint32_t j = 0; j < bn->child_count; j++) {
+		uint32_t c = br->child[bn->child + j];
+
+		if (c <= index || c >= header->node_count) {
+			return false;
+		}
+	}
+	for (uint32_t j = 0; j < bn->cb_count; j++) {
+		int32_t id = br->cb[bn->cb + j];
+
+		if (id < 0 || (uint32_t)id >= header->callback_count) {
+			return false;
+		}
+	}
+	for (uint32_t j = 0; j < bn->member_count; j++) {
+		if (!br_string(br, br->member[bn->member + j], false)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* Every node is a rule of its own or the child of one other node, as bw_node() lays them out */
+static bool br_tree(const struct BlobReader *br)
+{
+	const struct SchemaBlobHeader *header = br->header;
+	uint8_t *owner = calloc(header->node_count + 1, sizeof(*owner));
+	bool ok = true;
+
+	assert(owner);
+	for (uint32_t i = 0; i < header->rule_count; i++) {
+		for (uint32_t j = 0; j < i && ok; j++) {
+			ok = strcmp(&br->strings[br->rule[i].key], &br->strings[br->rule[j].key]) != 0;
+		}
+		owner[br->rule[i].node] += owner[br->rule[i].node] < 2;
+	}
+	for (uint32_t i = 0; i < header->node_count; i++) {
+		const struct SchemaBlobNode *bn = &br->node[i];
+
+		for (uint32_t j = 0; j < bn->child_count; j++) {
+			owner[br->child[bn->child + j]] += owner[br->child[bn->child + j]] < 2;
+		}
+	}
+	for (uint32_t i = 0; i < header->node_count && ok; i++) {
+		ok = owner[i] == 1;
+	}
+
+	free(owner);
+	return ok;
+}
+
+/* The blob comes from the disk, nothing in it is used before it's checked here */
+static bool br_open(struct BlobReader *br, const struct FileMap *map)
+{
+	const struct SchemaBlobHeader *header = map->data;
+	uint64_t size;
+
+	if (map->len < sizeof(*header) || header->size != map->len) {
+		return false;
+	}
+
+	size = sizeof(*header) +
+		(uint64_t)header->rule_count * sizeof(*br->rule) +
+		(uint64_t)header->node_count * sizeof(*br->node) +
+		(uint64_t)header->child_count * sizeof(*br->child) +
+		(uint64_t)header->cb_count * sizeof(*br->cb) +
+		(uint64_t)header->member_count * sizeof(*br->member) +
+		(uint64_t)header->callback_count * sizeof(*br->callback) +
+		(uint64_t)header->op_count * sizeof(*br->op) +
+		header->strings_size;
+	if (size != header->size) {
+		return false;
+	}
+
+	br->header = header;
+	br->rule = (const void *)(header + 1);
+	br->node = (const void *)(br->rule + header->rule_count);
+	br->child = (const void *)(br->node + header->node_count);
+	br->cb = (const void *)(br->child + header->child_count);
+	br->member = (const void *)(br->cb + header->cb_count);
+	br->callback = (const void *)(br->member + header->member_count);
+	br->op = (const void *)(br->callback + header->callback_count);
+	br->strings = (const void *)(br->op + header->op_count);
+
+	if (header->strings_size && br->strings[header->strings_size - 1]) {
+		return false;
+	}
+
+	for (uint32_t i = 0; i < header->rule_count; i++) {
+		if (!br_string(br, br->rule[i].key, false) || br->rule[i].node >= header->node_count) {
+			return false;
+		}
+	}
+	for (uint32_t i = 0; i < header->node_count; i++) {
+		if (!br_node(br, i)) {
+			return false;
+		}
+	}
+	if (!br_tree(br)) {
+		return false;
+	}
+	for (uint32_t i = 0; i < header->callback_count; i++) {
+		if (!br_string(br, br->callback[i], false)) {
+			return false;
+		}
+	}
+	for (uint32_t i = 0; i < header->op_count; i++) {
+		if (!br_string(br, br->op[i].value, false)) {
+			return false;
+		}
+	}
+
+	return true;
+}
+
+/* The nodes built from the blob, and the blob */
+static void schema_blob_nodes_free(struct LOP_SchemaBlob *blob)
+{
+	for (uint32_t i = 0; i < blob->node_count; i++) {
+		if (blob->node[i].sn_type == SN_TYPE_AST && blob->node[i].type > LOP_TYPE_LIST_LAST) {
+			set_free(blob->node[i].symbol.members);
+			pattern_free(blob->node[i].symbol.dfa);
+		}
+		free(blob->node[i].first);
+	}
+
+	free(blob->node);
+	free(blob->child);
+	unmap_file(blob->map);
+	free(blob);
+}
+
+int LOP_schema_load(struct LOP_Schema *schema, const char *filename, const char *src, size_t len)
+{
+	struct BlobReader br;
+	const struct SchemaBlobHeader *header;
+	struct LOP_SchemaBlob *blob;
+	struct FileMap map;
+	bool broken = false;
+
+	/* We will fill the structure */
+	assert(schema->operator_table.size == 0);
+	assert(schema->operator_table.data == NULL);
+	assert(schema->kv == NULL);
+	assert(schema->callback_table.size == 0);
+	assert(schema->callback_table.data == NULL);
+
+	/* Missing cache is not an error to report, the caller falls back to LOP_schema_init() */
+	if (access(filename, R_OK)) {
+		return LOP_ERROR_SCHEMA_CACHE;
+	}
+
+	map = map_file(filename);
+	if (map.fd < 0) {
+		return LOP_ERROR_SCHEMA_CACHE;
+	}
+	close(map.fd);
+
+	header = map.data;
+	if (map.len < sizeof(*header) ||
+		memcmp(header->magic, SCHEMA_BLOB_MAGIC, sizeof(header->magic)) ||
+		header->version != SCHEMA_BLOB_VERSION ||
+		header->hash != schema_hash(src, len) ||
+		!br_open(&br, &map)) {
+		unmap_file(map);
+		return LOP_ERROR_SCHEMA_CACHE;
+	}
+
+#define BLOB_STRING(offset) ((offset) == SCHEMA_BLOB_NONE ? NULL : (char *)&br.strings[offset])
+
+	blob = calloc(1, sizeof(*blob));
+	assert(blob);
+
+	blob->map = map;
+	blob->node = calloc(header->node_count + 1, sizeof(*blob->node));
+	blob->node_count = header->node_count;
+	blob->child = calloc(header->child_count + 1, sizeof(*blob->child));
+	assert(blob->node && blob->child);
+
+	for (uint32_t i = 0; i < header->node_count; i++) {
+		struct SchemaNode *sn = &blob->node[i];
+		const struct SchemaBlobNode *bn = &br.node[i];
+
+		sn->sn_type = bn->sn_type;
+		sn->optional = bn->optional;
+		sn->cut = bn->cut;
+		sn->set = bn->set;
+		sn->pattern = bn->pattern;
+		sn->lazy = bn->lazy;
+		sn->type = bn->type;
+		sn->ref = bn->ref;
+		sn->child = &blob->child[bn->child];
+		sn->child_count = bn->child_count;
+		sn->cb = (int *)&br.cb[bn->cb];
+		sn->cb_count = bn->cb_count;
+		sn->loc.lineno = bn->lineno;
+		sn->loc.charno = bn->charno;
+
+		if (sn->sn_type == SN_TYPE_AST) {
+			if (sn->type < LOP_TYPE_LIST_LAST) {
+				sn->list.call = bn->call;
+			} else {
+				sn->symbol.value = BLOB_STRING(bn->symbol);
+			}
+		}
+
+		if (bn->member_count) {
+			sn->symbol.members = calloc(1, sizeof(*sn->symbol.members));
+			assert(sn->symbol.members);
+			for (uint32_t j = 0; j < bn->member_count; j++) {
+				set_add(sn->symbol.members, BLOB_STRING(br.member[bn->member + j]));
+			}
+			set_build(sn->symbol.members);
+		}
+		if (sn->pattern) {
+			const char *err;
+
+			/* It compiled before it was saved, unless the blob is broken */
+			sn->symbol.dfa = pattern_compile(sn->symbol.value, &err);
+			broken |= !sn->symbol.dfa;
+		}
+
+		for (uint32_t j = 0; j < bn->child_count; j++) {
+			struct SchemaNode *c = &blob->node[br.child[bn->child + j]];
+
+			sn->child[j] = c;
+			c->parent = sn;
+			if (j) {
+				sn->child[j - 1]->next = c;
+			}
+		}
+	}
+
+	if (broken) {
+		schema_blob_nodes_free(blob);
+		return LOP_ERROR_SCHEMA_CACHE;
+	}
+
+	schema->kv = kv_alloc();
+	for (uint32_t i = 0; i < header->rule_count; i++) {
+		kv_add(schema->kv, BLOB_STRING(br.rule[i].key), &blob->node[br.rule[i].node]);
+	}
+
+	schema->operator_table.size = header->op_count;
+	schema->operator_table.data = calloc(header->op_count + 1, sizeof(*schema->operator_table.data));
+	assert(schema->operator_table.data);
+	for (uint32_t i = 0; i < header->op_count; i++) {
+		schema->operator_table.data[i] = (struct LOP_Operator) {
+			.value = BLOB_STRING(br.op[i].value),
+			.prio = br.op[i].prio,
+			.type = br.op[i].type,
+		};
+	}
+
+	schema->callback_table.size = header->callback_count;
+	schema->callback_table.data = calloc(header->callback_count + 1, sizeof(*schema->callback_table.data));
+	assert(schema->callback_table.data);
+	for (uint32_t i = 0; i < header->callback_count; i++) {
+		schema->callback_table.data[i].name = BLOB_STRING(br.callback[i]);
+	}
+
+#undef BLOB_STRING
+
+	schema_number(schema);
+	direct_analyze(schema);
+	schema->blob = blob;
+	return 0;
+}
+
+static void schema_blob_free(struct LOP_Schema *schema)
+{
+	struct LOP_SchemaBlob *blob = schema->blob;
+
+	/* Nodes, keys, symbols, operators and callback names all point into the blob */
+	kv_free(schema->kv, NULL);
+	free(schema->operator_table.data);
+	free(schema->callback_table.data);
+	schema_blob_nodes_free(blob);
+
+	schema->blob = NULL;
+}
@@ -0,0 +1,1438 @@
+/* Schema to C code generator.
+ *
+ * Every SchemaNode becomes its own function with the node type resolved at
+ * generation time: oneof/listof alternatives are dispatched by a switch on
+ * the AST node type (and the symbol for fixed symbols) when some of them are
+ * AST nodes, seqof and list children are unrolled into straight-line code.
+ * What is left generic is the continuation to the next AST sibling, which
+ * walks the runtime parent chain exactly like check_entry() does, so the
+ * produced LOP_HandlerList is the same. Unlike check_entry(), it's recursive,
+ * except for the items of a listof: g_items() takes them in a loop and keeps
+ * what's left to try in them on a stack of its own, so the native stack grows
+ * with the nesting of the lists but not with their length.
+ *
+ * The generated file only needs LOP.h and liblop for the AST. */
+
+struct GenContext {
+	FILE *out;
+	const char *prefix;
+	struct KV *kv;
+
+	struct SchemaNode **node;
+	int count;
+	/* Some node is #cut, the alternatives check for it */
+	bool cut;
+	/* Some node is #set, the lookup is emitted */
+	bool set;
+	/* Some node is #pattern, the DFA run is emitted */
+	bool pattern;
+	/* Some seqof leaves the next child on the native stack */
+	bool stacked;
+};
+
+/* The seqof can be an item, the child after the optional one is left on the native stack then */
+static bool gen_stacked(struct SchemaNode *sn, int i)
+{
+	return sn->sn_type == SN_TYPE_SEQOF && sn->child[i]->optional && i + 1 < sn->child_count;
+}
+
+static void gen_collect(struct GenContext *g, struct SchemaNode *sn)
+{
+	g->count++;
+	g->node = realloc(g->node, g->count * sizeof(*g->node));
+	assert(g->node);
+	g->node[g->count - 1] = sn;
+	g->cut |= sn->cut;
+	g->set |= sn->set;
+	g->pattern |= sn->pattern;
+
+	for (int i = 0; i < sn->child_count; i++) {
+		g->stacked |= gen_stacked(sn, i);
+		gen_collect(g, sn->child[i]);
+	}
+}
+
+static int gen_id(struct GenContext *g, struct SchemaNode *sn)
+{
+	for (int i = 0; i < g->count; i++) {
+		if (g->node[i] == sn) {
+			return i;
+		}
+	}
+
+	assert(0);
+	return -1;
+}
+
+static struct SchemaNode *gen_ref(struct GenContext *g, struct SchemaNode *sn)
+{
+	return g->kv->children[sn->ref].value;
+}
+
+static void gen_string(struct GenContext *g, const char *str)
+{
+	fputc('"', g->out);
+	for (; *str; str++) {
+		unsigned char c = *str;
+
+		if (c == '"' || c == '\\') {
+			fprintf(g->out, "\\%c", c);
+		} else if (c == '\n') {
+			fprintf(g->out, "\\n");
+		} else if (c == '\t') {
+			fprintf(g->out, "\\t");
+		} else if (!isprint(c)) {
+			fprintf(g->out, "\\%03o", c);
+		} else {
+			fputc(c, g->out);
+		}
+	}
+	fputc('"', g->out);
+}
+
+static const char *gen_type_name(enum LOP_ASTNodeType type)
+{
+	switch (type) {
+	case LOP_TYPE_LIST_ROUND: return "LOP_TYPE_LIST_ROUND";
+	case LOP_TYPE_LIST_CURLY: return "LOP_TYPE_LIST_CURLY";
+	case LOP_TYPE_LIST_SQUARE: return "LOP_TYPE_LIST_SQUARE";
+	case LOP_TYPE_LIST_COLON: return "LOP_TYPE_LIST_COLON";
+	case LOP_TYPE_LIST_STRING: return "LOP_TYPE_LIST_STRING";
+	case LOP_TYPE_LIST_OPERATOR_UNARY: return "LOP_TYPE_LIST_OPERATOR_UNARY";
+	case LOP_TYPE_LIST_OPERATOR_BINARY: return "LOP_TYPE_LIST_OPERATOR_BINARY";
+	case LOP_TYPE_OPERATOR: return "LOP_TYPE_OPERATOR";
+	case LOP_TYPE_ID: return "LOP_TYPE_ID";
+	case LOP_TYPE_NUMBER: return "LOP_TYPE_NUMBER";
+	case LOP_TYPE_STRING: return "LOP_TYPE_STRING";
+	case LOP_TYPE_NIL: return "LOP_TYPE_NIL";
+	default:
+		assert(0);
+	}
+	return NULL;
+}
+
+static const char *gen_sn_type_name(enum SchemaNodeType type)
+{
+	switch (type) {
+	case SN_TYPE_AST: return "G_AST";
+	case SN_TYPE_ONEOF: return "G_ONEOF";
+	case SN_TYPE_LISTOF: return "G_LISTOF";
+	case SN_TYPE_SEQOF: return "G_SEQOF";
+	case SN_TYPE_REF: return "G_REF";
+	}
+	assert(0);
+	return NULL;
+}
+
+/* Runtime part of the generated file: the continuation to the next sibling,
+ * handler list and error reporting. Mirrors ASTSchema.c. */
+static const char gen_runtime[] =
+"#include <assert.h>\n"
+"#include <ctype.h>\n"
+"#include <stdbool.h>\n"
+"#include <stdio.h>\n"
+"#include <stdlib.h>\n"
+"#include <string.h>\n"
+"\n"
+"#include <LOP.h>\n"
+"\n"
+"enum { G_AST, G_ONEOF, G_LISTOF, G_SEQOF, G_REF };\n"
+"\n"
+"/* Matcher state of an AST node, by LOP_ASTNode.id */\n"
+"struct GMatchNode {\n"
+"	uint32_t index;\n"
+"	const void *sn;\n"
+"};\n"
+"\n"
+"struct GNode;\n"
+"\n"
+"/* The furthest mismatch, see g_fail_at() */\n"
+"struct GFailure {\n"
+"	size_t pos;\n"
+"	int depth;\n"
+"	struct LOP_Location loc;\n"
+"	bool end;\n"
+"	bool root;\n"
+"	enum LOP_ASTNodeType type;\n"
+"	bool call;\n"
+"	char symbol[32];\n"
+"	const struct GNode *expected[16];\n"
+"	int count;\n"
+"};\n"
+"\n"
+"struct GCont;\n"
+"struct GChoice;\n"
+"\n"
+"struct GContext {\n"
+"	struct LOP_CallbackTable *ct;\n"
+"	struct LOP_HandlerList *hl;\n"
+"	struct GMatchNode *node;\n"
+"	struct GFailure fail;\n"
+"	/* The GConts, in blocks which don't move, see g_try() */\n"
+"	struct GCont **cont;\n"
+"	size_t cont_count;\n"
+"	size_t cont_blocks;\n"
+"	/* What's left to try once the rest fails, see g_items() */\n"
+"	struct GChoice *choice;\n"
+"	int choice_count;\n"
+"	int choice_capacity;\n"
+"	/* Alternatives left on the native stack, g_items() takes no item past them */\n"
+"	int stacked;\n"
+"	/* An item has matched, bounce gets it back to its g_items() which goes on at bounce_ast */\n"
+"	struct GCont *bounce;\n"
+"	struct LOP_ASTNode *bounce_ast;\n"
+"	/* Where the native stack was when the match started, see G_MAX_STACK */\n"
+"	const char *stack;\n"
+"	bool deep;\n"
+"};\n"
+"\n"
+"struct GNode {\n"
+"	int sn_type;\n"
+"	bool optional;\n"
+"	bool cut;\n"
+"	/* What it takes first, for the errors */\n"
+"	const char *expect;\n"
+"	const int *cb;\n"
+"	int cb_count;\n"
+"	const struct GNode *next;\n"
+"	/* Enter the node at ast */\n"
+"	bool (*match)(struct GContext *ctx, struct LOP_ASTNode *ast, struct GCont *cec);\n"
+"	/* oneof/listof: try the alternatives at ast under the parent, from the given one on.\n"
+"	 * cut is the one of the parent before the first of them */\n"
+"	bool (*alt)(struct GContext *ctx, struct LOP_ASTNode *ast, struct GCont *parent, int from, bool cut);\n"
+"};\n"
+"\n"
+"struct GCont {\n"
+"	const struct GNode *sn;\n"
+"	struct GCont *parent;\n"
+"	/* oneof/listof: the current item has nothing else to try */\n"
+"	bool cut;\n"
+"	/* listof: g_items() takes the items, with ctx->stacked as it was then */\n"
+"	bool loop;\n"
+"	int stacked;\n"
+"};\n"
+"\n"
+"/* An alternative which is left, resumed if everything after the one taken fails */\n"
+"struct GChoice {\n"
+"	bool (*resume)(struct GContext *ctx, const struct GChoice *c);\n"
+"	const struct GNode *sn;\n"
+"	struct LOP_ASTNode *ast;\n"
+"	struct GCont *cec;\n"
+"	int from;\n"
+"	bool cut;\n"
+"	int hl_count;\n"
+"};\n"
+"\n"
+"/* Lists nested so deep that the match takes more of the native stack than this stop it,\n"
+" * rather than overflow the 8 MB the main thread has by default */\n"
+"#define G_MAX_STACK (6 << 20)\n"
+"#define G_BLOCK 1024\n"
+"\n"
+"static void g_reserve(struct LOP_HandlerList *hl, int count)\n"
+"{\n"
+"	if (count <= hl->capacity) {\n"
+"		return;\n"
+"	}\n"
+"\n"
+"	while (hl->capacity < count) {\n"
+"		hl->capacity = hl->capacity ? hl->capacity * 2 : 64;\n"
+"	}\n"
+"\n"
+"	if (hl->compact) {\n"
+"		hl->compact_handler = realloc(hl->compact_handler, hl->capacity * sizeof(*hl->compact_handler));\n"
+"		hl->close = realloc(hl->close, hl->capacity * sizeof(*hl->close));\n"
+"		assert(hl->close);\n"
+"	} else {\n"
+"		hl->handler = realloc(hl->handler, hl->capacity * sizeof(*hl->handler));\n"
+"	}\n"
+"	assert(hl->handler);\n"
+"	hl->reallocs++;\n"
+"}\n"
+"\n"
+"static uint32_t g_node(struct GContext *ctx, struct LOP_ASTNode *n)\n"
+"{\n"
+"	struct LOP_HandlerList *hl = ctx->hl;\n"
+"	struct GMatchNode *mn;\n"
+"\n"
+"	if (n == NULL) {\n"
+"		return 0;\n"
+"	}\n"
+"\n"
+"	mn = &ctx->node[n->id];\n"
+"	if (mn->index == 0) {\n"
+"		if (hl->node_count == hl->node_capacity) {\n"
+"			hl->node_capacity = hl->node_capacity ? hl->node_capacity * 2 : 64;\n"
+"			hl->node = realloc(hl->node, hl->node_capacity * sizeof(*hl->node));\n"
+"			assert(hl->node);\n"
+"		}\n"
+"		hl->node[hl->node_count++] = n;\n"
+"		mn->index = hl->node_count;\n"
+"	}\n"
+"\n"
+"	return mn->index;\n"
+"}\n"
+"\n"
+"static void g_begin(struct LOP *lop, const struct LOP_CallbackTable *ct)\n"
+"{\n"
+"	struct LOP_HandlerList *hl = &lop->hl;\n"
+"\n"
+"	if (hl->compact != lop->compact) {\n"
+"		free(hl->handler);\n"
+"		free(hl->close);\n"
+"		hl->handler = NULL;\n"
+"		hl->close = NULL;\n"
+"		hl->capacity = 0;\n"
+"	}\n"
+"\n"
+"	hl->compact = lop->compact;\n"
+"	hl->ct = ct;\n"
+"	hl->count = 0;\n"
+"	hl->node_count = 0;\n"
+"	hl->reallocs = 0;\n"
+"}\n"
+"\n"
+"static void g_add(struct GContext *ctx, const struct GNode *sn, struct LOP_ASTNode *n, int delta, int member)\n"
+"{\n"
+"	struct LOP_HandlerList *hl = ctx->hl;\n"
+"	int count = hl->count;\n"
+"\n"
+"	if (!sn->cb_count) {\n"
+"		return;\n"
+"	}\n"
+"\n"
+"	g_reserve(hl, count + sn->cb_count);\n"
+"	hl->count = count + sn->cb_count;\n"
+"\n"
+"	for (int i = 0; i < sn->cb_count; i++) {\n"
+"		int id = sn->cb[delta == -1 ? sn->cb_count - 1 - i : i];\n"
+"\n"
+"		if (hl->compact) {\n"
+"			hl->compact_handler[count + i] = (struct LOP_CompactHandler) { id << 2 | (delta + 1), g_node(ctx, n) };\n"
+"			hl->close[count + i] = member;\n"
+"		} else {\n"
+"			hl->handler[count + i] = (struct LOP_Handler) {\n"
+"				.key = ctx->ct->data[id].name,\n"
+"				.n = n,\n"
+"				.id = id,\n"
+"				.delta = delta,\n"
+"				.member = member,\n"
+"			};\n"
+"		}\n"
+"	}\n"
+"}\n"
+"\n"
+"static bool g_enter(struct GContext *ctx, struct LOP_ASTNode *ast, const struct GNode *sn)\n"
+"{\n"
+"	struct GMatchNode *mn = &ctx->node[ast->id];\n"
+"\n"
+"	if (mn->sn == sn) {\n"
+"		return false;\n"
+"	}\n"
+"\n"
+"	mn->sn = sn;\n"
+"	return true;\n"
+"}\n"
+"\n"
+"static size_t g_offset(struct LOP_ASTNode *n)\n"
+"{\n"
+"	return n->loc.line_offset + n->loc.charno;\n"
+"}\n"
+"\n"
+"static void g_fail_add(struct GFailure *f, const struct GNode *sn)\n"
+"{\n"
+"	for (int i = 0; i < f->count; i++) {\n"
+"		if (f->expected[i] == sn) {\n"
+"			return;\n"
+"		}\n"
+"	}\n"
+"	if (f->count < 16) {\n"
+"		f->expected[f->count++] = sn;\n"
+"	}\n"
+"}\n"
+"\n"
+"static bool g_fail_further(struct GFailure *f, size_t pos, int depth, const struct GNode *sn)\n"
+"{\n"
+"	if (pos < f->pos || (pos == f->pos && depth < f->depth)) {\n"
+"		return false;\n"
+"	}\n"
+"	if (pos == f->pos && depth == f->depth) {\n"
+"		g_fail_add(f, sn);\n"
+"		return false;\n"
+"	}\n"
+"\n"
+"	f->pos = pos;\n"
+"	f->depth = depth;\n"
+"	f->count = 0;\n"
+"	g_fail_add(f, sn);\n"
+"	return true;\n"
+"}\n"
+"\n"
+"static struct LOP_ASTNode *g_first(struct LOP_ASTNode *n)\n"
+"{\n"
+"	if (n->type > LOP_TYPE_LIST_LAST || !n->list.head) {\n"
+"		return NULL;\n"
+"	}\n"
+"	return n->type == LOP_TYPE_LIST_OPERATOR_BINARY ? n->list.head->next : n->list.head;\n"
+"}\n"
+"\n"
+"/* sn has failed at n */\n"
+"static void g_fail_at(struct GContext *ctx, const struct GNode *sn, struct LOP_ASTNode *n)\n"
+"{\n"
+"	struct GFailure *f = &ctx->fail;\n"
+"	struct LOP_ASTNode *first = n;\n"
+"	int depth = 0;\n"
+"\n"
+"	for (struct LOP_ASTNode *p = n; p->parent && g_first(p->parent) == p; p = p->parent) {\n"
+"		depth++;\n"
+"	}\n"
+"	for (struct LOP_ASTNode *i = g_first(n); i; i = g_first(i)) {\n"
+"		if (g_offset(i) < g_offset(first)) {\n"
+"			first = i;\n"
+"		}\n"
+"	}\n"
+"\n"
+"	if (!g_fail_further(f, 2 * g_offset(first) + 1, depth, sn)) {\n"
+"		return;\n"
+"	}\n"
+"\n"
+"	f->loc = first->loc;\n"
+"	f->end = false;\n"
+"	f->root = n->parent && !n->parent->parent;\n"
+"	f->type = n->type;\n"
+"	f->call = n->type < LOP_TYPE_LIST_LAST && n->list.call;\n"
+"	f->symbol[0] = 0;\n"
+"	if (n->type > LOP_TYPE_LIST_LAST && n->type != LOP_TYPE_NIL) {\n"
+"		snprintf(f->symbol, sizeof(f->symbol), \"%s\", n->symbol.value);\n"
+"	}\n"
+"}\n"
+"\n"
+"/* sn was expected after n, at the end of the list */\n"
+"static void g_fail_end(struct GContext *ctx, const struct GNode *sn, struct LOP_ASTNode *n, struct LOP_ASTNode *list)\n"
+"{\n"
+"	struct GFailure *f = &ctx->fail;\n"
+"	struct LOP_ASTNode *last = n;\n"
+"\n"
+"	for (struct LOP_ASTNode *i = n; i->type < LOP_TYPE_LIST_LAST && (i = i->list.tail);) {\n"
+"		if (g_offset(i) > g_offset(last)) {\n"
+"			last = i;\n"
+"		}\n"
+"	}\n"
+"\n"
+"	if (!g_fail_further(f, 2 * g_offset(last) + 2, 0, sn)) {\n"
+"		return;\n"
+"	}\n"
+"\n"
+"	f->loc = last->loc;\n"
+"	if (last->type == LOP_TYPE_ID || last->type == LOP_TYPE_NUMBER) {\n"
+"		f->loc.charno += strlen(last->symbol.value);\n"
+"	}\n"
+"	f->end = true;\n"
+"	f->root = !list->parent;\n"
+"}\n"
+"\n"
+"static struct GCont *g_cont(struct GContext *ctx)\n"
+"{\n"
+"	size_t block = ctx->cont_count / G_BLOCK;\n"
+"\n"
+"	if (block == ctx->cont_blocks) {\n"
+"		ctx->cont = realloc(ctx->cont, (block + 1) * sizeof(*ctx->cont));\n"
+"		assert(ctx->cont);\n"
+"		ctx->cont[block] = malloc(G_BLOCK * sizeof(**ctx->cont));\n"
+"		assert(ctx->cont[block]);\n"
+"		ctx->cont_blocks++;\n"
+"	}\n"
+"\n"
+"	return &ctx->cont[block][ctx->cont_count++ % G_BLOCK];\n"
+"}\n"
+"\n"
+"static void g_free(struct GContext *ctx)\n"
+"{\n"
+"	for (size_t i = 0; i < ctx->cont_blocks; i++) {\n"
+"		free(ctx->cont[i]);\n"
+"	}\n"
+"	free(ctx->cont);\n"
+"	free(ctx->choice);\n"
+"	free(ctx->node);\n"
+"}\n"
+"\n"
+"/* The GConts outlive the call, the choices and the items taken by g_items() refer to them.\n"
+" * A failed one leaves nothing which does */\n"
+"static bool g_try(struct GContext *ctx, const struct GNode *sn, struct LOP_ASTNode *ast, struct GCont *parent)\n"
+"{\n"
+"	size_t mark = ctx->cont_count;\n"
+"	const char *here = (const char *)&mark;\n"
+"	struct GCont *cec;\n"
+"\n"
+"	if (ctx->deep || (here < ctx->stack ? ctx->stack - here : here - ctx->stack) > G_MAX_STACK) {\n"
+"		ctx->deep = true;\n"
+"		return false;\n"
+"	}\n"
+"\n"
+"	cec = g_cont(ctx);\n"
+"	*cec = (struct GCont) { sn, parent };\n"
+"\n"
+"	if (!sn->match(ctx, ast, cec)) {\n"
+"		ctx->cont_count = mark;\n"
+"		return false;\n"
+"	}\n"
+"	return true;\n"
+"}\n"
+"\n"
+"static void g_push(struct GContext *ctx, struct GChoice c)\n"
+"{\n"
+"	if (ctx->choice_count == ctx->choice_capacity) {\n"
+"		ctx->choice_capacity = ctx->choice_capacity ? ctx->choice_capacity * 2 : 64;\n"
+"		ctx->choice = realloc(ctx->choice, ctx->choice_capacity * sizeof(*ctx->choice));\n"
+"		assert(ctx->choice);\n"
+"	}\n"
+"	c.hl_count = ctx->hl->count;\n"
+"	ctx->choice[ctx->choice_count++] = c;\n"
+"}\n"
+"\n"
+"/* g_try(), with c left to try if it fails, or if everything after it does */\n"
+"static bool g_try_or(struct GContext *ctx, const struct GNode *sn, struct LOP_ASTNode *ast, struct GCont *parent,\n"
+"		     struct GChoice c)\n"
+"{\n"
+"	int count = ctx->choice_count;\n"
+"\n"
+"	g_push(ctx, c);\n"
+"	if (g_try(ctx, sn, ast, parent)) {\n"
+"		return true;\n"
+"	}\n"
+"\n"
+"	ctx->choice_count = count;\n"
+"	return false;\n"
+"}\n"
+"\n"
+"/* #cut: the node of cec has matched */\n"
+"static void g_cut(struct GCont *cec)\n"
+"{\n"
+"	for (cec = cec->parent; cec; cec = cec->parent) {\n"
+"		if (cec->sn->sn_type == G_ONEOF || cec->sn->sn_type == G_LISTOF) {\n"
+"			cec->cut = true;\n"
+"			return;\n"
+"		}\n"
+"	}\n"
+"}\n"
+"\n"
+"static void g_close(struct GContext *ctx, struct GCont *cec)\n"
+"{\n"
+"	g_add(ctx, cec->sn, NULL, -1, 0);\n"
+"	if (cec->sn->cut) {\n"
+"		g_cut(cec);\n"
+"	}\n"
+"}\n"
+"\n"
+"/* \"Close\" SNs, until it's AST */\n"
+"static bool g_ast_up(struct GContext *ctx, struct LOP_ASTNode *ast, struct GCont *cec)\n"
+"{\n"
+"	for (struct GCont *cecp = cec->parent; cecp; cec = cecp, cecp = cecp->parent) {\n"
+"		if (cecp->sn->sn_type == G_SEQOF || cecp->sn->sn_type == G_AST) {\n"
+"			for (const struct GNode *sn = cec->sn->next; sn; sn = sn->next) {\n"
+"				if (!sn->optional) {\n"
+"					g_fail_end(ctx, sn, ast, ast->parent);\n"
+"					return false;\n"
+"				}\n"
+"			}\n"
+"		}\n"
+"\n"
+"		if (cecp->sn->sn_type == G_AST) {\n"
+"			break;\n"
+"		}\n"
+"\n"
+"		g_close(ctx, cecp);\n"
+"	}\n"
+"\n"
+"	return true;\n"
+"}\n"
+"\n"
+"static bool g_sibling(struct GContext *ctx, struct LOP_ASTNode *ast, struct GCont *cec, int hl_count);\n"
+"\n"
+"static bool g_resume_alt(struct GContext *ctx, const struct GChoice *c)\n"
+"{\n"
+"	return c->cec->sn->alt(ctx, c->ast, c->cec, c->from, c->cut);\n"
+"}\n"
+"\n"
+"/* The SNs of cec from sn on, at ast */\n"
+"static bool g_seq(struct GContext *ctx, struct LOP_ASTNode *ast, struct GCont *cec, const struct GNode *sn, int hl_count);\n"
+"\n"
+"static bool g_resume_seq(struct GContext *ctx, const struct GChoice *c)\n"
+"{\n"
+"	return g_seq(ctx, c->ast, c->cec, c->sn, c->hl_count);\n"
+"}\n"
+"\n"
+"/* The listof of cec ends before ast */\n"
+"static bool g_resume_end(struct GContext *ctx, const struct GChoice *c)\n"
+"{\n"
+"	g_close(ctx, c->cec);\n"
+"	return g_sibling(ctx, c->ast, c->cec, c->hl_count);\n"
+"}\n"
+"\n"
+"static bool g_seq(struct GContext *ctx, struct LOP_ASTNode *ast, struct GCont *cec, const struct GNode *sn, int hl_count)\n"
+"{\n"
+"	for (; sn; sn = sn->next) {\n"
+"		if (sn->optional && (sn->next || cec->sn->sn_type == G_SEQOF)) {\n"
+"			if (g_try_or(ctx, sn, ast, cec, (struct GChoice) { g_resume_seq, sn->next, ast, cec })) {\n"
+"				return true;\n"
+"			}\n"
+"		} else if (g_try(ctx, sn, ast, cec)) {\n"
+"			return true;\n"
+"		}\n"
+"		if (!sn->optional) {\n"
+"			goto mismatch;\n"
+"		}\n"
+"	}\n"
+"	if (cec->sn->sn_type == G_AST) {\n"
+"		g_fail_at(ctx, NULL, ast);\n"
+"		goto mismatch;\n"
+"	}\n"
+"\n"
+"	g_close(ctx, cec);\n"
+"	return g_sibling(ctx, ast, cec, hl_count);\n"
+"\n"
+"mismatch:\n"
+"	ctx->hl->count = hl_count;\n"
+"	return false;\n"
+"}\n"
+"\n"
+"/* Would the listof of cec fail if it ended before an item? That's left to try otherwise */\n"
+"static bool g_end_fails(const struct GCont *cec)\n"
+"{\n"
+"	const struct GCont *save = cec;\n"
+"\n"
+"	for (cec = cec->parent; cec && (cec->sn->sn_type == G_ONEOF || cec->sn->sn_type == G_REF); cec = cec->parent) {\n"
+"		save = cec;\n"
+"	}\n"
+"\n"
+"	return !cec || (cec->sn->sn_type == G_AST && !save->sn->next);\n"
+"}\n"
+"\n"
+"/* The item of the listof of cec at ast, or the end of the list before it */\n"
+"static bool g_item(struct GContext *ctx, struct LOP_ASTNode *ast, struct GCont *cec, int hl_count, bool end)\n"
+"{\n"
+"	int count = ctx->choice_count;\n"
+"\n"
+"	if (end) {\n"
+"		g_push(ctx, (struct GChoice) { g_resume_end, NULL, ast, cec });\n"
+"	}\n"
+"	if (cec->sn->alt(ctx, ast, cec, 0, false)) {\n"
+"		return true;\n"
+"	}\n"
+"	ctx->choice_count = count;\n"
+"\n"
+"	g_close(ctx, cec);\n"
+"	return g_sibling(ctx, ast, cec, hl_count);\n"
+"}\n"
+"\n"
+"/* The items of the listof of cec from ast on, first is the one it starts with. Every item which\n"
+" * has matched gets back here through ctx->bounce instead of trying the next one inside the\n"
+" * continuation, so the native stack doesn't grow with the list; what's left to try in the items\n"
+" * taken is on ctx->choice */\n"
+"static bool g_items(struct GContext *ctx, struct LOP_ASTNode *ast, struct GCont *cec, int hl_count, bool first)\n"
+"{\n"
+"	bool loop = cec->loop;\n"
+"	int stacked = cec->stacked;\n"
+"	size_t mark = ctx->cont_count;\n"
+"	int base = ctx->choice_count;\n"
+"	bool end = !g_end_fails(cec);\n"
+"	bool ok;\n"
+"\n"
+"	cec->loop = true;\n"
+"	cec->stacked = ctx->stacked;\n"
+"\n"
+"	ok = first ? cec->sn->alt(ctx, ast, cec, 0, false) : g_item(ctx, ast, cec, hl_count, end);\n"
+"	while (true) {\n"
+"		if (ok && ctx->bounce != cec) {\n"
+"			break;\n"
+"		}\n"
+"\n"
+"		if (ok) {\n"
+"			ast = ctx->bounce_ast;\n"
+"			ctx->bounce = NULL;\n"
+"			/* Nothing refers to the GConts of the items taken */\n"
+"			if (ctx->choice_count == base) {\n"
+"				ctx->cont_count = mark;\n"
+"			}\n"
+"			ok = g_item(ctx, ast, cec, hl_count, end);\n"
+"			continue;\n"
+"		}\n"
+"\n"
+"		/* Back into an item which is taken already */\n"
+"		if (ctx->choice_count == base) {\n"
+"			break;\n"
+"		}\n"
+"\n"
+"		struct GChoice c = ctx->choice[--ctx->choice_count];\n"
+"\n"
+"		ctx->hl->count = c.hl_count;\n"
+"		ok = c.resume(ctx, &c);\n"
+"	}\n"
+"\n"
+"	cec->loop = loop;\n"
+"	cec->stacked = stacked;\n"
+"	return ok;\n"
+"}\n"
+"\n"
+"/* ast follows the node of cec, go on with the SNs there */\n"
+"static bool g_sibling(struct GContext *ctx, struct LOP_ASTNode *ast, struct GCont *cec, int hl_count)\n"
+"{\n"
+"	struct GCont *save = cec;\n"
+"\n"
+"	cec = cec->parent;\n"
+"	while (cec && (cec->sn->sn_type == G_ONEOF || cec->sn->sn_type == G_REF)) {\n"
+"		g_close(ctx, cec);\n"
+"\n"
+"		save = cec;\n"
+"		cec = cec->parent;\n"
+"	}\n"
+"\n"
+"	if (!cec) {\n"
+"		g_fail_at(ctx, NULL, ast);\n"
+"		ctx->hl->count = hl_count;\n"
+"		return false;\n"
+"	}\n"
+"\n"
+"	switch (cec->sn->sn_type) {\n"
+"	case G_LISTOF:\n"
+"		if (cec->loop && ctx->stacked == cec->stacked) {\n"
+"			ctx->bounce = cec;\n"
+"			ctx->bounce_ast = ast;\n"
+"			return true;\n"
+"		}\n"
+"		return g_items(ctx, ast, cec, hl_count, false);\n"
+"	default:\n"
+"		return g_seq(ctx, ast, cec, save->sn->next, hl_count);\n"
+"	}\n"
+"}\n"
+"\n"
+"/* The node of cec has matched ast, go on with the next AST sibling */\n"
+"static bool g_next(struct GContext *ctx, struct LOP_ASTNode *ast, struct GCont *cec, int hl_count)\n"
+"{\n"
+"	if (ast->next) {\n"
+"		return g_sibling(ctx, ast->next, cec, hl_count);\n"
+"	}\n"
+"\n"
+"	if (!g_ast_up(ctx, ast, cec)) {\n"
+"		ctx->hl->count = hl_count;\n"
+"		return false;\n"
+"	}\n"
+"	return true;\n"
+"}\n"
+"\n"
+"/* The schema keywords, by the type and the call */\n"
+"static const char *const g_type[][2] = {\n"
+"	[LOP_TYPE_LIST_ROUND] = { \"list\", \"call\" },\n"
+"	[LOP_TYPE_LIST_CURLY] = { \"slist\", \"struct\" },\n"
+"	[LOP_TYPE_LIST_SQUARE] = { \"alist\", \"aref\" },\n"
+"	[LOP_TYPE_LIST_COLON] = { \"tlist\", \"tree\" },\n"
+"	[LOP_TYPE_LIST_STRING] = { \"fstring\", \"fstring\" },\n"
+"	[LOP_TYPE_LIST_OPERATOR_UNARY] = { \"unary\", \"unary\" },\n"
+"	[LOP_TYPE_LIST_OPERATOR_BINARY] = { \"binary\", \"binary\" },\n"
+"	[LOP_TYPE_OPERATOR] = { \"operator\", \"operator\" },\n"
+"	[LOP_TYPE_ID] = { \"identifier\", \"identifier\" },\n"
+"	[LOP_TYPE_NUMBER] = { \"number\", \"number\" },\n"
+"	[LOP_TYPE_STRING] = { \"string\", \"string\" },\n"
+"	[LOP_TYPE_NIL] = { \"nil\", \"nil\" },\n"
+"};\n"
+"\n"
+"/* Same as fail_describe() */\n"
+"static void g_describe(struct GFailure *f, char *buf, size_t size)\n"
+"{\n"
+"	const char *end = f->root ? \"end of file\" : \"end of list\";\n"
+"	bool eol = false;\n"
+"	int count = 0;\n"
+"	size_t len;\n"
+"\n"
+"	snprintf(buf, size, \"expected \");\n"
+"	for (int i = 0; i < f->count; i++) {\n"
+"		int j;\n"
+"\n"
+"		if (f->expected[i] == NULL) {\n"
+"			eol = true;\n"
+"			continue;\n"
+"		}\n"
+"\n"
+"		for (j = 0; j < i && (!f->expected[j] || strcmp(f->expected[j]->expect, f->expected[i]->expect)); j++) {\n"
+"		}\n"
+"		if (j < i) {\n"
+"			continue;\n"
+"		}\n"
+"\n"
+"		len = strlen(buf);\n"
+"		snprintf(buf + len, size - len, \"%s%s\", count ? \" or \" : \"\", f->expected[i]->expect);\n"
+"		count++;\n"
+"	}\n"
+"	if (eol) {\n"
+"		len = strlen(buf);\n"
+"		snprintf(buf + len, size - len, \"%s%s\", count ? \" or \" : \"\", end);\n"
+"	}\n"
+"\n"
+"	len = strlen(buf);\n"
+"	if (f->end) {\n"
+"		snprintf(buf + len, size - len, \", got %s\", end);\n"
+"	} else if (f->symbol[0]) {\n"
+"		snprintf(buf + len, size - len, \", got %s '%s'\", g_type[f->type][0], f->symbol);\n"
+"	} else {\n"
+"		snprintf(buf + len, size - len, \", got %s\", g_type[f->type][f->call]);\n"
+"	}\n"
+"}\n"
+"\n"
+"static void g_report(const char *filename, const char *string, size_t len, struct LOP_Location loc, const char *detail)\n"
+"{\n"
+"	fprintf(stderr, \"Syntax error in file '%s' at %i:%i%s%s\\n\", filename, loc.lineno, loc.charno + 1,\n"
+"		detail ? \": \" : \"\", detail ? detail : \"\");\n"
+"\n"
+"	for (size_t i = loc.line_offset; i < len && string[i] && string[i] != '\\n'; i++) {\n"
+"		fprintf(stderr, \"%c\", string[i]);\n"
+"	}\n"
+"	fprintf(stderr, \"\\n\");\n"
+"\n"
+"	for (size_t i = loc.line_offset; i < len && (i - loc.line_offset < loc.charno); i++) {\n"
+"		fprintf(stderr, \"%c\", isspace(string[i]) ? string[i] : ' ');\n"
+"	}\n"
+"	fprintf(stderr, \"^\\n\");\n"
+"}\n"
+"\n";
+
+/* A seqof item with optional children, see gen_seq() */
+static const char gen_stacked_runtime[] =
+"/* g_try(), with the alternative which is left on the native stack */\n"
+"static bool g_try_stacked(struct GContext *ctx, const struct GNode *sn, struct LOP_ASTNode *ast, struct GCont *parent)\n"
+"{\n"
+"	bool ok;\n"
+"\n"
+"	ctx->stacked++;\n"
+"	ok = g_try(ctx, sn, ast, parent);\n"
+"	ctx->stacked--;\n"
+"\n"
+"	return ok;\n"
+"}\n"
+"\n";
+
+/* #set lookup, the tables are built by set_build() and emitted by gen_set(). Mirrors SymbolSet.c */
+static const char gen_set_runtime[] =
+"struct GSet {\n"
+"	const char *const *value;\n"
+"	const uint32_t *disp;\n"
+"	uint32_t bucket_mask;\n"
+"	const uint32_t *slot;\n"
+"	uint32_t mask;\n"
+"};\n"
+"\n"
+"static uint64_t g_set_hash(const char *str)\n"
+"{\n"
+"	uint64_t hash = 0xcbf29ce484222325ULL;\n"
+"\n"
+"	for (; *str; str++) {\n"
+"		hash ^= (unsigned char)*str;\n"
+"		hash *= 0x100000001b3ULL;\n"
+"	}\n"
+"\n"
+"	return hash;\n"
+"}\n"
+"\n"
+"static uint32_t g_set_mix(uint64_t hash, uint32_t disp)\n"
+"{\n"
+"	hash ^= disp * 0x9e3779b97f4a7c15ULL;\n"
+"	hash ^= hash >> 33;\n"
+"	hash *= 0xff51afd7ed558ccdULL;\n"
+"	hash ^= hash >> 33;\n"
+"\n"
+"	return hash;\n"
+"}\n"
+"\n"
+"static int g_set_find(const struct GSet *set, const char *str)\n"
+"{\n"
+"	uint64_t hash = g_set_hash(str);\n"
+"	uint32_t i = set->slot[g_set_mix(hash, set->disp[g_set_mix(hash, 0) & set->bucket_mask]) & set->mask];\n"
+"\n"
+"	if (i == 0 || strcmp(set->value[i - 1], str)) {\n"
+"		return -1;\n"
+"	}\n"
+"	return i - 1;\n"
+"}\n"
+"\n";
+
+/* #pattern DFA run, the tables are compiled by pattern_compile() and emitted by gen_pattern(). Mirrors Pattern.c */
+static const char gen_pattern_runtime[] =
+"struct GPattern {\n"
+"	const uint8_t *class;\n"
+"	int classes;\n"
+"	const uint16_t *next;\n"
+"	const bool *accept;\n"
+"};\n"
+"\n"
+"static bool g_pattern_match(const struct GPattern *p, const char *str)\n"
+"{\n"
+"	uint32_t s = 1;\n"
+"\n"
+"	for (; *str && s; str++) {\n"
+"		s = p->next[s * p->classes + p->class[(unsigned char)*str]];\n"
+"	}\n"
+"\n"
+"	return p->accept[s];\n"
+"}\n"
+"\n";
+
+static void gen_u32_array(struct GenContext *g, const uint32_t *data, uint32_t count)
+{
+	fprintf(g->out, "(const uint32_t[]){");
+	for (uint32_t i = 0; i < count; i++) {
+		fprintf(g->out, "%s%u,", i % 16 ? " " : "\n\t\t", data[i]);
+	}
+	fprintf(g->out, "\n\t}");
+}
+
+/* The lookup tables of a #set SN, as built for the interpreter */
+static void gen_set(struct GenContext *g, struct SchemaNode *sn)
+{
+	struct SymbolSet *set = sn->symbol.members;
+
+	fprintf(g->out, "static const struct GSet set_%i = {\n", gen_id(g, sn));
+	fprintf(g->out, "\t(const char *const[]){");
+	for (int i = 0; i < set->count; i++) {
+		fprintf(g->out, "\n\t\t");
+		gen_string(g, set->value[i]);
+		fprintf(g->out, ",");
+	}
+	fprintf(g->out, "\n\t},\n\t");
+	gen_u32_array(g, set->disp, set->bucket_mask + 1);
+	fprintf(g->out, ",\n\t%u,\n\t", set->bucket_mask);
+	gen_u32_array(g, set->slot, set->mask + 1);
+	fprintf(g->out, ",\n\t%u,\n", set->mask);
+	fprintf(g->out, "};\n\n");
+}
+
+/* The DFA of a #pattern SN, as compiled for the interpreter */
+static void gen_pattern(struct GenContext *g, struct SchemaNode *sn)
+{
+	struct Pattern *p = sn->symbol.dfa;
+
+	fprintf(g->out, "/* ");
+	/* The pattern may hold the end of the comment */
+	for (const char *c = sn->symbol.value; *c; c++) {
+		fprintf(g->out, c[0] == '*' && c[1] == '/' ? "*\\" : "%c", *c);
+	}
+	fprintf(g->out, " */\n");
+	fprintf(g->out, "static const struct GPattern pattern_%i = {\n", gen_id(g, sn));
+	fprintf(g->out, "\t(const uint8_t[]){");
+	for (int i = 0; i < 256; i++) {
+		fprintf(g->out, "%s%u,", i % 16 ? " " : "\n\t\t", p->class[i]);
+	}
+	fprintf(g->out, "\n\t},\n\t%i,\n", p->classes);
+	fprintf(g->out, "\t(const uint16_t[]){");
+	for (int i = 0; i < p->count * p->classes; i++) {
+		fprintf(g->out, "%s%u,", i % p->classes ? " " : "\n\t\t", p->next[i]);
+	}
+	fprintf(g->out, "\n\t},\n");
+	fprintf(g->out, "\t(const bool[]){");
+	for (int i = 0; i < p->count; i++) {
+		fprintf(g->out, "%s%i,", i % 16 ? " " : "\n\t\t", p->accept[i]);
+	}
+	fprintf(g->out, "\n\t},\n");
+	fprintf(g->out, "};\n\n");
+}
+
+/* Can the alternative be skipped for the given AST node type without trying it?
+ * Only for AST nodes, everything else must be entered to keep the same side effects. */
+static bool gen_alt_type_mismatch(struct SchemaNode *sn, enum LOP_ASTNodeType type)
+{
+	return sn->sn_type == SN_TYPE_AST && sn->type != type;
+}
+
+/* Does c still take a node of the type after alternative i of sn has? Otherwise nothing is left to try after it */
+static bool gen_alt_live(struct SchemaNode *sn, int i, struct SchemaNode *c, enum LOP_ASTNodeType type)
+{
+	struct SchemaNode *taken = sn->child[i];
+
+	if (gen_alt_type_mismatch(c, type)) {
+		return false;
+	}
+	/* Both want a symbol of their own */
+	return !(type > LOP_TYPE_LIST_LAST && taken->sn_type == SN_TYPE_AST && c->sn_type == SN_TYPE_AST &&
+		 taken->symbol.value && c->symbol.value && !taken->set && !taken->pattern && !c->set && !c->pattern &&
+		 strcmp(taken->symbol.value, c->symbol.value));
+}
+
+/* Some alternative after the one taken is left to try */
+static bool gen_alt_left(struct SchemaNode *sn, int i, enum LOP_ASTNodeType type)
+{
+	for (int j = i + 1; j < sn->child_count; j++) {
+		if (gen_alt_live(sn, i, sn->child[j], type)) {
+			return true;
+		}
+	}
+	return false;
+}
+
+static void gen_alt_try(struct GenContext *g, struct SchemaNode *sn, int i, enum LOP_ASTNodeType type, const char *indent)
+{
+	int id = gen_id(g, sn->child[i]);
+
+	if (gen_alt_left(sn, i, type)) {
+		fprintf(g->out, "%sif (g_try_or(ctx, &N[%i], ast, parent, (struct GChoice) { g_resume_alt, NULL, ast, parent, %i, cut })) {\n",
+			indent, id, i + 1);
+	} else {
+		fprintf(g->out, "%sif (g_try(ctx, &N[%i], ast, parent)) {\n", indent, id);
+	}
+	fprintf(g->out, "%s\treturn true;\n", indent);
+	fprintf(g->out, "%s}\n", indent);
+	if (g->cut) {
+		fprintf(g->out, "%sif (parent->cut) {\n", indent);
+		fprintf(g->out, "%s\tgoto out;\n", indent);
+		fprintf(g->out, "%s}\n", indent);
+	}
+}
+
+/* Skipped alternative has failed, as it would have in check_entry() */
+static void gen_alt_fail(struct GenContext *g, struct SchemaNode *sn, const char *indent)
+{
+	fprintf(g->out, "%sg_fail_at(ctx, &N[%i], ast);\n", indent, gen_id(g, sn));
+}
+
+/* Skipped alternative still marks the AST node, as check_entry() would do */
+static void gen_alt_skip(struct GenContext *g, struct SchemaNode *sn, const char *indent)
+{
+	fprintf(g->out, "%sctx->node[ast->id].sn = &N[%i];\n", indent, gen_id(g, sn));
+}
+
+/* The alternatives of sn for an AST node of the type. An alternative resumed from g_items()
+ * starts past the ones before it, which have run already */
+static void gen_alt_case(struct GenContext *g, struct SchemaNode *sn, enum LOP_ASTNodeType type, const char *indent)
+{
+	char inner[16];
+	char nested[24];
+	int resumed = -1;
+
+	snprintf(inner, sizeof(inner), "%s\t", indent);
+
+	/* The last one which leaves a choice, the ones up to it are skipped once it's resumed */
+	for (int i = 0; i < sn->child_count; i++) {
+		if (!gen_alt_type_mismatch(sn->child[i], type) && gen_alt_left(sn, i, type)) {
+			resumed = i;
+		}
+	}
+
+	for (int i = 0; i < sn->child_count; i++) {
+		struct SchemaNode *c = sn->child[i];
+		const char *in = i <= resumed ? inner : indent;
+
+		snprintf(nested, sizeof(nested), "%s\t", in);
+
+		if (i == 0 && resumed >= 0) {
+			fprintf(g->out, "%sif (from == 0) {\n", indent);
+		} else if (i <= resumed) {
+			fprintf(g->out, "%sif (from <= %i) {\n", indent, i);
+		}
+
+		if (gen_alt_type_mismatch(c, type)) {
+			gen_alt_fail(g, c, in);
+			/* Only the last of the skipped run is visible for the next alternative */
+			if (i + 1 == sn->child_count || !gen_alt_type_mismatch(sn->child[i + 1], type)) {
+				gen_alt_skip(g, c, in);
+			}
+		} else if (c->sn_type == SN_TYPE_AST && type > LOP_TYPE_LIST_LAST && c->symbol.value && !c->set && !c->pattern) {
+			fprintf(g->out, "%sif (!strcmp(ast->symbol.value, ", in);
+			gen_string(g, c->symbol.value);
+			fprintf(g->out, ")) {\n");
+			gen_alt_try(g, sn, i, type, nested);
+			fprintf(g->out, "%s} else {\n", in);
+			gen_alt_fail(g, c, nested);
+			gen_alt_skip(g, c, nested);
+			fprintf(g->out, "%s}\n", in);
+		} else {
+			gen_alt_try(g, sn, i, type, in);
+		}
+
+		if (in == inner) {
+			fprintf(g->out, "%s}\n", indent);
+		}
+	}
+}
+
+static void gen_alt(struct GenContext *g, struct SchemaNode *sn)
+{
+	static const enum LOP_ASTNodeType types[] = {
+		LOP_TYPE_LIST_ROUND, LOP_TYPE_LIST_CURLY, LOP_TYPE_LIST_SQUARE, LOP_TYPE_LIST_COLON,
+		LOP_TYPE_LIST_STRING, LOP_TYPE_LIST_OPERATOR_UNARY, LOP_TYPE_LIST_OPERATOR_BINARY,
+		LOP_TYPE_OPERATOR, LOP_TYPE_ID, LOP_TYPE_NUMBER, LOP_TYPE_STRING, LOP_TYPE_NIL,
+	};
+	int id = gen_id(g, sn);
+	bool typed = false;
+
+	for (int i = 0; i < sn->child_count; i++) {
+		typed |= sn->child[i]->sn_type == SN_TYPE_AST;
+	}
+
+	fprintf(g->out, "static bool alt_%i(struct GContext *ctx, struct LOP_ASTNode *ast, struct GCont *parent, int from, bool cut)\n", id);
+	fprintf(g->out, "{\n");
+	if (g->cut && sn->child_count) {
+		/* The cut of the parent before the first alternative, a resumed one has it from the choice
+		 * and stops if the alternative before it has cut */
+		fprintf(g->out, "\tif (from == 0) {\n");
+		fprintf(g->out, "\t\tcut = parent->cut;\n");
+		fprintf(g->out, "\t\tparent->cut = false;\n");
+		fprintf(g->out, "\t} else if (parent->cut) {\n");
+		fprintf(g->out, "\t\tgoto out;\n");
+		fprintf(g->out, "\t}\n");
+	}
+
+	/* Only AST alternatives are told apart by the type */
+	if (!typed) {
+		gen_alt_case(g, sn, LOP_TYPE_LIST_LAST, "\t");
+	} else {
+		fprintf(g->out, "\tswitch (ast->type) {\n");
+		for (int t = 0; t < sizeof(types) / sizeof(*types); t++) {
+			fprintf(g->out, "\tcase %s:\n", gen_type_name(types[t]));
+			gen_alt_case(g, sn, types[t], "\t\t");
+			fprintf(g->out, "\t\tbreak;\n");
+		}
+		fprintf(g->out, "\tdefault:\n");
+		fprintf(g->out, "\t\tassert(0);\n");
+		fprintf(g->out, "\t}\n");
+	}
+
+	if (g->cut && sn->child_count) {
+		fprintf(g->out, "out:\n");
+		fprintf(g->out, "\tparent->cut = cut;\n");
+	}
+	fprintf(g->out, "\treturn false;\n");
+	fprintf(g->out, "}\n\n");
+}
+
+/* Straight-line sequence of children at ast: the first one which takes the rest wins,
+ * non-optional one which fails is the mismatch. For the list content, ast is its head */
+static void gen_seq(struct GenContext *g, struct SchemaNode *sn, const char *ast, const char *done)
+{
+	for (int i = 0; i < sn->child_count; i++) {
+		struct SchemaNode *c = sn->child[i];
+
+		fprintf(g->out, "\tif (%s && %s(ctx, &N[%i], %s, cec)) {\n", ast, gen_stacked(sn, i) ? "g_try_stacked" : "g_try",
+			gen_id(g, c), ast);
+		fprintf(g->out, "\t\t%s;\n", done);
+		fprintf(g->out, "\t}\n");
+		if (!c->optional) {
+			if (sn->sn_type == SN_TYPE_AST) {
+				fprintf(g->out, "\tif (!%s) {\n", ast);
+				fprintf(g->out, "\t\tg_fail_end(ctx, &N[%i], ast, ast);\n", gen_id(g, c));
+				fprintf(g->out, "\t}\n");
+			}
+			fprintf(g->out, "\tgoto mismatch;\n");
+			return;
+		}
+	}
+}
+
+static void gen_add(struct GenContext *g, struct SchemaNode *sn, const char *n, int delta, const char *member)
+{
+	if (!sn->cb_count) {
+		return;
+	}
+
+	fprintf(g->out, "\tg_add(ctx, &N[%i], %s, %i, %s);\n", gen_id(g, sn), n, delta, member);
+}
+
+static void gen_match(struct GenContext *g, struct SchemaNode *sn)
+{
+	int id = gen_id(g, sn);
+
+	fprintf(g->out, "static bool m_%i(struct GContext *ctx, struct LOP_ASTNode *ast, struct GCont *cec)\n", id);
+	fprintf(g->out, "{\n");
+	fprintf(g->out, "\tint hl_count = ctx->hl->count;\n");
+	if (sn->set) {
+		fprintf(g->out, "\tint member;\n");
+	}
+	if (sn->sn_type == SN_TYPE_AST && sn->type < LOP_TYPE_LIST_LAST && !sn->lazy && sn->child_count) {
+		fprintf(g->out, "\tsize_t mark = ctx->cont_count;\n");
+		fprintf(g->out, "\tint choices = ctx->choice_count;\n");
+	}
+	fprintf(g->out, "\n");
+	fprintf(g->out, "\tif (!g_enter(ctx, ast, &N[%i])) {\n", id);
+	fprintf(g->out, "\t\treturn false;\n");
+	fprintf(g->out, "\t}\n");
+	fprintf(g->out, "\n");
+
+	switch (sn->sn_type) {
+	case SN_TYPE_ONEOF:
+		gen_add(g, sn, "ast", 1, "0");
+		fprintf(g->out, "\tif (alt_%i(ctx, ast, cec, 0, false)) {\n", id);
+		fprintf(g->out, "\t\treturn true;\n");
+		fprintf(g->out, "\t}\n");
+		fprintf(g->out, "\tgoto mismatch;\n");
+		break;
+	case SN_TYPE_LISTOF:
+		gen_add(g, sn, "ast", 1, "0");
+		fprintf(g->out, "\tif (g_items(ctx, ast, cec, hl_count, true)) {\n");
+		fprintf(g->out, "\t\treturn true;\n");
+		fprintf(g->out, "\t}\n");
+		fprintf(g->out, "\tgoto mismatch;\n");
+		break;
+	case SN_TYPE_SEQOF:
+		gen_add(g, sn, "ast", 1, "0");
+		gen_seq(g, sn, "ast", "return true");
+		fprintf(g->out, "\tgoto mismatch;\n");
+		break;
+	case SN_TYPE_REF:
+		gen_add(g, sn, "ast", 1, "0");
+		fprintf(g->out, "\tif (g_try(ctx, &N[%i], ast, cec)) {\n", gen_id(g, gen_ref(g, sn)));
+		fprintf(g->out, "\t\treturn true;\n");
+		fprintf(g->out, "\t}\n");
+		fprintf(g->out, "\tgoto mismatch;\n");
+		break;
+	case SN_TYPE_AST:
+		fprintf(g->out, "\tif (ast->type != %s", gen_type_name(sn->type));
+		if (sn->type < LOP_TYPE_LIST_LAST) {
+			fprintf(g->out, " || ast->list.call != %i", sn->list.call);
+		} else if (sn->set) {
+			fprintf(g->out, " || (member = g_set_find(&set_%i, ast->symbol.value)) < 0", id);
+		} else if (sn->pattern) {
+			fprintf(g->out, " || !g_pattern_match(&pattern_%i, ast->symbol.value)", id);
+		} else if (sn->symbol.value) {
+			fprintf(g->out, " || strcmp(ast->symbol.value, ");
+			gen_string(g, sn->symbol.value);
+			fprintf(g->out, ")");
+		}
+		fprintf(g->out, ") {\n");
+		fprintf(g->out, "\t\tg_fail_at(ctx, &N[%i], ast);\n", id);
+		fprintf(g->out, "\t\tgoto mismatch;\n");
+		fprintf(g->out, "\t}\n");
+
+		if (sn->type < LOP_TYPE_LIST_LAST && sn->lazy) {
+			char id_str[16];
+
+			/* LOP_force() with the schema finds the SN by its number */
+			snprintf(id_str, sizeof(id_str), "%i", sn->id);
+			gen_add(g, sn, "ast", 0, id_str);
+		} else if (sn->type < LOP_TYPE_LIST_LAST) {
+			gen_add(g, sn, "ast", 1, "0");
+			gen_seq(g, sn, "ast->list.head", "goto matched");
+			/* Every child is optional and none of them took the elements */
+			fprintf(g->out, "\tif (ast->list.head) {\n");
+			fprintf(g->out, "\t\tg_fail_at(ctx, NULL, ast->list.head);\n");
+			fprintf(g->out, "\t\tgoto mismatch;\n");
+			fprintf(g->out, "\t}\n");
+			if (sn->child_count) {
+				fprintf(g->out, "matched:\n");
+				/* The content is taken, nothing in it is tried again */
+				fprintf(g->out, "\tctx->choice_count = choices;\n");
+				fprintf(g->out, "\tctx->cont_count = mark;\n");
+			}
+			gen_add(g, sn, "NULL", -1, "0");
+		} else {
+			gen_add(g, sn, "ast", 0, sn->set ? "member" : "0");
+		}
+
+		if (sn->cut) {
+			fprintf(g->out, "\tg_cut(cec);\n");
+		}
+		fprintf(g->out, "\tif (g_next(ctx, ast, cec, hl_count)) {\n");
+		fprintf(g->out, "\t\treturn true;\n");
+		fprintf(g->out, "\t}\n");
+		break;
+	}
+
+	fprintf(g->out, "\n");
+	fprintf(g->out, "mismatch:\n");
+	fprintf(g->out, "\tctx->hl->count = hl_count;\n");
+	fprintf(g->out, "\treturn false;\n");
+	fprintf(g->out, "}\n\n");
+}
+
+static void gen_node(struct GenContext *g, struct SchemaNode *sn)
+{
+	int id = gen_id(g, sn);
+	char expect[128] = "";
+
+	sn_describe(sn, g->kv, expect, sizeof(expect));
+
+	fprintf(g->out, "\t[%i] = { %s, %s, %s, ", id, gen_sn_type_name(sn->sn_type), sn->optional ? "true" : "false",
+		sn->cut ? "true" : "false");
+	gen_string(g, expect);
+	fprintf(g->out, ", ");
+	if (sn->cb_count) {
+		fprintf(g->out, "(const int[]){ ");
+		for (int i = 0; i < sn->cb_count; i++) {
+			fprintf(g->out, "%i, ", sn->cb[i]);
+		}
+		fprintf(g->out, "}, %i", sn->cb_count);
+	} else {
+		fprintf(g->out, "NULL, 0");
+	}
+	if (sn->next) {
+		fprintf(g->out, ", &N[%i]", gen_id(g, sn->next));
+	} else {
+		fprintf(g->out, ", NULL");
+	}
+	fprintf(g->out, ", m_%i", id);
+	if (sn->sn_type == SN_TYPE_ONEOF || sn->sn_type == SN_TYPE_LISTOF) {
+		fprintf(g->out, ", alt_%i", id);
+	} else {
+		fprintf(g->out, ", NULL");
+	}
+	fprintf(g->out, " },\n");
+}
+
+int LOP_schema_gen(struct LOP_Schema *schema, FILE *out, const char *prefix)
+{
+	struct GenContext g = {
+		.out = out,
+		.prefix = prefix,
+		.kv = schema->kv,
+	};
+	struct LOP_OperatorTable *ot = &schema->operator_table;
+	struct LOP_CallbackTable *ct = &schema->callback_table;
+
+	for (int i = 0; i < g.kv->count; i++) {
+		gen_collect(&g, g.kv->children[i].value);
+	}
+
+	fprintf(out, "/* Generated by lop-gen from '%s', do not edit */\n\n", schema->filename);
+	fputs(gen_runtime, out);
+	if (g.stacked) {
+		fputs(gen_stacked_runtime, out);
+	}
+	if (g.set) {
+		fputs(gen_set_runtime, out);
+	}
+	if (g.pattern) {
+		fputs(gen_pattern_runtime, out);
+	}
+
+	fprintf(out, "static const struct GNode N[%i];\n\n", g.count ? g.count : 1);
+
+	for (int i = 0; i < g.count; i++) {
+		fprintf(out, "static bool m_%i(struct GContext *ctx, struct LOP_ASTNode *ast, struct GCont *cec);\n", i);
+	}
+	fprintf(out, "\n");
+
+	for (int i = 0; i < g.count; i++) {
+		if (g.node[i]->set) {
+			gen_set(&g, g.node[i]);
+		}
+		if (g.node[i]->pattern) {
+			gen_pattern(&g, g.node[i]);
+		}
+	}
+
+	for (int i = 0; i < g.count; i++) {
+		if (g.node[i]->sn_type == SN_TYPE_ONEOF || g.node[i]->sn_type == SN_TYPE_LISTOF) {
+			gen_alt(&g, g.node[i]);
+		}
+	}
+
+	for (int i = 0; i < g.count; i++) {
+		gen_match(&g, g.node[i]);
+	}
+
+	fprintf(out, "static const struct GNode N[%i] = {\n", g.count ? g.count : 1);
+	for (int i = 0; i < g.count; i++) {
+		gen_node(&g, g.node[i]);
+	}
+	fprintf(out, "};\n\n");
+
+	fprintf(out, "static struct LOP_Operator %s_operator[%i] = {\n", prefix, ot->size ? ot->size : 1);
+	for (int i = 0; i < ot->size; i++) {
+		fprintf(out, "\t{ ");
+		gen_string(&g, ot->data[i].value);
+		fprintf(out, ", %i, %u },\n", ot->data[i].prio, ot->data[i].type);
+	}
+	fprintf(out, "};\n\n");
+
+	fprintf(out, "struct LOP_OperatorTable %s_operator_table = { %s_operator, %i };\n\n", prefix, prefix, ot->size);
+
+	fprintf(out, "static struct LOP_Callback %s_callback[%i] = {\n", prefix, ct->size ? ct->size : 1);
+	for (int i = 0; i < ct->size; i++) {
+		fprintf(out, "\t{ ");
+		gen_string(&g, ct->data[i].name);
+		fprintf(out, ", NULL },\n");
+	}
+	fprintf(out, "};\n\n");
+
+	fprintf(out, "struct LOP_CallbackTable %s_callback_table = { %s_callback, %i };\n\n", prefix, prefix, ct->size);
+
+	fprintf(out, "static const struct {\n");
+	fprintf(out, "\tconst char *name;\n");
+	fprintf(out, "\tconst struct GNode *sn;\n");
+	fprintf(out, "} rule[] = {\n");
+	for (int i = 0; i < g.kv->count; i++) {
+		fprintf(out, "\t{ ");
+		gen_string(&g, g.kv->children[i].key);
+		fprintf(out, ", &N[%i] },\n", gen_id(&g, g.kv->children[i].value));
+	}
+	fprintf(out, "\t{ NULL, NULL },\n");
+	fprintf(out, "};\n\n");
+
+	fprintf(out,
+		"/* Same as LOP_init(), lop->schema is not used */\n"
+		"int %s_init(struct LOP *lop, const char *src, size_t len)\n"
+		"{\n"
+		"	struct GContext ctx = {\n"
+		"		.ct = &%s_callback_table,\n"
+		"		.hl = &lop->hl,\n"
+		"		.stack = (const char *)&ctx,\n"
+		"	};\n"
+		"	/* Only the operators of the schema are needed to parse */\n"
+		"	struct LOP_Schema schema = {\n"
+		"		.operator_table = %s_operator_table,\n"
+		"	};\n"
+		"	struct LOP_AST ast = {\n"
+		"		.schema = &schema,\n"
+		"		.filename = lop->filename,\n"
+		"		.limits = lop->limits,\n"
+		"	};\n"
+		"	const struct GNode *sn = NULL;\n"
+		"	int rc;\n"
+		"\n"
+		"	for (int i = 0; rule[i].name; i++) {\n"
+		"		if (!strcmp(rule[i].name, lop->top_rule_name)) {\n"
+		"			sn = rule[i].sn;\n"
+		"			break;\n"
+		"		}\n"
+		"	}\n"
+		"	if (sn == NULL) {\n"
+		"		fprintf(stderr, \"Top rule '%%s' not found\\n\", lop->top_rule_name);\n"
+		"		return LOP_ERROR_SCHEMA_MISSING_TOP;\n"
+		"	}\n"
+		"\n"
+		"	rc = LOP_parse(&ast, src, len);\n"
+		"	if (rc < 0) {\n"
+		"		lop->error = ast.error;\n"
+		"		return rc;\n"
+		"	}\n"
+		"\n"
+		"	ctx.node = calloc(ast.node_count, sizeof(*ctx.node));\n"
+		"	assert(ctx.node);\n"
+		"\n"
+		"	g_begin(lop, ctx.ct);\n"
+		"	if (g_try(&ctx, sn, ast.root, NULL)) {\n"
+		"		lop->ast = ast.root;\n"
+		"		LOP_handler_link(&lop->hl);\n"
+		"		g_free(&ctx);\n"
+		"		return 0;\n"
+		"	}\n"
+		"	if (ctx.deep) {\n"
+		"		fprintf(stderr, \"Lists nested too deep in file '%%s' for the generated matcher\\n\", lop->filename);\n"
+		"		g_free(&ctx);\n"
+		"		LOP_parse_deinit(&ast);\n"
+		"		return LOP_ERROR_LEXER_DEPTH;\n"
+		"	}\n"
+		"\n"
+		"	char detail[512];\n"
+		"\n"
+		"	if (ctx.fail.pos == 0) {\n"
+		"		g_fail_at(&ctx, NULL, ast.root);\n"
+		"		ctx.fail.count = 0;\n"
+		"	}\n"
+		"	g_describe(&ctx.fail, detail, sizeof(detail));\n"
+		"	g_report(lop->filename, src, len, ctx.fail.loc, ctx.fail.count ? detail : NULL);\n"
+		"	lop->error = ctx.fail.loc;\n"
+		"\n"
+		"	g_free(&ctx);\n"
+		"	LOP_parse_deinit(&ast);\n"
+		"	return LOP_ERROR_SCHEMA_SYNTAX;\n"
+		"}\n",
+		prefix, prefix, prefix);
+
+	free(g.node);
+	return 0;
+}
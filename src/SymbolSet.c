@@ -0,0 +1,240 @@
+/* #set: the values a symbol SN takes, found by a perfect hash built with the schema.
+ *
+ * The values are split into buckets by a hash of the string, and the buckets, the largest
+ * first, get a displacement each which sends all of their values to free slots of a table
+ * twice as large as the set (hash and displace). A lookup is one pass over the string,
+ * two slots and a strcmp(), whatever the size of the set. SchemaGen.c emits the same lookup. */
+
+struct SymbolSet {
+	/* In the schema order, LOP_Handler.member is the index */
+	char **value;
+	int count;
+	/* By bucket */
+	uint32_t *disp;
+	uint32_t bucket_mask;
+	/* Index in value + 1, 0 is free */
+	uint32_t *slot;
+	uint32_t mask;
+};
+
+/* FNV-1a */
+static uint64_t set_hash(const char *str)
+{
+	uint64_t hash = 0xcbf29ce484222325ULL;
+
+	for (; *str; str++) {
+		hash ^= (unsigned char)*str;
+		hash *= 0x100000001b3ULL;
+	}
+
+	return hash;
+}
+
+/* Displacement 0 gives the bucket */
+static uint32_t set_mix(uint64_t hash, uint32_t disp)
+{
+	hash ^= disp * 0x9e3779b97f4a7c15ULL;
+	hash ^= hash >> 33;
+	hash *= 0xff51afd7ed558ccdULL;
+	hash ^= hash >> 33;
+
+	return hash;
+}
+
+/* The member str is, -1 if none */
+static int set_find(const struct SymbolSet *set, const char *str)
+{
+	uint64_t hash = set_hash(str);
+	uint32_t i = set->slot[set_mix(hash, set->disp[set_mix(hash, 0) & set->bucket_mask]) & set->mask];
+
+	if (i == 0 || strcmp(set->value[i - 1], str)) {
+		return -1;
+	}
+	return i - 1;
+}
+
+static void set_add(struct SymbolSet *set, char *value)
+{
+	set->count++;
+	set->value = realloc(set->value, set->count * sizeof(*set->value));
+	assert(set->value);
+
+	set->value[set->count - 1] = value;
+}
+
+static int set_cmp(const void *a, const void *b)
+{
+	char *const *x = *(char *const *const *)a;
+	char *const *y = *(char *const *const *)b;
+	int rc = strcmp(*x, *y);
+
+	if (rc) {
+		return rc;
+	}
+	return x < y ? -1 : x > y;
+}
+
+/* A repeated value is left to the first of them */
+static bool *set_repeated(struct SymbolSet *set)
+{
+	char ***sorted = calloc(set->count, sizeof(*sorted));
+	bool *repeated = calloc(set->count, sizeof(*repeated));
+
+	assert(sorted && repeated);
+
+	for (int i = 0; i < set->count; i++) {
+		sorted[i] = &set->value[i];
+	}
+	qsort(sorted, set->count, sizeof(*sorted), set_cmp);
+
+	for (int i = 1; i < set->count; i++) {
+		if (!strcmp(*sorted[i], *sorted[i - 1])) {
+			repeated[sorted[i] - set->value] = true;
+		}
+	}
+
+	free(sorted);
+	return repeated;
+}
+
+struct SetBucket {
+	int size;
+	/* Where its values start in the order of set_place() */
+	int first;
+};
+
+static int set_bucket_cmp(const void *a, const void *b)
+{
+	const struct SetBucket *x = a;
+	const struct SetBucket *y = b;
+
+	if (x->size != y->size) {
+		return y->size - x->size;
+	}
+	return x->first - y->first;
+}
+
+#define SET_DISP_TRIES (1 << 16)
+
+/* Fills the table of size slots, false if some bucket found no displacement */
+static bool set_place(struct SymbolSet *set, const uint64_t *hash, const bool *repeated, uint32_t size)
+{
+	uint32_t buckets = set->bucket_mask + 1;
+	struct SetBucket *bucket = calloc(buckets + 1, sizeof(*bucket));
+	int *order = calloc(set->count, sizeof(*order));
+	uint32_t *taken = calloc(set->count, sizeof(*taken));
+	bool placed = true;
+
+	assert(bucket && order && taken);
+
+	set->mask = size - 1;
+	set->slot = calloc(size, sizeof(*set->slot));
+	set->disp = calloc(buckets, sizeof(*set->disp));
+	assert(set->slot && set->disp);
+
+	/* The values grouped by bucket */
+	for (int i = 0; i < set->count; i++) {
+		if (!repeated[i]) {
+			bucket[set_mix(hash[i], 0) & set->bucket_mask].size++;
+		}
+	}
+	for (uint32_t b = 0, first = 0; b < buckets; b++) {
+		bucket[b].first = first;
+		first += bucket[b].size;
+		bucket[b].size = 0;
+	}
+	for (int i = 0; i < set->count; i++) {
+		if (!repeated[i]) {
+			struct SetBucket *bk = &bucket[set_mix(hash[i], 0) & set->bucket_mask];
+
+			order[bk->first + bk->size++] = i;
+		}
+	}
+
+	/* The sorted bucket is told by the bucket of its first value */
+	qsort(bucket, buckets, sizeof(*bucket), set_bucket_cmp);
+
+	for (uint32_t b = 0; b < buckets && bucket[b].size && placed; b++) {
+		const int *value = &order[bucket[b].first];
+		uint32_t home = set_mix(hash[value[0]], 0) & set->bucket_mask;
+		uint32_t disp;
+
+		for (disp = 1; disp < SET_DISP_TRIES; disp++) {
+			int k;
+
+			for (k = 0; k < bucket[b].size; k++) {
+				taken[k] = set_mix(hash[value[k]], disp) & set->mask;
+				if (set->slot[taken[k]]) {
+					break;
+				}
+				set->slot[taken[k]] = value[k] + 1;
+			}
+			if (k == bucket[b].size) {
+				break;
+			}
+
+			/* Some value hit a taken slot, or one of the bucket */
+			while (k--) {
+				set->slot[taken[k]] = 0;
+			}
+		}
+
+		set->disp[home] = disp;
+		placed = disp < SET_DISP_TRIES;
+	}
+
+	if (!placed) {
+		free(set->slot);
+		free(set->disp);
+	}
+
+	free(bucket);
+	free(order);
+	free(taken);
+	return placed;
+}
+
+/* The table once the values are all added */
+static void set_build(struct SymbolSet *set)
+{
+	uint64_t *hash = calloc(set->count, sizeof(*hash));
+	bool *repeated = set_repeated(set);
+	uint32_t buckets = 1;
+	uint32_t size = 2;
+
+	assert(hash);
+
+	for (int i = 0; i < set->count; i++) {
+		hash[i] = set_hash(set->value[i]);
+	}
+
+	/* About four values a bucket, half of the slots free */
+	while (buckets * 4 < set->count) {
+		buckets *= 2;
+	}
+	while (size < 2 * set->count) {
+		size *= 2;
+	}
+	set->bucket_mask = buckets - 1;
+
+	/* Only values with the same 64-bit hash could take it beyond a few tries */
+	while (!set_place(set, hash, repeated, size)) {
+		size *= 2;
+		assert(size < (1u << 30));
+	}
+
+	free(hash);
+	free(repeated);
+}
+
+/* The values themselves are the SN's or the blob's */
+static void set_free(struct SymbolSet *set)
+{
+	if (!set) {
+		return;
+	}
+	free(set->value);
+	free(set->disp);
+	free(set->slot);
+	free(set);
+}
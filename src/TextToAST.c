@@ -2,9 +2,43 @@
 #include <stdlib.h>
 #include <string.h>
 #include <ctype.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
 
 #include <LOP.h>
 
+/* The source read in windows, see LOP_getAST_begin() */
+static const char *win_src;
+static size_t win_len;
+static size_t win_pos;
+static size_t win_size;
+/* The pages before it are released */
+static size_t win_released;
+
+static size_t l_input(char *buf, size_t max_size)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t n = win_len - win_pos;
+
+	if (n > max_size) {
+		n = max_size;
+	}
+	memcpy(buf, win_src + win_pos, n);
+	win_pos += n;
+
+	/* The scanner has its copy, the error report reads the pages in again if it needs */
+	if (win_pos / page * page > win_released) {
+		madvise((char *)win_src + win_released, win_pos / page * page - win_released, MADV_DONTNEED);
+		win_released = win_pos / page * page;
+	}
+
+	return n;
+}
+
+#define YY_INPUT(buf, result, max_size) (result) = l_input(buf, max_size)
+#define YY_READ_BUF_SIZE win_size
+
 #include "lex.yy.c"
 
 static struct LOP_ASTNode *last_list;
@@ -15,55 +49,128 @@ static int continue_was;
 static size_t l_line_offset;
 static struct LOP_Location last_loc;
 static size_t l_str_offset;
+/* LOP_getAST_step() has got to the end or failed */
+static bool l_done;
+static const char *l_filename;
+static const char *l_string;
+static size_t l_len;
+static struct LOP_OperatorTable *l_operator_table;
+static YY_BUFFER_STATE l_buffer;
+/* The copy of a whole source flex scans, kept by LOP_scan_end() for the parse of the same source */
+static char *l_copy;
+static const char *l_copy_src;
+static size_t l_copy_len;
+/* The token being built, from yylex() or from the lexer thread */
+static const char *l_text;
+static int l_leng;
+static int l_lineno;
+/* The limits of the parse, with the maximum where there is none */
+static struct LOP_Limits l_limits;
+static size_t l_nodes;
+static size_t l_bytes;
+/* Why create_token() has failed */
+static int l_failed;
+
+#define L_BATCH 512
+#define L_BATCHES 4
+
+struct TokenBatch {
+	struct TokenBatch *next;
+	int count;
+	struct {
+		enum Token t;
+		int leng;
+		int lineno;
+		size_t text;
+	} tok[L_BATCH];
+	char *text;
+	size_t text_size;
+};
+
+/* With a lexer thread, see LOP_getAST_begin(). It takes a spare batch, fills it with the
+ * tokens and their text, and queues it, LOP_getAST_step() builds them and gives the batch back */
+static struct {
+	bool started;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	struct TokenBatch *queue;
+	struct TokenBatch **tail;
+	struct TokenBatch *spare;
+	bool stop;
+	/* Being built */
+	struct TokenBatch *batch;
+	int next;
+} l_pipe = {
+	.lock = PTHREAD_MUTEX_INITIALIZER,
+	.cond = PTHREAD_COND_INITIALIZER,
+};
 
 #include "ErrorReport.c"
 
-static void l_report(enum LOP_ErrorType type, const char *filename, const char *string, size_t len, struct LOP_Location loc)
+const char *LOP_strerror(int rc)
 {
-	const char *err_string = NULL;
-
-	switch (type) {
+	switch (rc) {
 	case LOP_ERROR_LEXER_OUT_OF_MEMORY:
-		err_string = "Out of memory";
-		break;
+		return "Out of memory";
+	case LOP_ERROR_LEXER_DEPTH:
+		return "Lists nested too deep";
+	case LOP_ERROR_LEXER_NODES:
+		return "Too many nodes";
+	case LOP_ERROR_LEXER_SYMBOL:
+		return "Symbol too long";
+	case LOP_ERROR_LEXER_BYTES:
+		return "Too much memory taken";
 	case LOP_ERROR_LEXER_UNKNOWN:
-		err_string = "Unknown symbol";
-		break;
+		return "Unknown symbol";
 	case LOP_ERROR_LEXER_UNBALANCED:
-		err_string = "Unbalanced list";
-		break;
+		return "Unbalanced list";
 	case LOP_ERROR_LEXER_ROOT_CLOSED:
-		err_string = "Root list is closed by ;";
-		break;
+		return "Root list is closed by ;";
 	case LOP_ERROR_LEXER_ROOT_CLOSED_BY_INDENT:
-		err_string = "Root list is closed by indent";
-		break;
+		return "Root list is closed by indent";
 	case LOP_ERROR_LEXER_SEPARATOR:
-		err_string = "Separator expected";
-		break;
+		return "Separator expected";
 	case LOP_ERROR_LEXER_UNARY_ARGS:
-		err_string = "Unary operator expects exactly 1 argument";
-		break;
+		return "Unary operator expects exactly 1 argument";
 	case LOP_ERROR_LEXER_UNARY_UNKNOWN:
-		err_string = "Unknown unary operator";
-		break;
+		return "Unknown unary operator";
 	case LOP_ERROR_LEXER_BINARY_ARGS:
-		err_string = "Binary operator expects exactly 2 arguments";
-		break;
+		return "Binary operator expects exactly 2 arguments";
 	case LOP_ERROR_LEXER_BINARY_UNKNOWN:
-		err_string = "Unknown binary operator";
-		break;
+		return "Unknown binary operator";
+	case LOP_ERROR_LEXER_MATCHED:
+		return "The list is matched already";
+	case LOP_ERROR_SCHEMA_SYNTAX:
+		return "Syntax error";
+	case LOP_ERROR_SCHEMA_MISSING_RULE:
+		return "Rule not found";
+	case LOP_ERROR_SCHEMA_MISSING_TOP:
+		return "Top rule not found";
+	case LOP_ERROR_SCHEMA_CACHE:
+		return "Schema cache missing, broken or stale";
+	case LOP_ERROR_SCHEMA_UNKNOWN_CALLBACK:
+		return "Unknown callback";
+	case LOP_ERROR_SCHEMA_OPERATORS:
+		return "Parsed with other operators";
+	case LOP_ERROR_FILE:
+		return "File can't be read";
+	case LOP_ERROR_BUDGET:
+		return "Match stopped by the budget";
 	default:
-		assert(1);
+		return "Unknown error";
 	}
+}
 
-	report_error(filename, string, len, loc, err_string);
+static void l_report(enum LOP_ErrorType type, const char *filename, const char *string, size_t len, struct LOP_Location loc)
+{
+	report_error(filename, string, len, loc, LOP_strerror(type), NULL);
 }
 
 static struct LOP_Location get_loc(void)
 {
 	return (struct LOP_Location) {
-		.lineno = yylineno,
+		.lineno = l_lineno,
 		.charno = l_str_offset - l_line_offset,
 		.line_offset = l_line_offset,
 	};
@@ -71,8 +178,29 @@ static struct LOP_Location get_loc(void)
 
 static struct LOP_ASTNode *create_token(enum LOP_ASTNodeType type)
 {
-	struct LOP_ASTNode *t = calloc(1, sizeof(*t));
+	size_t symbol = type == LOP_TYPE_STRING ? 1 : l_leng + 1;
+	struct LOP_ASTNode *t;
 
+	l_bytes += sizeof(*t);
+	if (type > LOP_TYPE_LIST_LAST) {
+		l_bytes += symbol;
+	}
+
+	if (++l_nodes > l_limits.max_nodes) {
+		l_failed = LOP_ERROR_LEXER_NODES;
+		return NULL;
+	}
+	if (type > LOP_TYPE_LIST_LAST && symbol - 1 > l_limits.max_symbol) {
+		l_failed = LOP_ERROR_LEXER_SYMBOL;
+		return NULL;
+	}
+	if (l_bytes > l_limits.max_bytes) {
+		l_failed = LOP_ERROR_LEXER_BYTES;
+		return NULL;
+	}
+
+	l_failed = LOP_ERROR_LEXER_OUT_OF_MEMORY;
+	t = calloc(1, sizeof(*t));
 	if (t == NULL) {
 		return NULL;
 	}
@@ -80,12 +208,13 @@ static struct LOP_ASTNode *create_token(enum LOP_ASTNodeType type)
 	t->type = type;
 	t->loc = get_loc();
 	t->indent = indent;
+	t->id = LOP_AST_NO_ID;
 
 	if (type > LOP_TYPE_LIST_LAST) {
 		if (type == LOP_TYPE_STRING) {
 			t->symbol.value = strdup("");
 		} else {
-			t->symbol.value = strdup(yytext);
+			t->symbol.value = strdup(l_text);
 		}
 
 		if (t->symbol.value == NULL) {
@@ -99,37 +228,58 @@ static struct LOP_ASTNode *create_token(enum LOP_ASTNodeType type)
 
 static struct LOP_ASTNode *swap_token(struct LOP_ASTNode *t)
 {
-	struct LOP_ASTNode *ret = last_token;
-	struct LOP_ASTNode *prev = NULL;
+	struct LOP_ASTNode *slot = last_token;
+	struct LOP_ASTNode tmp;
 
 	assert(last_list);
 	assert(last_token);
+	assert(last_list->list.tail == last_token);
 
-	for (struct LOP_ASTNode *i = last_list->list.head; i; i = i->next) {
-		if (i == last_token) {
-			break;
-		}
-		prev = i;
+	/* The matcher has taken it, see LOP_getAST_settled() */
+	if (slot->id != LOP_AST_NO_ID && win_src) {
+		LOP_delAST(t);
+		return NULL;
 	}
 
-	assert(prev == NULL || prev->next == last_token);
-
 	/* Taking into account that last_token is either
-	 * a single element in the list or the last element. */
-	if (prev == NULL) {
-		last_list->list.head = last_list->list.tail = t;
-	} else {
-		prev->next = t;
-		last_list->list.tail = t;
+	 * a single element in the list or the last element,
+	 * t takes its place by swapping the contents of the nodes.
+	 * This way we don't look for the previous element in the list,
+	 * which is quadratic for the long lists. */
+	tmp = *slot;
+	*slot = *t;
+	*t = tmp;
+
+	slot->parent = last_list;
+	slot->next = NULL;
+	last_token = slot;
+
+	/* t goes one list deeper, with all it has */
+	slot->depth = t->depth;
+	slot->height = slot->type < LOP_TYPE_LIST_LAST && t->type < LOP_TYPE_LIST_LAST ? t->height + 1 : 0;
+	t->depth = slot->depth + 1;
+
+	t->parent = NULL;
+	t->next = NULL;
+
+	if (t->type < LOP_TYPE_LIST_LAST) {
+		for (struct LOP_ASTNode *i = t->list.head; i; i = i->next) {
+			i->parent = t;
+		}
 	}
 
-	t->parent = last_list;
-	last_token = t;
+	return t;
+}
 
-	ret->parent = NULL;
-	ret->next = NULL;
+/* Back to the parent list, which is as deep as the lists in this one */
+static void list_up(void)
+{
+	struct LOP_ASTNode *parent = last_list->parent;
 
-	return ret;
+	if (parent && parent->height <= last_list->height) {
+		parent->height = last_list->height + 1;
+	}
+	last_list = parent;
 }
 
 static int vert_colon_closed(void)
@@ -178,7 +328,7 @@ static int operator_close(void)
 		if (rc < 0) {
 			return rc;
 		}
-		last_list = last_list->parent;
+		list_up();
 	}
 
 	return 0;
@@ -189,7 +339,7 @@ static int close_vert_colon(void)
 	while (vert_colon_closed()) {
 		int rc;
 
-		last_list = last_list->parent;
+		list_up();
 		if (last_list == NULL) {
 			return LOP_ERROR_LEXER_ROOT_CLOSED_BY_INDENT;
 		}
@@ -214,7 +364,7 @@ static int push_token(struct LOP_ASTNode *t)
 	int rc;
 
 	if (t == NULL) {
-		return LOP_ERROR_LEXER_OUT_OF_MEMORY;
+		return l_failed;
 	}
 
 	rc = close_vert_colon();
@@ -252,12 +402,16 @@ static int push_token(struct LOP_ASTNode *t)
 	continue_was = 0;
 
 	t->parent = last_list;
+	t->depth = last_list->depth + 1;
 
 	if (last_token) {
 		if (t->type < LOP_TYPE_LIST_LAST) {
 			t->list.call = 1;
 
 			t = swap_token(t);
+			if (t == NULL) {
+				return LOP_ERROR_LEXER_MATCHED;
+			}
 
 			last_list = last_token;
 
@@ -265,7 +419,12 @@ static int push_token(struct LOP_ASTNode *t)
 
 			last_list->list.head = last_list->list.tail = t;
 			last_token = NULL;
+
+			if (last_list->depth + last_list->height > l_limits.max_depth) {
+				return LOP_ERROR_LEXER_DEPTH;
+			}
 		} else {
+			LOP_delAST(t);
 			return LOP_ERROR_LEXER_SEPARATOR;
 		}
 	} else {
@@ -277,6 +436,10 @@ static int push_token(struct LOP_ASTNode *t)
 		last_list->list.tail = t;
 
 		if (t->type < LOP_TYPE_LIST_LAST) {
+			/* A callee of an operator comes here with its lists */
+			if (t->depth + t->height > l_limits.max_depth) {
+				return LOP_ERROR_LEXER_DEPTH;
+			}
 			last_list = t;
 			last_token = NULL;
 		} else {
@@ -300,21 +463,31 @@ static int l_str_open()
 
 static void set_newline(void)
 {
-	l_line_offset = l_str_offset + yyleng;
+	l_line_offset = l_str_offset + l_leng;
 	newline_was = 1;
 }
 
 static int l_str_append()
 {
-	last_token->symbol.value = realloc((char *)last_token->symbol.value, strlen(last_token->symbol.value) + yyleng + 1);
+	size_t len = strlen(last_token->symbol.value);
+
+	l_bytes += l_leng;
+	if (len + l_leng > l_limits.max_symbol) {
+		return LOP_ERROR_LEXER_SYMBOL;
+	}
+	if (l_bytes > l_limits.max_bytes) {
+		return LOP_ERROR_LEXER_BYTES;
+	}
+
+	last_token->symbol.value = realloc((char *)last_token->symbol.value, len + l_leng + 1);
 
 	if (last_token->symbol.value == NULL) {
 		return LOP_ERROR_LEXER_OUT_OF_MEMORY;
 	}
 
-	strcat((char *)last_token->symbol.value, yytext);
+	strcat((char *)last_token->symbol.value, l_text);
 
-	if (yytext[yyleng - 1] == '\n') {
+	if (l_text[l_leng - 1] == '\n') {
 		set_newline();
 	}
 	return 0;
@@ -323,7 +496,7 @@ static int l_str_append()
 static int l_str_close()
 {
 	if (last_list->type == LOP_TYPE_LIST_STRING) {
-		last_list = last_list->parent;
+		list_up();
 	}
 	last_token = last_list->list.tail;
 	newline_was = 0;
@@ -352,11 +525,11 @@ static int l_operator(struct LOP_OperatorTable *operator_table)
 	int rc;
 
 	if (t == NULL) {
-		return LOP_ERROR_LEXER_OUT_OF_MEMORY;
+		return l_failed;
 	}
 
 	if (last_token) {
-		op = op_find(operator_table, yytext, LOP_OPERATOR_BINARY_MASK);
+		op = op_find(operator_table, l_text, LOP_OPERATOR_BINARY_MASK);
 		if (op == NULL) {
 			return LOP_ERROR_LEXER_BINARY_UNKNOWN;
 		}
@@ -368,13 +541,16 @@ static int l_operator(struct LOP_OperatorTable *operator_table)
 			if (last_list->list.prio == op->prio && op->type == LOP_OPERATOR_RTL) {
 				break;
 			}
-			last_list = last_list->parent;
+			list_up();
 			last_token = last_list->list.tail;
 		}
 
 		last_token = last_list->list.tail;
 
 		t = swap_token(t);
+		if (t == NULL) {
+			return LOP_ERROR_LEXER_MATCHED;
+		}
 
 		rc = push_token(create_token(LOP_TYPE_LIST_OPERATOR_BINARY));
 		if (rc < 0) {
@@ -388,10 +564,12 @@ static int l_operator(struct LOP_OperatorTable *operator_table)
 
 		/* a(b) + c must be (binary + (call a '()' b) c)
 		 * and not the (binary + (call a '()' b c)) */
-		last_list = t->parent;
+		if (last_list == t) {
+			list_up();
+		}
 		last_token = NULL;
 	} else {
-		op = op_find(operator_table, yytext, LOP_OPERATOR_UNARY);
+		op = op_find(operator_table, l_text, LOP_OPERATOR_UNARY);
 		if (op == NULL) {
 			return LOP_ERROR_LEXER_UNARY_UNKNOWN;
 		}
@@ -421,7 +599,7 @@ static int l_push_token(enum LOP_ASTNodeType t)
 		 * 3. a->b() => (call '()' (binary (operator ->) (identifier a) (identifier b)))
 		 */
 		if (last_list->list.prio == 0) {
-			last_list = last_list->parent;
+			list_up();
 			last_token = last_list->list.tail;
 			continue;
 		}
@@ -456,7 +634,7 @@ static int l_list_close(enum LOP_ASTNodeType t)
 			} else if (last_list->type != LOP_TYPE_LIST_COLON) {
 				break;
 			}
-			last_list = last_list->parent;
+			list_up();
 			if (last_list == NULL) {
 				return LOP_ERROR_LEXER_UNBALANCED;
 			}
@@ -467,7 +645,7 @@ static int l_list_close(enum LOP_ASTNodeType t)
 		return LOP_ERROR_LEXER_UNBALANCED;
 	}
 
-	last_list = last_list->parent;
+	list_up();
 	if (last_list == NULL) {
 		return LOP_ERROR_LEXER_ROOT_CLOSED;
 	}
@@ -534,12 +712,277 @@ static int finish(void)
 	return 0;
 }
 
-int LOP_getAST(struct LOP_ASTNode **root, const char *filename, const char *string, size_t len, struct LOP_OperatorTable *operator_table)
+static int l_token(enum Token t)
 {
-	enum Token t;
 	int rc = 0;
 
+	switch (t) {
+	case L_DIGIT:
+	case L_FLOAT:
+	case L_BNUMBER:
+		last_loc = get_loc();
+		rc = l_push_token(LOP_TYPE_NUMBER);
+		break;
+	case L_ID:
+		last_loc = get_loc();
+		rc = l_push_token(LOP_TYPE_ID);
+		break;
+	case L_SQUOTE:
+	case L_DQUOTE:
+	case L_QQUOTE:
+		last_loc = get_loc();
+		rc = l_str_open();
+		break;
+	case L_STR_APPEND:
+		last_loc = get_loc();
+		rc = l_str_append();
+		break;
+	case L_STR_CONTINUE:
+		break;
+	case L_QUOTE_CLOSE:
+		last_loc = get_loc();
+		rc = l_str_close();
+		break;
+	case L_COMMENT:
+		break;
+	case L_OPERATOR:
+		last_loc = get_loc();
+		rc = l_operator(l_operator_table);
+		break;
+	case L_LIST_OPEN:
+		last_loc = get_loc();
+		rc = l_push_token(LOP_TYPE_LIST_ROUND);
+		break;
+	case L_CLIST_OPEN:
+		last_loc = get_loc();
+		rc = l_push_token(LOP_TYPE_LIST_CURLY);
+		break;
+	case L_BLIST_OPEN:
+		last_loc = get_loc();
+		rc = l_push_token(LOP_TYPE_LIST_SQUARE);
+		break;
+	case L_TLIST_OPEN:
+		last_loc = get_loc();
+		rc = l_push_token(LOP_TYPE_LIST_COLON);
+		break;
+	case L_LIST_CLOSE:
+		last_loc = get_loc();
+		rc = l_list_close(LOP_TYPE_LIST_ROUND);
+		break;
+	case L_CLIST_CLOSE:
+		last_loc = get_loc();
+		rc = l_list_close(LOP_TYPE_LIST_CURLY);
+		break;
+	case L_BLIST_CLOSE:
+		last_loc = get_loc();
+		rc = l_list_close(LOP_TYPE_LIST_SQUARE);
+		break;
+	case L_TLIST_CLOSE:
+		last_loc = get_loc();
+		rc = l_list_close(LOP_TYPE_LIST_COLON);
+		break;
+	case L_INDENT:
+		if (newline_was) {
+			indent++;
+		}
+		break;
+	case L_NEWLINE:
+		rc = l_newline();
+		break;
+	case L_CONTINUE:
+		continue_was = 1;
+		break;
+	case L_COMMA:
+		rc = l_comma();
+		break;
+	case L_WHITESPACE:
+		break;
+	case L_UNKNOWN:
+		rc = LOP_ERROR_LEXER_UNKNOWN;
+		break;
+	default:
+		assert(0);
+	}
+
+	return rc;
+}
+
+static void *l_lexer(void *arg)
+{
+	enum Token t;
+
+	do {
+		struct TokenBatch *b;
+		size_t text_len = 0;
+
+		pthread_mutex_lock(&l_pipe.lock);
+		while (l_pipe.spare == NULL && !l_pipe.stop) {
+			pthread_cond_wait(&l_pipe.cond, &l_pipe.lock);
+		}
+		b = l_pipe.spare;
+		if (l_pipe.stop) {
+			pthread_mutex_unlock(&l_pipe.lock);
+			break;
+		}
+		l_pipe.spare = b->next;
+		pthread_mutex_unlock(&l_pipe.lock);
+
+		b->count = 0;
+		do {
+			t = yylex();
+
+			if (text_len + yyleng + 1 > b->text_size) {
+				b->text_size = (text_len + yyleng + 1) * 2;
+				b->text = realloc(b->text, b->text_size);
+				assert(b->text);
+			}
+			memcpy(b->text + text_len, yytext, yyleng + 1);
+			b->tok[b->count].t = t;
+			b->tok[b->count].leng = yyleng;
+			b->tok[b->count].lineno = yylineno;
+			b->tok[b->count].text = text_len;
+			b->count++;
+			text_len += yyleng + 1;
+		} while (t && b->count < L_BATCH);
+
+		pthread_mutex_lock(&l_pipe.lock);
+		b->next = NULL;
+		*l_pipe.tail = b;
+		l_pipe.tail = &b->next;
+		pthread_cond_broadcast(&l_pipe.cond);
+		pthread_mutex_unlock(&l_pipe.lock);
+	} while (t);
+
+	return NULL;
+}
+
+static enum Token l_next(void)
+{
+	struct TokenBatch *b = l_pipe.batch;
+	enum Token t;
+
+	if (!l_pipe.started) {
+		t = yylex();
+		l_text = yytext;
+		l_leng = yyleng;
+		l_lineno = yylineno;
+		return t;
+	}
+
+	pthread_mutex_lock(&l_pipe.lock);
+	if (b && l_pipe.next == b->count) {
+		b->next = l_pipe.spare;
+		l_pipe.spare = b;
+		b = NULL;
+		pthread_cond_broadcast(&l_pipe.cond);
+	}
+	if (b == NULL) {
+		while (l_pipe.queue == NULL) {
+			pthread_cond_wait(&l_pipe.cond, &l_pipe.lock);
+		}
+		b = l_pipe.queue;
+		l_pipe.queue = b->next;
+		if (l_pipe.queue == NULL) {
+			l_pipe.tail = &l_pipe.queue;
+		}
+		b->next = NULL;
+		l_pipe.batch = b;
+		l_pipe.next = 0;
+	}
+	pthread_mutex_unlock(&l_pipe.lock);
+
+	t = b->tok[l_pipe.next].t;
+	l_text = b->text + b->tok[l_pipe.next].text;
+	l_leng = b->tok[l_pipe.next].leng;
+	l_lineno = b->tok[l_pipe.next].lineno;
+	l_pipe.next++;
+
+	return t;
+}
+
+static void l_pipe_free(struct TokenBatch *b)
+{
+	while (b) {
+		struct TokenBatch *next = b->next;
+
+		free(b->text);
+		free(b);
+		b = next;
+	}
+}
+
+/* The scanner of LOP_getAST_begin() and LOP_scan_begin() */
+static int l_begin(const char *string, size_t len, size_t window, bool thread)
+{
+	/* Out of a string the last source has left open */
+	BEGIN(INITIAL);
+
+	if (window) {
+		win_src = string;
+		win_len = len;
+		win_pos = 0;
+		win_size = window;
+		win_released = 0;
+		l_buffer = yy_create_buffer(NULL, window);
+		yy_switch_to_buffer(l_buffer);
+	} else {
+		win_src = NULL;
+		if (l_copy == NULL || l_copy_src != string || l_copy_len != len) {
+			free(l_copy);
+			l_copy = malloc(len + 2);
+			if (l_copy == NULL) {
+				return LOP_ERROR_LEXER_OUT_OF_MEMORY;
+			}
+			l_copy_src = string;
+			l_copy_len = len;
+		}
+		/* Again into a kept copy, flex writes into it as it goes */
+		memcpy(l_copy, string, len);
+		l_copy[len] = l_copy[len + 1] = YY_END_OF_BUFFER_CHAR;
+		l_buffer = yy_scan_buffer(l_copy, len + 2);
+	}
+
+	l_pipe.started = false;
+	if (thread) {
+		l_pipe.queue = NULL;
+		l_pipe.tail = &l_pipe.queue;
+		l_pipe.spare = NULL;
+		l_pipe.batch = NULL;
+		l_pipe.stop = false;
+		for (int i = 0; i < L_BATCHES; i++) {
+			struct TokenBatch *b = calloc(1, sizeof(*b));
+
+			if (b == NULL) {
+				l_pipe_free(l_pipe.spare);
+				return LOP_ERROR_LEXER_OUT_OF_MEMORY;
+			}
+			b->next = l_pipe.spare;
+			l_pipe.spare = b;
+		}
+		/* Lexed here if it can't start */
+		l_pipe.started = pthread_create(&l_pipe.thread, NULL, l_lexer, NULL) == 0;
+		if (!l_pipe.started) {
+			l_pipe_free(l_pipe.spare);
+		}
+	}
+
+	return 0;
+}
+
+int LOP_getAST_begin(struct LOP_ASTNode **root, const char *filename, const char *string, size_t len,
+	struct LOP_OperatorTable *operator_table, const struct LOP_Limits *limits, size_t window, bool thread)
+{
+	l_limits = (struct LOP_Limits) {
+		.max_depth = limits && limits->max_depth ? limits->max_depth : INT_MAX,
+		.max_nodes = limits && limits->max_nodes ? limits->max_nodes : SIZE_MAX,
+		.max_symbol = limits && limits->max_symbol ? limits->max_symbol : SIZE_MAX,
+		.max_bytes = limits && limits->max_bytes ? limits->max_bytes : SIZE_MAX,
+	};
+	l_nodes = 0;
+	l_bytes = 0;
+
 	yylineno = 1;
+	l_lineno = 1;
 	indent = -1;
 	newline_was = 1;
 	continue_was = 0;
@@ -550,107 +993,681 @@ int LOP_getAST(struct LOP_ASTNode **root, const char *filename, const char *stri
 	last_token = NULL;
 	indent = 0;
 
-	yy_scan_bytes(string, len);
+	l_done = false;
+	l_filename = filename;
+	l_string = string;
+	l_len = len;
+	l_operator_table = operator_table;
 
-	while (rc == 0 && (t = yylex())) {
-		switch (t) {
-		case L_DIGIT:
-		case L_FLOAT:
-		case L_BNUMBER:
-			last_loc = get_loc();
-			rc = l_push_token(LOP_TYPE_NUMBER);
-			break;
-		case L_ID:
-			last_loc = get_loc();
-			rc = l_push_token(LOP_TYPE_ID);
-			break;
-		case L_SQUOTE:
-		case L_DQUOTE:
-		case L_QQUOTE:
-			last_loc = get_loc();
-			rc = l_str_open();
-			break;
-		case L_STR_APPEND:
-			last_loc = get_loc();
-			rc = l_str_append();
-			break;
-		case L_STR_CONTINUE:
-			break;
-		case L_QUOTE_CLOSE:
-			last_loc = get_loc();
-			rc = l_str_close();
-			break;
-		case L_COMMENT:
-			break;
-		case L_OPERATOR:
-			last_loc = get_loc();
-			rc = l_operator(operator_table);
-			break;
-		case L_LIST_OPEN:
-			last_loc = get_loc();
-			rc = l_push_token(LOP_TYPE_LIST_ROUND);
-			break;
-		case L_CLIST_OPEN:
-			last_loc = get_loc();
-			rc = l_push_token(LOP_TYPE_LIST_CURLY);
-			break;
-		case L_BLIST_OPEN:
-			last_loc = get_loc();
-			rc = l_push_token(LOP_TYPE_LIST_SQUARE);
-			break;
-		case L_TLIST_OPEN:
-			last_loc = get_loc();
-			rc = l_push_token(LOP_TYPE_LIST_COLON);
-			break;
-		case L_LIST_CLOSE:
-			last_loc = get_loc();
-			rc = l_list_close(LOP_TYPE_LIST_ROUND);
-			break;
-		case L_CLIST_CLOSE:
-			last_loc = get_loc();
-			rc = l_list_close(LOP_TYPE_LIST_CURLY);
-			break;
-		case L_BLIST_CLOSE:
-			last_loc = get_loc();
-			rc = l_list_close(LOP_TYPE_LIST_SQUARE);
-			break;
-		case L_TLIST_CLOSE:
-			last_loc = get_loc();
-			rc = l_list_close(LOP_TYPE_LIST_COLON);
-			break;
-		case L_INDENT:
-			if (newline_was) {
-				indent++;
-			}
-			break;
-		case L_NEWLINE:
-			rc = l_newline();
-			break;
-		case L_CONTINUE:
-			continue_was = 1;
-			break;
-		case L_COMMA:
-			rc = l_comma();
-			break;
-		case L_WHITESPACE:
-			break;
-		case L_UNKNOWN:
-			rc = LOP_ERROR_LEXER_UNKNOWN;
-			break;
-		default:
-			assert(0);
+	if (*root == NULL) {
+		return l_failed;
+	}
+
+	return l_begin(string, len, window, thread);
+}
+
+int LOP_getAST_step(void)
+{
+	enum Token t;
+	int rc;
+
+	if (l_done) {
+		return 0;
+	}
+
+	t = l_next();
+	if (t) {
+		rc = l_token(t);
+		l_str_offset += l_leng;
+	} else {
+		rc = finish();
+	}
+
+	/* The matcher reports it if it can't parse the source again, see LOP_init_file() */
+	if (rc < 0 && rc != LOP_ERROR_LEXER_MATCHED) {
+		l_report(rc, l_filename, l_string, l_len, last_loc);
+	}
+	l_done = t == 0 || rc < 0;
+
+	return rc < 0 ? rc : t != 0;
+}
+
+bool LOP_getAST_open(const struct LOP_ASTNode *n)
+{
+	if (l_done) {
+		return false;
+	}
+
+	for (struct LOP_ASTNode *i = last_list; i; i = i->parent) {
+		if (i == n) {
+			return true;
 		}
+	}
+	return false;
+}
 
-		l_str_offset += yyleng;
+bool LOP_getAST_settled(const struct LOP_ASTNode *n)
+{
+	if (l_done) {
+		return true;
 	}
+	if (n == last_token) {
+		return false;
+	}
+
+	/* A colon list closed by ; may still be called or be an operand, that's known with the next token,
+	 * see above. One which goes on past its line is taken while it's open, to stream what's inside,
+	 * and that's LOP_ERROR_LEXER_MATCHED if it's closed by ; later */
+	if (!LOP_getAST_open(n)) {
+		return true;
+	}
+	return n->type == LOP_TYPE_LIST_COLON && n->loc.lineno < l_lineno;
+}
+
+static void l_end(bool keep)
+{
+	if (l_pipe.started) {
+		pthread_mutex_lock(&l_pipe.lock);
+		l_pipe.stop = true;
+		pthread_cond_broadcast(&l_pipe.cond);
+		pthread_mutex_unlock(&l_pipe.lock);
+		pthread_join(l_pipe.thread, NULL);
+
+		l_pipe_free(l_pipe.queue);
+		l_pipe_free(l_pipe.spare);
+		l_pipe_free(l_pipe.batch);
+		l_pipe.started = false;
+	}
+
+	yy_delete_buffer(l_buffer);
+	l_buffer = NULL;
+	win_src = NULL;
+	if (!keep) {
+		free(l_copy);
+		l_copy = NULL;
+	}
+}
+
+void LOP_getAST_end(void)
+{
+	l_end(false);
+}
+
+int LOP_getAST(struct LOP_ASTNode **root, const char *filename, const char *string, size_t len,
+	       struct LOP_OperatorTable *operator_table, const struct LOP_Limits *limits)
+{
+	int rc;
 
+	rc = LOP_getAST_begin(root, filename, string, len, operator_table, limits, 0, false);
 	if (rc == 0) {
-		rc = finish();
+		do {
+			rc = LOP_getAST_step();
+		} while (rc > 0);
 	}
+	LOP_getAST_end();
+
+	return rc;
+}
+
+struct LOP_Location LOP_getAST_loc(void)
+{
+	return last_loc;
+}
+
+/* LOP_scan_next(): the builder above without the nodes, for LOP.direct. It keeps what the
+ * builder looks at of the open lists, and passes a list as soon as it's opened, and a symbol
+ * once it can't become a callee or an operand any more. A list which would be turned into
+ * one after it's passed stops it with LOP_ERROR_LEXER_MATCHED, as LOP_init_file() does */
+
+struct ScanList {
+	enum LOP_ASTNodeType type;
+	int indent;
+	int prio;
+	/* Elements, the symbol which isn't passed yet included */
+	int count;
+	/* Of the last one, for vert_colon_closed() */
+	int tail_indent;
+};
+
+static struct {
+	/* The open lists, the root first */
+	struct ScanList *list;
+	int depth;
+	int size;
+	/* last_token: none, the symbol which isn't passed yet, or a list passed already */
+	enum {
+		SCAN_NONE,
+		SCAN_SYMBOL,
+		SCAN_PASSED,
+	} last;
+	struct LOP_ASTNode symbol;
+	char *text;
+	size_t text_len;
+	size_t text_size;
+	/* Passed by the token, the symbol values are by offset in value_text */
+	struct LOP_Scan *queue;
+	size_t *value;
+	int count;
+	int next;
+	int queue_size;
+	char *value_text;
+	size_t value_len;
+	size_t value_size;
+} l_scan;
+
+static void scan_text(char **buf, size_t *len, size_t *size, const char *text, size_t n)
+{
+	if (*len + n + 1 > *size) {
+		*size = (*len + n + 1) * 2;
+		*buf = realloc(*buf, *size);
+		assert(*buf);
+	}
+	memcpy(*buf + *len, text, n);
+	*len += n;
+	(*buf)[*len] = 0;
+}
+
+static struct LOP_Scan *scan_pass(enum LOP_ScanType what, enum LOP_ASTNodeType type)
+{
+	struct LOP_Scan *s;
+
+	if (l_scan.count == l_scan.queue_size) {
+		l_scan.queue_size = l_scan.queue_size ? l_scan.queue_size * 2 : 16;
+		l_scan.queue = realloc(l_scan.queue, l_scan.queue_size * sizeof(*l_scan.queue));
+		l_scan.value = realloc(l_scan.value, l_scan.queue_size * sizeof(*l_scan.value));
+		assert(l_scan.queue && l_scan.value);
+	}
+
+	s = &l_scan.queue[l_scan.count++];
+	*s = (struct LOP_Scan) {
+		.what = what,
+		.n = {
+			.type = type,
+			.loc = get_loc(),
+			.indent = indent,
+			.depth = l_scan.depth,
+			.id = LOP_AST_NO_ID,
+		},
+	};
+	return s;
+}
+
+static void scan_symbol(enum LOP_ASTNodeType type, struct LOP_Location loc, int at, const char *text, size_t len)
+{
+	struct LOP_Scan *s = scan_pass(LOP_SCAN_SYMBOL, type);
+
+	s->n.loc = loc;
+	s->n.indent = at;
+	l_scan.value[s - l_scan.queue] = l_scan.value_len;
+	scan_text(&l_scan.value_text, &l_scan.value_len, &l_scan.value_size, text, len);
+	/* A gap, so the next value doesn't run into this one */
+	l_scan.value_len++;
+}
+
+/* The symbol which was last_token is taken where it is */
+static void scan_seal(void)
+{
+	if (l_scan.last == SCAN_SYMBOL) {
+		scan_symbol(l_scan.symbol.type, l_scan.symbol.loc, l_scan.symbol.indent, l_scan.text, l_scan.text_len);
+	}
+	l_scan.last = SCAN_NONE;
+}
+
+static void scan_open(enum LOP_ASTNodeType type, int call, int prio)
+{
+	struct LOP_Scan *s = scan_pass(LOP_SCAN_OPEN, type);
 
+	s->n.list.call = call;
+	s->n.list.prio = prio;
+
+	if (l_scan.depth == l_scan.size) {
+		l_scan.size = l_scan.size ? l_scan.size * 2 : 16;
+		l_scan.list = realloc(l_scan.list, l_scan.size * sizeof(*l_scan.list));
+		assert(l_scan.list);
+	}
+	l_scan.list[l_scan.depth++] = (struct ScanList) {
+		.type = type,
+		.indent = indent,
+		.prio = prio,
+	};
+}
+
+static struct ScanList *scan_top(void)
+{
+	return &l_scan.list[l_scan.depth - 1];
+}
+
+static void scan_up(void)
+{
+	scan_seal();
+	l_scan.depth--;
+	scan_pass(LOP_SCAN_CLOSE, l_scan.list[l_scan.depth].type);
+}
+
+static int scan_vert_colon_closed(void)
+{
+	struct ScanList *top = scan_top();
+
+	if (top->type != LOP_TYPE_LIST_COLON || newline_was == 0 || continue_was == 1) {
+		return 0;
+	}
+	if (indent <= top->indent) {
+		return 1;
+	}
+	if (top->count && top->tail_indent > top->indent && indent < top->tail_indent) {
+		return 1;
+	}
+	return 0;
+}
+
+static int scan_top_is_operator(void)
+{
+	return scan_top()->type == LOP_TYPE_LIST_OPERATOR_UNARY || scan_top()->type == LOP_TYPE_LIST_OPERATOR_BINARY;
+}
+
+static int scan_operator_close(void)
+{
+	while (scan_top_is_operator()) {
+		struct ScanList *top = scan_top();
+
+		if (top->type == LOP_TYPE_LIST_OPERATOR_UNARY && top->count != 2) {
+			return LOP_ERROR_LEXER_UNARY_ARGS;
+		}
+		if (top->type == LOP_TYPE_LIST_OPERATOR_BINARY && top->count >= 2 && top->count != 3) {
+			return LOP_ERROR_LEXER_BINARY_ARGS;
+		}
+		scan_up();
+	}
+
+	return 0;
+}
+
+static int scan_close_vert_colon(void)
+{
+	while (scan_vert_colon_closed()) {
+		int rc;
+
+		scan_up();
+		if (l_scan.depth == 0) {
+			return LOP_ERROR_LEXER_ROOT_CLOSED_BY_INDENT;
+		}
+
+		rc = scan_operator_close();
+		if (rc < 0) {
+			return rc;
+		}
+		l_scan.last = SCAN_NONE;
+	}
+
+	return 0;
+}
+
+/* push_token() of a new node of the type */
+static int scan_push(enum LOP_ASTNodeType type, int prio)
+{
+	struct ScanList *top;
+	int rc;
+
+	rc = scan_close_vert_colon();
 	if (rc < 0) {
-		l_report(rc, filename, string, len, last_loc);
+		return rc;
 	}
 
-	return rc;
+	newline_was = 0;
+	continue_was = 0;
+	top = scan_top();
+
+	if (l_scan.last != SCAN_NONE) {
+		if (type > LOP_TYPE_LIST_LAST) {
+			return LOP_ERROR_LEXER_SEPARATOR;
+		}
+		if (l_scan.last == SCAN_PASSED) {
+			return LOP_ERROR_LEXER_MATCHED;
+		}
+
+		/* The list takes the place of the symbol, which is its callee */
+		top->tail_indent = indent;
+		scan_open(type, 1, prio);
+		scan_top()->count = 1;
+		scan_top()->tail_indent = l_scan.symbol.indent;
+		scan_seal();
+		return 0;
+	}
+
+	top->count++;
+	top->tail_indent = indent;
+
+	if (type < LOP_TYPE_LIST_LAST) {
+		scan_open(type, 0, prio);
+		return 0;
+	}
+
+	l_scan.last = SCAN_SYMBOL;
+	l_scan.symbol = (struct LOP_ASTNode) {
+		.type = type,
+		.loc = get_loc(),
+		.indent = indent,
+	};
+	l_scan.text_len = 0;
+	scan_text(&l_scan.text, &l_scan.text_len, &l_scan.text_size, l_text, type == LOP_TYPE_STRING ? 0 : l_leng);
+	return 0;
+}
+
+static int scan_str_open(void)
+{
+	if (l_scan.last != SCAN_NONE) {
+		int rc = scan_push(LOP_TYPE_LIST_STRING, 0);
+		if (rc < 0) {
+			return rc;
+		}
+	}
+	return scan_push(LOP_TYPE_STRING, 0);
+}
+
+static int scan_str_append(void)
+{
+	scan_text(&l_scan.text, &l_scan.text_len, &l_scan.text_size, l_text, l_leng);
+
+	if (l_text[l_leng - 1] == '\n') {
+		set_newline();
+	}
+	return 0;
+}
+
+static int scan_str_close(void)
+{
+	if (scan_top()->type == LOP_TYPE_LIST_STRING) {
+		scan_up();
+		l_scan.last = SCAN_PASSED;
+	}
+	newline_was = 0;
+	return 0;
+}
+
+static int scan_operator(void)
+{
+	struct LOP_Operator *op;
+	struct ScanList *top = scan_top();
+
+	if (l_scan.last == SCAN_NONE) {
+		int rc;
+
+		op = op_find(l_operator_table, l_text, LOP_OPERATOR_UNARY);
+		if (op == NULL) {
+			return LOP_ERROR_LEXER_UNARY_UNKNOWN;
+		}
+
+		rc = scan_push(LOP_TYPE_OPERATOR, 0);
+		if (rc < 0) {
+			return rc;
+		}
+		return scan_push(LOP_TYPE_LIST_OPERATOR_UNARY, op->prio);
+	}
+
+	op = op_find(l_operator_table, l_text, LOP_OPERATOR_BINARY_MASK);
+	if (op == NULL) {
+		return LOP_ERROR_LEXER_BINARY_UNKNOWN;
+	}
+
+	/* The operator list around it, or the list last_token is, becomes the operand */
+	if (top->type > LOP_TYPE_LIST_LAST_CALLABLE &&
+	    (top->prio < op->prio || (top->prio == op->prio && op->type != LOP_OPERATOR_RTL))) {
+		return LOP_ERROR_LEXER_MATCHED;
+	}
+	if (l_scan.last == SCAN_PASSED || scan_vert_colon_closed()) {
+		return LOP_ERROR_LEXER_MATCHED;
+	}
+
+	/* (binary op symbol), in the place of the symbol */
+	newline_was = 0;
+	continue_was = 0;
+	top->tail_indent = indent;
+	scan_open(LOP_TYPE_LIST_OPERATOR_BINARY, 1, op->prio);
+	scan_symbol(LOP_TYPE_OPERATOR, get_loc(), indent, l_text, l_leng);
+	scan_top()->count = 2;
+	scan_top()->tail_indent = l_scan.symbol.indent;
+	scan_seal();
+	return 0;
+}
+
+static int scan_push_token(enum LOP_ASTNodeType t)
+{
+	/* l_push_token() would make the operator list a callee */
+	if (t < LOP_TYPE_LIST_LAST_CALLABLE && scan_top_is_operator() && scan_top()->prio == 0) {
+		return LOP_ERROR_LEXER_MATCHED;
+	}
+
+	return scan_push(t, 0);
+}
+
+static int scan_list_close(enum LOP_ASTNodeType t)
+{
+	if (t == LOP_TYPE_LIST_COLON) {
+		int rc;
+
+		rc = scan_operator_close();
+		if (rc < 0) {
+			return rc;
+		}
+
+		rc = scan_close_vert_colon();
+		if (rc < 0) {
+			return rc;
+		}
+	} else {
+		while (1) {
+			if (scan_top_is_operator()) {
+				int rc = scan_operator_close();
+				if (rc < 0) {
+					return rc;
+				}
+				continue;
+			} else if (scan_top()->type != LOP_TYPE_LIST_COLON) {
+				break;
+			}
+			scan_up();
+			if (l_scan.depth == 0) {
+				return LOP_ERROR_LEXER_UNBALANCED;
+			}
+		}
+	}
+
+	if (scan_top()->type != t) {
+		return LOP_ERROR_LEXER_UNBALANCED;
+	}
+
+	scan_up();
+	if (l_scan.depth == 0) {
+		return LOP_ERROR_LEXER_ROOT_CLOSED;
+	}
+	l_scan.last = SCAN_PASSED;
+
+	newline_was = 0;
+	return 0;
+}
+
+static int scan_newline(void)
+{
+	if (continue_was == 0) {
+		int rc = scan_operator_close();
+		if (rc < 0) {
+			return rc;
+		}
+		scan_seal();
+	}
+
+	indent = 0;
+	set_newline();
+	return 0;
+}
+
+static int scan_comma(void)
+{
+	if (!scan_top_is_operator() && l_scan.last == SCAN_NONE) {
+		int rc;
+
+		rc = scan_push(LOP_TYPE_NIL, 0);
+		if (rc < 0) {
+			return rc;
+		}
+	}
+
+	scan_seal();
+	return scan_operator_close();
+}
+
+static int scan_finish(void)
+{
+	if (l_scan.last == SCAN_SYMBOL && l_scan.symbol.type == LOP_TYPE_STRING) {
+		return LOP_ERROR_LEXER_UNBALANCED;
+	}
+
+	scan_seal();
+	while (l_scan.depth) {
+		if (scan_top_is_operator()) {
+			int rc = scan_operator_close();
+			if (rc < 0) {
+				return rc;
+			}
+			continue;
+		} else if (scan_top()->type != LOP_TYPE_LIST_COLON) {
+			return LOP_ERROR_LEXER_UNBALANCED;
+		}
+		scan_up();
+	}
+
+	scan_pass(LOP_SCAN_END, LOP_TYPE_NIL);
+	return 0;
+}
+
+static int scan_token(enum Token t)
+{
+	switch (t) {
+	case L_DIGIT:
+	case L_FLOAT:
+	case L_BNUMBER:
+		return scan_push_token(LOP_TYPE_NUMBER);
+	case L_ID:
+		return scan_push_token(LOP_TYPE_ID);
+	case L_SQUOTE:
+	case L_DQUOTE:
+	case L_QQUOTE:
+		return scan_str_open();
+	case L_STR_APPEND:
+		return scan_str_append();
+	case L_QUOTE_CLOSE:
+		return scan_str_close();
+	case L_OPERATOR:
+		return scan_operator();
+	case L_LIST_OPEN:
+		return scan_push_token(LOP_TYPE_LIST_ROUND);
+	case L_CLIST_OPEN:
+		return scan_push_token(LOP_TYPE_LIST_CURLY);
+	case L_BLIST_OPEN:
+		return scan_push_token(LOP_TYPE_LIST_SQUARE);
+	case L_TLIST_OPEN:
+		return scan_push_token(LOP_TYPE_LIST_COLON);
+	case L_LIST_CLOSE:
+		return scan_list_close(LOP_TYPE_LIST_ROUND);
+	case L_CLIST_CLOSE:
+		return scan_list_close(LOP_TYPE_LIST_CURLY);
+	case L_BLIST_CLOSE:
+		return scan_list_close(LOP_TYPE_LIST_SQUARE);
+	case L_TLIST_CLOSE:
+		return scan_list_close(LOP_TYPE_LIST_COLON);
+	case L_INDENT:
+		if (newline_was) {
+			indent++;
+		}
+		return 0;
+	case L_NEWLINE:
+		return scan_newline();
+	case L_CONTINUE:
+		continue_was = 1;
+		return 0;
+	case L_COMMA:
+		return scan_comma();
+	case L_STR_CONTINUE:
+	case L_COMMENT:
+	case L_WHITESPACE:
+		return 0;
+	case L_UNKNOWN:
+		return LOP_ERROR_LEXER_UNKNOWN;
+	default:
+		assert(0);
+	}
+
+	return 0;
+}
+
+int LOP_scan_begin(const char *string, size_t len, struct LOP_OperatorTable *operator_table, size_t window, bool thread)
+{
+	yylineno = 1;
+	l_lineno = 1;
+	indent = -1;
+	newline_was = 1;
+	continue_was = 0;
+	l_str_offset = 0;
+	l_line_offset = 0;
+	l_done = false;
+	l_operator_table = operator_table;
+
+	l_scan.depth = 0;
+	l_scan.last = SCAN_NONE;
+	l_scan.count = 0;
+	l_scan.next = 0;
+	l_scan.value_len = 0;
+	scan_open(LOP_TYPE_LIST_COLON, 0, 0);
+	indent = 0;
+
+	return l_begin(string, len, window, thread);
+}
+
+int LOP_scan_next(struct LOP_Scan *s)
+{
+	while (l_scan.next == l_scan.count) {
+		enum Token t;
+		int rc;
+
+		if (l_done) {
+			*s = (struct LOP_Scan) { .what = LOP_SCAN_END };
+			return 0;
+		}
+
+		l_scan.count = 0;
+		l_scan.next = 0;
+		l_scan.value_len = 0;
+
+		t = l_next();
+		if (t) {
+			rc = scan_token(t);
+			l_str_offset += l_leng;
+		} else {
+			rc = scan_finish();
+		}
+
+		l_done = t == 0 || rc < 0;
+		if (rc < 0) {
+			return rc;
+		}
+	}
+
+	*s = l_scan.queue[l_scan.next];
+	if (s->what == LOP_SCAN_SYMBOL) {
+		s->n.symbol.value = l_scan.value_text + l_scan.value[l_scan.next];
+	}
+	l_scan.next++;
+	return 0;
+}
+
+void LOP_scan_end(bool keep)
+{
+	l_end(keep);
+
+	free(l_scan.list);
+	free(l_scan.text);
+	free(l_scan.queue);
+	free(l_scan.value);
+	free(l_scan.value_text);
+	memset(&l_scan, 0, sizeof(l_scan));
 }
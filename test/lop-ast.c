@@ -81,7 +81,7 @@ int main(int argc, char *argv[])
 
 	source = map_file(argv[1]);
 
-	rc = LOP_getAST(&ast, argv[1], source.data, source.len, &ot);
+	rc = LOP_getAST(&ast, argv[1], source.data, source.len, &ot, NULL);
 	LOP_dump_ast(ast);
 	LOP_delAST(ast);
 
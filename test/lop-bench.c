@@ -0,0 +1,186 @@
+#include <assert.h>
+#include <LOP.h>
+#include <regex.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include "FileMap.h"
+
+static double now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#define MAX_CHECKS 8
+
+/* --callback=<name>:<regex>, what a #pattern does in the match done on the handlers instead */
+struct Check {
+	const char *name;
+	int id;
+	regex_t re;
+};
+
+/* The symbols of the delta == 0 handlers which don't match the regex of their callback */
+static int check_handlers(const struct LOP_HandlerList *hl, struct Check *check, int check_count)
+{
+	int failed = 0;
+
+	for (int i = 0; i < hl->count; i++) {
+		int id = LOP_handler_id(hl, i);
+
+		if (LOP_handler_delta(hl, i) != 0) {
+			continue;
+		}
+		for (int j = 0; j < check_count; j++) {
+			if (check[j].id == id) {
+				failed += regexec(&check[j].re, LOP_symbol_value(LOP_handler_node(hl, i)), 0, NULL, 0) != 0;
+			}
+		}
+	}
+
+	return failed;
+}
+
+int main(int argc, char *argv[])
+{
+	struct Check checks[MAX_CHECKS];
+	int check_count = 0;
+	int failed = 0;
+	bool compact = false;
+	bool check = false;
+	bool direct = false;
+	int threads = 0;
+	int iterations = 10;
+	int first = 0;
+	int reallocs = 0;
+	int rc;
+
+	while (argc > 1 && !strncmp(argv[1], "--", 2)) {
+		if (!strcmp(argv[1], "--compact")) {
+			compact = true;
+		} else if (!strcmp(argv[1], "--check")) {
+			/* LOP_validate() instead of LOP_init() */
+			check = true;
+		} else if (!strcmp(argv[1], "--direct")) {
+			/* LOP.direct, the tokens matched without the AST where the schema allows */
+			direct = true;
+		} else if (!strncmp(argv[1], "--threads=", 10)) {
+			threads = atoi(argv[1] + 10);
+		} else if (!strncmp(argv[1], "--callback=", 11) && strchr(argv[1], ':') && check_count < MAX_CHECKS) {
+			char *name = strdup(argv[1] + 11);
+			char *colon = strchr(name, ':');
+			char re[256];
+
+			assert(name);
+			*colon = 0;
+			/* Anchored as #pattern is */
+			snprintf(re, sizeof(re), "^(%s)$", colon + 1);
+			if (regcomp(&checks[check_count].re, re, REG_EXTENDED | REG_NOSUB)) {
+				fprintf(stderr, "Bad regex '%s'\n", colon + 1);
+				return -1;
+			}
+			checks[check_count++].name = name;
+		} else {
+			fprintf(stderr, "Unknown option '%s'\n", argv[1]);
+			return -1;
+		}
+		argc--;
+		argv++;
+	}
+
+	if (argc < 4) {
+		fprintf(stderr, "Usage: %s [--compact] [--check] [--direct] [--threads=<n>] [--callback=<name>:<regex>]... <schema-file> <top-rule-name> <source-file> [<iterations>]\n", argv[0]);
+		return -1;
+	}
+	if (argc > 4) {
+		iterations = atoi(argv[4]);
+	}
+
+	struct LOP_Schema schema = {
+		.filename = argv[1],
+	};
+
+	struct FileMap schema_str = map_file(argv[1]);
+	assert(schema_str.fd >= 0);
+	rc = LOP_schema_init(&schema, schema_str.data, schema_str.len);
+	unmap_file(schema_str);
+
+	if (rc < 0) {
+		fprintf(stderr, "User schema parsing error\n");
+		goto out;
+	}
+
+	for (int i = 0; i < check_count; i++) {
+		checks[i].id = -1;
+		for (int j = 0; j < schema.callback_table.size; j++) {
+			if (!strcmp(schema.callback_table.data[j].name, checks[i].name)) {
+				checks[i].id = j;
+			}
+		}
+	}
+
+	struct FileMap source = map_file(argv[3]);
+	assert(source.fd >= 0);
+
+	/* The handler buffer survives between the parses */
+	struct LOP lop = {
+		.schema = &schema,
+		.top_rule_name = argv[2],
+		.filename = argv[3],
+		.keep_handlers = true,
+		.compact = compact,
+		.threads = threads,
+		.direct = direct,
+	};
+	double start = now();
+
+	for (int i = 0; i < iterations && rc == 0; i++) {
+		if (check) {
+			rc = LOP_validate(&lop, source.data, source.len);
+			continue;
+		}
+
+		rc = LOP_init(&lop, source.data, source.len);
+		if (rc == 0 && check_count) {
+			failed = check_handlers(&lop.hl, checks, check_count);
+		}
+		if (i == 0) {
+			first = lop.hl.reallocs;
+		}
+		reallocs += lop.hl.reallocs;
+		if (i < iterations - 1) {
+			LOP_deinit(&lop);
+		}
+	}
+
+	double elapsed = now() - start;
+
+	if (rc < 0) {
+		fprintf(stderr, "Parsing error\n");
+	} else {
+		size_t size = lop.hl.capacity * (compact ? sizeof(*lop.hl.compact_handler) : sizeof(*lop.hl.handler)) +
+			      lop.hl.node_capacity * sizeof(*lop.hl.node) +
+			      (compact ? lop.hl.capacity * sizeof(*lop.hl.close) : 0);
+
+		printf("%s: %d parses, %.0f us/parse, %d handlers (capacity %d, %zu KiB), reallocs: %d first, %d total%s\n",
+		       argv[3], iterations, elapsed * 1e6 / iterations, lop.hl.count, lop.hl.capacity, size / 1024,
+		       first, reallocs, lop.scanned ? ", without the AST" : "");
+		if (check_count) {
+			printf("%d handlers failed the --callback checks\n", failed);
+		}
+	}
+
+	lop.keep_handlers = false;
+	LOP_deinit(&lop);
+	unmap_file(source);
+out:
+	for (int i = 0; i < check_count; i++) {
+		regfree(&checks[i].re);
+		free((char *)checks[i].name);
+	}
+	LOP_schema_deinit(&schema);
+	return rc < 0;
+}
@@ -1,51 +1,520 @@
 #include <assert.h>
 #include <LOP.h>
+#include <pthread.h>
+#include <stdlib.h>
 #include <string.h>
+#include <time.h>
 #include "FileMap.h"
 
-static int cb_dummy(struct LOP_Handler *h)
-{
-	static int delta;
+/* Where the handlers are printed, with the depth they are at */
+struct Printer {
+	FILE *f;
+	int delta;
+	char *buf;
+	size_t len;
+};
 
+static int print_handler(struct Printer *p, struct LOP_Handler *h)
+{
 	if (h->delta < 0) {
-		delta += h->delta;
+		p->delta += h->delta;
 	}
 
-	for (int i = 0; i < delta; i++) {
-		printf("\t");
+	for (int i = 0; i < p->delta; i++) {
+		fprintf(p->f, "\t");
 	}
 
 	if (h->delta == 1) {
-		printf("+%s\n", h->key);
+		fprintf(p->f, "+%s\n", h->key);
 	} else if (h->delta == 0) {
-		if (h->n->type > LOP_TYPE_LIST_LAST) {
-			printf("=%s(%s)\n", h->key, LOP_symbol_value(h->n));
+		/* The member of #set follows, unless it's the first one, and a #lazy list is left as ~ */
+		if (h->n->type < LOP_TYPE_LIST_LAST) {
+			fprintf(p->f, "~%s\n", h->key);
+		} else if (h->n->type > LOP_TYPE_LIST_LAST && h->member) {
+			fprintf(p->f, "=%s(%s)[%d]\n", h->key, LOP_symbol_value(h->n), h->member);
+		} else if (h->n->type > LOP_TYPE_LIST_LAST) {
+			fprintf(p->f, "=%s(%s)\n", h->key, LOP_symbol_value(h->n));
 		}
 	} else {
-		printf("-%s\n", h->key);
+		fprintf(p->f, "-%s\n", h->key);
 	}
 
 	if (h->delta > 0) {
-		delta += h->delta;
+		p->delta += h->delta;
 	}
 	return 0;
 }
 
-int main(int argc, char *argv[])
+static int cb_dummy(struct LOP_Handler *h)
 {
-	struct LOP_Schema schema = {
-		.filename = argv[1],
+	static struct Printer p;
+
+	p.f = stdout;
+	return print_handler(&p, h);
+}
+
+static int dispatch_handler(void *ctx, const struct LOP_HandlerList *hl, int i)
+{
+	struct LOP_Handler h = LOP_handler(hl, i);
+
+	return print_handler(ctx, &h);
+}
+
+/* Every task prints into a buffer of its own */
+static void *task_begin(void *arg, const struct LOP_HandlerList *hl, int i, int depth)
+{
+	struct Printer *p = calloc(1, sizeof(*p));
+
+	assert(p);
+	p->f = open_memstream(&p->buf, &p->len);
+	assert(p->f);
+	p->delta = depth;
+	return p;
+}
+
+static int task_merge(void *arg, void *ctx, int rc)
+{
+	struct Printer *p = ctx;
+
+	fclose(p->f);
+	fwrite(p->buf, 1, p->len, ((struct Printer *)arg)->f);
+	free(p->buf);
+	free(p);
+	return rc;
+}
+
+/* Streamed items are printed as soon as they match, before the rest of the list */
+static int print_item(void *arg, const struct LOP_HandlerList *hl, int depth)
+{
+	struct Printer p = {
+		.f = stdout,
+		.delta = depth,
 	};
+
+	for (int i = 0; i < hl->count; i++) {
+		struct LOP_Handler h = LOP_handler(hl, i);
+
+		print_handler(&p, &h);
+	}
+	return 0;
+}
+
+/* The #lazy lists inside are forced too */
+static int print_forced(struct LOP *lop, struct LOP_Handler *h)
+{
+	struct LOP_HandlerList hl = {};
 	int rc;
 
-	if (argc < 4) {
-		fprintf(stderr, "Usage: %s <schema-file> <top-rule-name> <source-file> ...\n", argv[0]);
+	if (h->delta != 0 || h->n->type > LOP_TYPE_LIST_LAST) {
+		return cb_dummy(h);
+	}
+
+	rc = LOP_force(lop, h, &hl);
+	for (int i = 0; i < hl.count && rc == 0; i++) {
+		struct LOP_Handler in = LOP_handler(&hl, i);
+
+		rc = print_forced(lop, &in);
+	}
+	LOP_force_deinit(&hl);
+	return rc;
+}
+
+struct Parse {
+	struct LOP_Schema *schema;
+	const char *top_rule_name;
+	const char *filename;
+	bool compact;
+	bool check;
+	bool stream;
+	/* LOP_force() the #lazy lists as they are printed */
+	bool force;
+	/* LOP_init_file() with this window, if set */
+	size_t window;
+	int threads;
+	/* Match the tokens without the AST where the schema allows */
+	bool direct;
+	/* Dispatch with the subtrees of these callbacks printed by the threads */
+	const char **tasks;
+	struct LOP_Profile *profile;
+	/* The budget of a match, LOP_resume() after it runs out if resume is set */
+	uint64_t max_steps;
+	int timeout_ms;
+	bool resume;
+	struct LOP_Limits limits;
+	int rc;
+};
+
+static uint64_t deadline(int timeout_ms)
+{
+	struct timespec ts;
+
+	if (!timeout_ms) {
+		return 0;
+	}
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000000ull + ts.tv_nsec + timeout_ms * 1000000ull;
+}
+
+static int resume(struct Parse *p, struct LOP *lop, int rc)
+{
+	while (rc == LOP_ERROR_BUDGET && p->resume && lop->suspended) {
+		lop->deadline = deadline(p->timeout_ms);
+		rc = LOP_resume(lop);
+	}
+
+	if (rc == LOP_ERROR_BUDGET) {
+		fprintf(stderr, "%s:%d:%d: match stopped by the budget after %llu steps\n", p->filename,
+			lop->error.lineno, lop->error.charno + 1, (unsigned long long)lop->steps);
+	}
+	return rc;
+}
+
+#ifdef LOP_SCHEMA_GEN
+/* The matcher compiled from the schema by lop-gen with the prefix gen, see Makefile */
+int gen_init(struct LOP *lop, const char *src, size_t len);
+
+#define LOP_init gen_init
+#endif
+
+static void *parse(void *arg)
+{
+	struct Parse *p = arg;
+	struct LOP lop = {
+		.schema = p->schema,
+		.top_rule_name = p->top_rule_name,
+		.filename = p->filename,
+		.compact = p->compact,
+		.threads = p->threads,
+		.item = p->stream ? print_item : NULL,
+		.free_items = p->stream,
+		.window = p->window,
+		.profile = p->profile,
+		.max_steps = p->max_steps,
+		.deadline = deadline(p->timeout_ms),
+		.limits = p->limits,
+		.direct = p->direct,
+	};
+	struct FileMap source = {};
+
+	if (!p->window) {
+		source = map_file(p->filename);
+		assert(source.fd >= 0);
+	}
+
+	if (p->check) {
+		if (p->window) {
+			p->rc = resume(p, &lop, LOP_validate_file(&lop));
+		} else {
+			p->rc = resume(p, &lop, LOP_validate(&lop, source.data, source.len));
+			LOP_deinit(&lop);
+			unmap_file(source);
+		}
+
+		if (p->rc < 0) {
+			printf("%s:%d:%d: error\n", p->filename, lop.error.lineno, lop.error.charno + 1);
+		} else {
+			printf("%s: ok\n", p->filename);
+		}
+		return NULL;
+	}
+
+	if (p->window) {
+		p->rc = resume(p, &lop, LOP_init_file(&lop));
+	} else {
+		p->rc = resume(p, &lop, LOP_init(&lop, source.data, source.len));
+		unmap_file(source);
+	}
+
+	struct LOP_HandlerList *hl = &lop.hl;
+
+	if (p->tasks && p->rc == 0) {
+		struct Printer out = {
+			.f = stdout,
+		};
+		struct LOP_Dispatch d = {
+			.handler = dispatch_handler,
+			.task = p->tasks,
+			.arg = &out,
+			.threads = p->threads,
+			.task_begin = task_begin,
+			.task_merge = task_merge,
+		};
+
+		p->rc = LOP_dispatch(hl, &d);
+		LOP_deinit(&lop);
+		return NULL;
+	}
+
+	/* The handlers matched before the budget has stopped it aren't the whole file */
+	for (int i = 0; i < hl->count && p->rc != LOP_ERROR_BUDGET; i++) {
+		struct LOP_Handler h = LOP_handler(hl, i);
+
+		if (!p->force) {
+			cb_dummy(&h);
+		} else if ((p->rc = print_forced(&lop, &h)) < 0) {
+			break;
+		}
+	}
+
+	LOP_deinit(&lop);
+	return NULL;
+}
+
+/* One of several top rules matched against a shared AST */
+struct Match {
+	const struct LOP_AST *ast;
+	struct LOP lop;
+	int rc;
+};
+
+static void *match(void *arg)
+{
+	struct Match *m = arg;
+
+	m->rc = LOP_match(&m->lop, m->ast);
+	return NULL;
+}
+
+/* The file is parsed once, and every top rule is matched against the same AST,
+ * concurrently if threads are asked */
+static int parse_once(struct LOP_Schema *schema, char *tops, const char *filename, bool compact, bool thread, int threads)
+{
+	struct LOP_AST ast = {
+		.schema = schema,
+		.filename = filename,
+	};
+	struct FileMap source = map_file(filename);
+	struct Match m[16];
+	pthread_t t[16];
+	int count = 0;
+	int rc;
+
+	assert(source.fd >= 0);
+
+	rc = LOP_parse(&ast, source.data, source.len);
+	if (rc < 0) {
+		unmap_file(source);
+		return rc;
+	}
+
+	for (char *top = strtok(tops, ","); top && count < 16; top = strtok(NULL, ",")) {
+		m[count++] = (struct Match) {
+			.ast = &ast,
+			.lop = {
+				.schema = schema,
+				.top_rule_name = top,
+				.compact = compact,
+				.threads = threads,
+			},
+		};
+	}
+
+	for (int i = 0; i < count; i++) {
+		if (thread) {
+			rc = pthread_create(&t[i], NULL, match, &m[i]);
+			assert(rc == 0);
+		} else {
+			match(&m[i]);
+		}
+	}
+
+	for (int i = 0; i < count; i++) {
+		struct LOP_HandlerList *hl = &m[i].lop.hl;
+
+		if (thread) {
+			pthread_join(t[i], NULL);
+		}
+
+		printf("# %s\n", m[i].lop.top_rule_name);
+		for (int j = 0; j < hl->count; j++) {
+			struct LOP_Handler h = LOP_handler(hl, j);
+
+			cb_dummy(&h);
+		}
+
+		if (m[i].rc < 0) {
+			rc = m[i].rc;
+		}
+		LOP_deinit(&m[i].lop);
+	}
+
+	LOP_parse_deinit(&ast);
+	unmap_file(source);
+	return rc;
+}
+
+static void print_finding(void *arg, const struct LOP_LintFinding *f)
+{
+	static const char *severity[] = { "low", "medium", "high" };
+
+	printf("%s:%d:%d: %s: %s [%s]\n", (const char *)arg, f->loc.lineno, f->loc.charno + 1,
+	       severity[f->severity], f->message, f->rule);
+}
+
+static const struct LOP_ProfileNode *by_time;
+
+static int cmp_time(const void *a, const void *b)
+{
+	const struct LOP_ProfileNode *x = &by_time[*(const int *)a];
+	const struct LOP_ProfileNode *y = &by_time[*(const int *)b];
+
+	if (x->ns != y->ns) {
+		return x->ns < y->ns ? 1 : -1;
+	}
+	return *(const int *)a - *(const int *)b;
+}
+
+/* The hottest rules, and then the hottest SNs: the alternatives worth reordering */
+static void print_profile(const struct LOP_Profile *p, FILE *f)
+{
+	int *order = calloc(p->count + 1, sizeof(*order));
+	int top = 20;
+
+	assert(order);
+	for (int i = 0; i < p->count; i++) {
+		order[i] = i;
+	}
+	by_time = p->node;
+	qsort(order, p->count, sizeof(*order), cmp_time);
+
+	for (int rules = 1; rules >= 0; rules--) {
+		int shown = 0;
+
+		fprintf(f, "%10s %10s %10s %10s %10s %5s  %s\n", "ms", "attempts", "successes", "failures",
+			"rollbacks", "depth", rules ? "rule" : "SN");
+		for (int i = 0; i < p->count && shown < top; i++) {
+			const struct LOP_ProfileNode *n = &p->node[order[i]];
+
+			if (n->rule != rules || n->attempts == 0) {
+				continue;
+			}
+			fprintf(f, "%10.3f %10llu %10llu %10llu %10llu %5d  %s\n", n->ns / 1e6,
+				(unsigned long long)n->attempts, (unsigned long long)n->successes,
+				(unsigned long long)n->failures, (unsigned long long)n->rollbacks,
+				n->max_depth, n->path);
+			shown++;
+		}
+		if (rules) {
+			fprintf(f, "\n");
+		}
+	}
+	free(order);
+}
+
+int main(int argc, char *argv[])
+{
+	const char *cache = NULL;
+	bool thread = false;
+	bool compact = false;
+	bool check = false;
+	bool stream = false;
+	size_t window = 0;
+	int threads = 0;
+	const char *tasks[16] = {};
+	bool profile = false;
+	const char *profile_file = NULL;
+	struct LOP_Profile prof = {};
+	bool lint = false;
+	uint64_t max_steps = 0;
+	int timeout_ms = 0;
+	bool resume = false;
+	bool force = false;
+	bool direct = false;
+	struct LOP_Limits limits = {};
+	int failed = 0;
+	int rc;
+
+	while (argc > 1 && !strncmp(argv[1], "--", 2)) {
+		if (!strncmp(argv[1], "--cache=", 8)) {
+			cache = argv[1] + 8;
+		} else if (!strcmp(argv[1], "--thread")) {
+			/* Match on a thread with the default stack size */
+			thread = true;
+		} else if (!strncmp(argv[1], "--threads=", 10)) {
+			/* Match the items of a long listof in parallel */
+			threads = atoi(argv[1] + 10);
+		} else if (!strncmp(argv[1], "--tasks=", 8)) {
+			/* LOP_dispatch() on --threads with a task per subtree of the callbacks */
+			int count = 0;
+
+			for (char *cb = strtok(argv[1] + 8, ","); cb && count < 15; cb = strtok(NULL, ",")) {
+				tasks[count++] = cb;
+			}
+		} else if (!strcmp(argv[1], "--compact")) {
+			compact = true;
+		} else if (!strcmp(argv[1], "--check")) {
+			/* Only tell which files conform to the schema */
+			check = true;
+		} else if (!strncmp(argv[1], "--window=", 9)) {
+			/* Read the file in windows of this size as the match goes */
+			window = atol(argv[1] + 9);
+		} else if (!strcmp(argv[1], "--stream")) {
+			/* Print the items of the top listof as they match, and free them */
+			stream = true;
+		} else if (!strcmp(argv[1], "--direct")) {
+			/* Match the tokens as they are scanned where the schema allows */
+			direct = true;
+		} else if (!strcmp(argv[1], "--force")) {
+			/* Match and print the #lazy lists too */
+			force = true;
+		} else if (!strncmp(argv[1], "--max-steps=", 12)) {
+			/* Stop the match after this many SNs */
+			max_steps = atoll(argv[1] + 12);
+		} else if (!strncmp(argv[1], "--timeout=", 10)) {
+			/* Stop the match after this many milliseconds */
+			timeout_ms = atoi(argv[1] + 10);
+		} else if (!strcmp(argv[1], "--resume")) {
+			/* Resume the stopped match with a new budget, until it's done */
+			resume = true;
+		} else if (!strncmp(argv[1], "--max-depth=", 12)) {
+			/* The limits of the parse of a hostile file */
+			limits.max_depth = atoi(argv[1] + 12);
+		} else if (!strncmp(argv[1], "--max-nodes=", 12)) {
+			limits.max_nodes = atol(argv[1] + 12);
+		} else if (!strncmp(argv[1], "--max-symbol=", 13)) {
+			limits.max_symbol = atol(argv[1] + 13);
+		} else if (!strncmp(argv[1], "--max-bytes=", 12)) {
+			limits.max_bytes = atol(argv[1] + 12);
+		} else if (!strcmp(argv[1], "--lint")) {
+			/* Only report the hazards of the schema, fail on the high severity ones */
+			lint = true;
+		} else if (!strcmp(argv[1], "--profile")) {
+			/* Print the hottest rules and SNs of the matches to stderr */
+			profile = true;
+		} else if (!strncmp(argv[1], "--profile=", 10)) {
+			/* And dump the whole profile into the file */
+			profile = true;
+			profile_file = argv[1] + 10;
+		} else {
+			fprintf(stderr, "Unknown option '%s'\n", argv[1]);
+			return -1;
+		}
+		argc--;
+		argv++;
+	}
+
+	if (argc < (lint ? 2 : 4)) {
+		fprintf(stderr, "Usage: %s --lint <schema-file>\n", argv[0]);
+		fprintf(stderr, "Usage: %s [--cache=<file>] [--thread] [--threads=<n>] [--tasks=<callback>[,<callback>...]] [--compact] [--check] [--stream] [--direct] [--force] [--window=<bytes>] [--profile[=<file>]] [--max-steps=<n>] [--timeout=<ms>] [--resume] [--max-depth=<n>] [--max-nodes=<n>] [--max-symbol=<bytes>] [--max-bytes=<bytes>] <schema-file> <top-rule-name>[,<top-rule-name>...] <source-file> ...\n", argv[0]);
 		return -1;
 	}
 
+	struct LOP_Schema schema = {
+		.filename = argv[1],
+	};
+
 	struct FileMap schema_str = map_file(argv[1]);
 	assert(schema_str.fd >= 0);
-	rc = LOP_schema_init(&schema, schema_str.data, schema_str.len);
+	rc = -1;
+	if (cache) {
+		rc = LOP_schema_load(&schema, cache, schema_str.data, schema_str.len);
+	}
+	if (rc < 0) {
+		rc = LOP_schema_init(&schema, schema_str.data, schema_str.len);
+		if (rc == 0 && cache) {
+			LOP_schema_save(&schema, cache, schema_str.data, schema_str.len);
+		}
+	}
 	unmap_file(schema_str);
 
 	if (rc < 0) {
@@ -53,28 +522,63 @@ int main(int argc, char *argv[])
 		goto out;
 	}
 
+	if (lint) {
+		rc = LOP_schema_lint(&schema, print_finding, argv[1]) ? -1 : 0;
+		goto out;
+	}
+
+	if (profile) {
+		LOP_profile_init(&prof, &schema);
+	}
+
 	for (int i = 3; i < argc; i++) {
-		struct LOP lop = {
+		struct Parse p = {
 			.schema = &schema,
 			.top_rule_name = argv[2],
 			.filename = argv[i],
+			.compact = compact,
+			.check = check,
+			.stream = stream,
+			.force = force,
+			.window = window,
+			.threads = threads,
+			.tasks = tasks[0] ? tasks : NULL,
+			.profile = profile ? &prof : NULL,
+			.max_steps = max_steps,
+			.timeout_ms = timeout_ms,
+			.resume = resume,
+			.limits = limits,
+			.direct = direct,
 		};
-		struct FileMap source = map_file(argv[i]);
-
-		assert(source.fd >= 0);
 
-		rc = LOP_init(&lop, source.data, source.len);
-		unmap_file(source);
+		if (strchr(argv[2], ',') && !check) {
+			char tops[256];
 
-		struct LOP_HandlerList *hl = &lop.hl;
+			snprintf(tops, sizeof(tops), "%s", argv[2]);
+			rc = parse_once(&schema, tops, argv[i], compact, thread, threads);
+			if (rc < 0) {
+				fprintf(stderr, "Parsing error\n");
+				break;
+			}
+			continue;
+		}
 
-		for (int i = 0; i < hl->count; i++) {
-			struct LOP_Handler *h = &hl->handler[i];
+		if (thread) {
+			pthread_t t;
 
-			cb_dummy(h);
+			rc = pthread_create(&t, NULL, parse, &p);
+			assert(rc == 0);
+			pthread_join(t, NULL);
+		} else {
+			parse(&p);
 		}
+		rc = p.rc;
 
-		LOP_deinit(&lop);
+		if (check) {
+			failed += rc < 0;
+			rc = failed ? -1 : 0;
+			continue;
+		}
 
 		if (rc < 0) {
 			fprintf(stderr, "Parsing error\n");
@@ -82,7 +586,22 @@ int main(int argc, char *argv[])
 		}
 	}
 
+	if (profile) {
+		print_profile(&prof, stderr);
+		if (profile_file) {
+			FILE *f = fopen(profile_file, "w");
+
+			if (f) {
+				LOP_profile_dump(&prof, f);
+				fclose(f);
+			} else {
+				perror(profile_file);
+			}
+		}
+		LOP_profile_deinit(&prof);
+	}
+
 out:
 	LOP_schema_deinit(&schema);
-	return 0;
+	return rc < 0;
 }
@@ -0,0 +1,51 @@
+#include <assert.h>
+#include <stdio.h>
+
+#include <LOP.h>
+#include "FileMap.h"
+
+int main(int argc, char *argv[])
+{
+	FILE *out = stdout;
+	int rc;
+
+	if (argc < 3) {
+		fprintf(stderr, "Usage: %s <schema-file> <prefix> [<output-file>]\n", argv[0]);
+		return -1;
+	}
+
+	struct LOP_Schema schema = {
+		.filename = argv[1],
+	};
+
+	struct FileMap schema_str = map_file(argv[1]);
+	if (schema_str.fd < 0) {
+		return -1;
+	}
+	rc = LOP_schema_init(&schema, schema_str.data, schema_str.len);
+	unmap_file(schema_str);
+
+	if (rc < 0) {
+		fprintf(stderr, "User schema parsing error\n");
+		goto out;
+	}
+
+	if (argc > 3) {
+		out = fopen(argv[3], "w");
+		if (out == NULL) {
+			perror("fopen");
+			rc = -1;
+			goto out;
+		}
+	}
+
+	rc = LOP_schema_gen(&schema, out, argv[2]);
+
+	if (out != stdout) {
+		fclose(out);
+	}
+
+out:
+	LOP_schema_deinit(&schema);
+	return rc < 0 ? 1 : 0;
+}